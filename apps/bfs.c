@@ -27,15 +27,53 @@ struct file_server_state {
 	 */
 	struct file_control_block *fcb_cache;
 	unsigned int num_fcbs;		// corresponds to underlying #inodes
+
+	/* Writes only update the size and modification time of a file in
+	 * fcb_cache.  The blocks of i-node 0 holding such FCBs are marked
+	 * dirty and written on FILE_SYNC, or after FCB_MAX_DEFERRED writes.
+	 */
+	bool *fcb_dirty;			// per block of i-node 0
+	unsigned int fcb_deferred;	// #writes since the last flush
 };
 
+#define FCB_MAX_DEFERRED	64
+
+/* Read-ahead.  The server tracks streams of reads by a client of a file.
+ * When a read starts where the previous one of the stream ended, the
+ * blocks that follow are read along with it into the buffer of the
+ * stream, so that the next reads can be served from memory.  The window
+ * doubles on every sequential refill, up to ra_max blocks.
+ */
+#define BFS_STREAMS		16		// #streams tracked
+#define BFS_RA_MIN		4		// initial read-ahead window (#blocks)
+#define BFS_RA_MAX		64		// default maximum window (#blocks)
+
+struct bfs_stream {
+	unsigned int file_no;		// 0 if unused
+	gpid_t client;
+	unsigned long next_block;	// block after the last one read
+	unsigned int window;		// current read-ahead window
+	unsigned long buf_start;	// first block in buffer
+	unsigned int buf_nblocks;	// #blocks in buffer
+	char *buf;					// ra_max blocks
+	unsigned long last_used;	// for LRU replacement
+};
+
+static struct bfs_stream bfs_streams[BFS_STREAMS];
+static unsigned int bfs_ra_max = BFS_RA_MAX;
+static unsigned long bfs_clock;	// to order uses of streams
+
 // file_control_block is 16 bytes
 #define STATS_PER_BLOCK      (BLOCK_SIZE / sizeof(struct file_control_block))
 
 // these helper functions are declared here and defined later
 static void flush_fcb_cache(struct file_server_state *, unsigned int file_no);
+static bool flush_fcb_dirty(struct file_server_state *);
+static void mark_fcb_dirty(struct file_server_state *, unsigned int file_no);
 static void flush_stat_cache_all(struct file_server_state *);
 static bool load_fcb_cache(struct file_server_state *);
+static struct bfs_stream *stream_find(unsigned int file_no, gpid_t client);
+static void stream_invalidate(unsigned int file_no);
 static void blkfile_do_create(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_delete(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_chown(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
@@ -45,6 +83,7 @@ static void blkfile_do_write(struct file_server_state *, struct file_request *re
 static void blkfile_do_sync(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_stat(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_do_setsize(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
+static void blkfile_do_maxmsg(struct file_server_state *, struct file_request *req, gpid_t src, unsigned int uid);
 static void blkfile_respond(struct file_request *req, enum file_status status,
                 void *data, unsigned int size, gpid_t src);
 static bool blkfile_read_allowed(struct file_control_block *stat, unsigned int uid);
@@ -53,28 +92,12 @@ static bool blkfile_write_allowed(struct file_control_block *stat, unsigned int
 /* Reads several contiguous blocks from a block server, starting at a specific
  * inode number and offset. The data will be placed in the buffer pointed to by 
  * addr, assuming it is at least *p_nblocks * BLOCK_SIZE long. Updates *p_nblocks
- * to equal the number of blocks actually read.
+ * to equal the number of blocks actually read.  The blocks are transferred
+ * in as few block server RPCs as possible.
  */
 bool multiblock_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr, unsigned int *p_nblocks){
-	unsigned int nblocks = *p_nblocks;
-	unsigned int i;
-
-	for (i = 0; i < nblocks; i++) {
-// printf("BFS R %u %u\n", ino, offset);
-		bool r = block_read(svr, ino, offset, addr);
-		if (!r) {
-			if (i == 0) {
-				return false;
-			}
-			else {
-				break;
-			}
-		}
-		offset++;
-		addr = (char *) addr + BLOCK_SIZE;
-	}
-	*p_nblocks = i;
-	return true;
+// printf("BFS R %u %u %u\n", ino, offset, *p_nblocks);
+	return block_readv(svr, ino, offset, addr, p_nblocks);
 }
 
 /* Writes several contiguous blocks to a block server, starting at the given 
@@ -82,18 +105,8 @@ bool multiblock_read(gpid_t svr, unsigned int ino, unsigned int offset, void *ad
  * addr, assuming it is at least nblocks * BLOCK_SIZE long.
  */
 bool multiblock_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr, unsigned int nblocks){
-	unsigned int i;
-
-	for (i = 0; i < nblocks; i++) {
-// printf("BFS W %u %u\n", ino, offset);
-		bool r = block_write(svr, ino, offset, addr);
-		if (!r) {
-			return false;
-		}
-		offset++;
-		addr = (char *) addr + BLOCK_SIZE;
-	}
-	return true;
+// printf("BFS W %u %u %u\n", ino, offset, nblocks);
+	return block_writev(svr, ino, offset, addr, nblocks);
 }
 
 /* A file server based on block server. Each file corresponds to an inode in the block server
@@ -113,13 +126,14 @@ static void blkfile_proc(void *arg){
     }
 
     struct file_request *req =
-		calloc(1, sizeof(struct file_request) + FILE_MAX_MSG_SIZE);
+		calloc(1, sizeof(struct file_request) + FILE_MAX_BULK_SIZE);
     for (;;) {
         gpid_t src;
 		unsigned int uid;
-        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + FILE_MAX_MSG_SIZE, &src, &uid);
+        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + FILE_MAX_BULK_SIZE, &src, &uid);
 		if (req_size < 0) {
 			printf("block file server terminated\n\r");
+			flush_fcb_dirty(fss);
 			free(req);
 			free(fss);
 			break;
@@ -162,6 +176,9 @@ static void blkfile_proc(void *arg){
             //fprintf(stderr, "!!DEBUG: calling blkfile create\n");
             blkfile_do_setsize(fss, req, src, uid);
             break;
+        case FILE_MAXMSG:
+            blkfile_do_maxmsg(fss, req, src, uid);
+            break;
         default:
             assert(0);
         }
@@ -171,6 +188,13 @@ static void blkfile_proc(void *arg){
 int main(int argc, char **argv){
 	gpid_t block_server = argc > 1 ? (gpid_t) atoi(argv[1]) : GRASS_ENV->servers[GPID_BLOCK];
 
+	/* The second argument, if any, is the maximum read-ahead window
+	 * in blocks (0 disables read-ahead).
+	 */
+	if (argc > 2) {
+		bfs_ra_max = atoi(argv[2]);
+	}
+
 	/* See how many inodes the underlying block server has.
 	 * Note that this file server maintain one file control block for
 	 * each underlying i-node.
@@ -191,6 +215,8 @@ int main(int argc, char **argv){
 	fss->start_time = sys_gettime();
 	fss->num_fcbs = ninodes;
 	fss->fcb_cache = calloc(ninodes, sizeof(*fss->fcb_cache));
+	fss->fcb_dirty = calloc((ninodes * sizeof(*fss->fcb_cache) - 1) / BLOCK_SIZE + 1,
+										sizeof(*fss->fcb_dirty));
 
     blkfile_proc(fss);
 	return 0;
@@ -256,6 +282,7 @@ static void blkfile_do_delete(struct file_server_state *fss, struct file_request
         // delete the file
         fss->fcb_cache[req->file_no].st_alloc = false;
         flush_fcb_cache(fss, req->file_no);
+        stream_invalidate(req->file_no);
 
         if (!block_setsize(fss->block_svr, req->file_no, 0)) {
             printf("blkfile_do_delete: bad size %u\n", req->file_no);
@@ -319,6 +346,105 @@ static void blkfile_do_chmod(struct file_server_state *fss, struct file_request
 }
 
 
+/* Find the read stream of the given client and file, creating one
+ * (replacing the least recently used one) if there is none.
+ */
+static struct bfs_stream *stream_find(unsigned int file_no, gpid_t client){
+	struct bfs_stream *bs, *lru = &bfs_streams[0];
+
+	for (bs = bfs_streams; bs < &bfs_streams[BFS_STREAMS]; bs++) {
+		if (bs->file_no == file_no && bs->client == client) {
+			bs->last_used = ++bfs_clock;
+			return bs;
+		}
+		if (bs->last_used < lru->last_used) {
+			lru = bs;
+		}
+	}
+	lru->file_no = file_no;
+	lru->client = client;
+	lru->next_block = (unsigned long) -1;
+	lru->window = 0;
+	lru->buf_nblocks = 0;
+	lru->last_used = ++bfs_clock;
+	return lru;
+}
+
+/* Drop the buffered blocks of the given file, which is being modified.
+ */
+static void stream_invalidate(unsigned int file_no){
+	struct bfs_stream *bs;
+
+	for (bs = bfs_streams; bs < &bfs_streams[BFS_STREAMS]; bs++) {
+		if (bs->file_no == file_no) {
+			bs->buf_nblocks = 0;
+		}
+	}
+}
+
+/* Get nblocks blocks of a file for a client, starting at block start.
+ * file_nblocks is the number of blocks in the file.  Blocks are served
+ * from the buffer of the client's stream if possible.  Otherwise they
+ * are read from the block server, together with a read-ahead window if
+ * the access is sequential.
+ */
+static bool blkfile_get_blocks(struct file_server_state *fss, unsigned int file_no,
+			gpid_t client, unsigned long start, unsigned int nblocks,
+			unsigned long file_nblocks, char *contents){
+	struct bfs_stream *bs = stream_find(file_no, client);
+	bool sequential = start == bs->next_block;
+	bs->next_block = start + nblocks;
+
+	if (start >= bs->buf_start && start + nblocks <= bs->buf_start + bs->buf_nblocks) {
+		memcpy(contents, &bs->buf[(start - bs->buf_start) * BLOCK_SIZE],
+										nblocks * BLOCK_SIZE);
+		return true;
+	}
+
+	/* Without a sequential pattern (or room for it), just read the blocks.
+	 */
+	unsigned long end = start + nblocks + (bs->window < BFS_RA_MIN ? BFS_RA_MIN : 2 * bs->window);
+	if (end > file_nblocks) {
+		end = file_nblocks;
+	}
+	if (!sequential || bfs_ra_max == 0 || end - start <= nblocks) {
+		unsigned int n = nblocks;
+		if (!sequential) {
+			bs->window = 0;
+		}
+		return multiblock_read(fss->block_svr, file_no, start, contents, &n) && n == nblocks;
+	}
+
+	/* Read the requested blocks and the window that follows at once.
+	 */
+	bs->window = bs->window < BFS_RA_MIN ? BFS_RA_MIN : 2 * bs->window;
+	if (bs->window > bfs_ra_max) {
+		bs->window = bfs_ra_max;
+	}
+	if (end > start + nblocks + bs->window) {
+		end = start + nblocks + bs->window;
+	}
+	unsigned int n = end - start;
+	if (bs->buf == 0) {
+		bs->buf = malloc(bfs_ra_max * BLOCK_SIZE);
+	}
+	if (n > bfs_ra_max) {
+		/* The request alone fills the buffer; don't keep anything.
+		 */
+		n = nblocks;
+		bs->buf_nblocks = 0;
+		return multiblock_read(fss->block_svr, file_no, start, contents, &n) && n == nblocks;
+	}
+	if (!multiblock_read(fss->block_svr, file_no, start, bs->buf, &n) || n < nblocks) {
+		bs->buf_nblocks = 0;
+		return false;
+	}
+	bs->buf_start = start;
+	bs->buf_nblocks = n;
+	memcpy(contents, bs->buf, nblocks * BLOCK_SIZE);
+	return true;
+}
+
 /* Respond to a read request.
  */
 static void blkfile_do_read(struct file_server_state *fss, struct file_request *req, gpid_t src, unsigned int uid){
@@ -342,6 +468,9 @@ static void blkfile_do_read(struct file_server_state *fss, struct file_request *
 
     /* Allocate room for the reply.
      */
+    if (req->size > FILE_MAX_BULK_SIZE) {
+        req->size = FILE_MAX_BULK_SIZE;
+    }
     struct file_reply *rep = calloc(1, sizeof(struct file_reply) + req->size);
     char *contents = NULL;
 
@@ -369,12 +498,13 @@ static void blkfile_do_read(struct file_server_state *fss, struct file_request *
         unsigned int psize_nblock = end_block_no - start_block_no + 1;
 
         // Call block server, using the file number as the inode number
+        unsigned long file_nblocks = (fss->fcb_cache[req->file_no].st_size - 1) / BLOCK_SIZE + 1;
         contents = malloc(psize_nblock * BLOCK_SIZE);
-        if (!multiblock_read(fss->block_svr, req->file_no, start_block_no, contents, &psize_nblock) 
-          || psize_nblock != end_block_no - start_block_no + 1) {
+        if (!blkfile_get_blocks(fss, req->file_no, src, start_block_no,
+                            psize_nblock, file_nblocks, contents)) {
             free(contents);
             free(rep);
-            printf("blkfile_do_read: block server read error: %d %d\n", psize_nblock, end_block_no - start_block_no + 1);
+            printf("blkfile_do_read: block server read error: %d\n", psize_nblock);
             blkfile_respond(req, FILE_ERROR, 0, 0, src);
             return;
         }
@@ -395,61 +525,65 @@ static void blkfile_do_read(struct file_server_state *fss, struct file_request *
         free(contents);
 }
 
+/* Write size bytes of data at the given offset in the file.  Blocks that
+ * are entirely overwritten are not read first; only a partially covered
+ * first and last block are, and only if they hold data of the file.  All
+ * blocks are then written in one go.  The new size and modification time
+ * are only kept in the FCB cache (see mark_fcb_dirty()).
+ */
 static int blkfile_put(struct file_server_state *fss, unsigned int file_no, unsigned long offset, void* data, unsigned int size) {
-
-    // Get file size and nblock
-    unsigned long file_size = fss->fcb_cache[file_no].st_size;
-
-    // File read parameter
-    unsigned long start_block_no = offset / BLOCK_SIZE;
-    unsigned long final_size;
-    unsigned long end_block_no;
-    unsigned int psize_nblock; // how many to read from file
-
-    if (offset + size > file_size) {
-        final_size = offset + size;
-        end_block_no = final_size / BLOCK_SIZE;
-        psize_nblock = (file_size / BLOCK_SIZE) - start_block_no + 1;
-    } else {
-        final_size = file_size;
-        end_block_no = (offset + size) / BLOCK_SIZE;
-        psize_nblock = end_block_no - start_block_no + 1;
-    }
-
-    // Get file content
-    char *contents = malloc((end_block_no - start_block_no + 1) * BLOCK_SIZE);
-    memset(contents, 0, (end_block_no - start_block_no + 1) * BLOCK_SIZE);
-
-    if (start_block_no > file_size / BLOCK_SIZE) {
-        // Write directly to block server, using file_no as the inode number
-        memcpy(&contents[offset % BLOCK_SIZE], data, size);
-        if (!multiblock_write(fss->block_svr, file_no, start_block_no, contents, end_block_no - start_block_no + 1)) {
-            free(contents);
-            return -1;
+    struct file_control_block *fcb = &fss->fcb_cache[file_no];
+    unsigned long file_size = fcb->st_size;
+
+    if (size > 0) {
+        stream_invalidate(file_no);
+        unsigned long start_block_no = offset / BLOCK_SIZE;
+        unsigned long end_block_no = (offset + size - 1) / BLOCK_SIZE;
+        unsigned int nblocks = end_block_no - start_block_no + 1;
+        char *contents = malloc(nblocks * BLOCK_SIZE);
+
+        // Fill in the head block if it is partially overwritten.
+        bool head_partial = offset % BLOCK_SIZE != 0 ||
+                (nblocks == 1 && (offset + size) % BLOCK_SIZE != 0);
+        if (head_partial) {
+            unsigned int n = 1;
+            if (start_block_no * BLOCK_SIZE >= file_size) {
+                memset(contents, 0, BLOCK_SIZE);
+            }
+            else if (!multiblock_read(fss->block_svr, file_no, start_block_no, contents, &n) || n != 1) {
+                free(contents);
+                return -1;
+            }
         }
-    } else {
-        // Read file first
-        if (file_size != 0 && 
-            (!multiblock_read(fss->block_svr, file_no, start_block_no, contents, &psize_nblock))) {
-            free(contents);
-            return -1;
+
+        // Same for the tail block, if different from the head block.
+        char *tail = &contents[(nblocks - 1) * BLOCK_SIZE];
+        if (nblocks > 1 && (offset + size) % BLOCK_SIZE != 0) {
+            unsigned int n = 1;
+            if (end_block_no * BLOCK_SIZE >= file_size) {
+                memset(tail, 0, BLOCK_SIZE);
+            }
+            else if (!multiblock_read(fss->block_svr, file_no, end_block_no, tail, &n) || n != 1) {
+                free(contents);
+                return -1;
+            }
         }
 
-        // Modify file content
+        // Write back to block store, using file_no as the inode number
         memcpy(&contents[offset % BLOCK_SIZE], data, size);
-
-        // Write back to block store
-        if (!multiblock_write(fss->block_svr, file_no, start_block_no, contents, end_block_no - start_block_no + 1)) {
+        if (!multiblock_write(fss->block_svr, file_no, start_block_no, contents, nblocks)) {
             free(contents);
             return -1;
         }
+        free(contents);
     }
 
-    free(contents);
-    fss->fcb_cache[file_no].st_size = final_size;
-	fss->fcb_cache[file_no].st_modtime = fss->global_time +
+    if (offset + size > file_size) {
+        fcb->st_size = offset + size;
+    }
+	fcb->st_modtime = fss->global_time +
 						(sys_gettime() - fss->start_time) / 1000;
-    flush_fcb_cache(fss, file_no);
+    mark_fcb_dirty(fss, file_no);
     return 0;
 }
 
@@ -492,7 +626,13 @@ static void blkfile_do_sync(struct file_server_state *fss, struct file_request *
         return;
     }
 
-    bool r = block_sync(fss->block_svr, req->file_no);
+    // Write out deferred FCB updates first, and make sure they are
+    // synced along with the file.
+    bool r = true;
+    if (flush_fcb_dirty(fss) && req->file_no != (unsigned int) -1) {
+        r = block_sync(fss->block_svr, 0);
+    }
+    r = block_sync(fss->block_svr, req->file_no) && r;
     if (!r) {
         printf("blkfile_do_sync: sync error\n");
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
@@ -551,6 +691,7 @@ static void blkfile_do_setsize(struct file_server_state *fss, struct file_reques
 
     // call block server set size
     unsigned int final_nblock = (req->offset == 0? 0 : 1 + (req->offset / BLOCK_SIZE));
+    stream_invalidate(req->file_no);
     if (!block_setsize(fss->block_svr, req->file_no, final_nblock)) {
         printf("blkfile_do_setsize: bad size %u\n", req->file_no);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
@@ -563,6 +704,17 @@ static void blkfile_do_setsize(struct file_server_state *fss, struct file_reques
     blkfile_respond(req, FILE_OK, 0, 0, src);
 }
 
+/* Tell the client how much data a read or write request may carry.
+ */
+static void blkfile_do_maxmsg(struct file_server_state *fss, struct file_request *req, gpid_t src, unsigned int uid){
+    struct file_reply rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.status = FILE_OK;
+    rep.op = FILE_MAXMSG;
+    rep.fcb.st_size = FILE_MAX_BULK_SIZE;
+    sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
 static void blkfile_respond(struct file_request *req, enum file_status status,
                 void *data, unsigned int size, gpid_t src){
     struct file_reply *rep = calloc(1, sizeof(struct file_reply) + size);
@@ -588,9 +740,60 @@ static void flush_fcb_cache(struct file_server_state *fss, unsigned int file_no)
     unsigned int end_block_no =
 		((char *) &fss->fcb_cache[file_no + 1] - 1 - blocks) / BLOCK_SIZE;
 
-    if (!multiblock_write(fss->block_svr, 0, start_block_no, blocks + (start_block_no * BLOCK_SIZE), end_block_no + 1)) {
+    if (!multiblock_write(fss->block_svr, 0, start_block_no, blocks + (start_block_no * BLOCK_SIZE), end_block_no - start_block_no + 1)) {
         printf("flush_fcb_cache: error\n");
     }
+    for (unsigned int i = start_block_no; i <= end_block_no; i++) {
+        fss->fcb_dirty[i] = false;
+    }
+}
+
+/* Mark the FCB of the given file as modified in the cache only.  Too many
+ * deferred updates cause a flush.
+ */
+static void mark_fcb_dirty(struct file_server_state *fss, unsigned int file_no) {
+	char *blocks = (char *) fss->fcb_cache;
+	unsigned int start_block_no =
+		((char *) &fss->fcb_cache[file_no] - blocks) / BLOCK_SIZE;
+    unsigned int end_block_no =
+		((char *) &fss->fcb_cache[file_no + 1] - 1 - blocks) / BLOCK_SIZE;
+
+    for (unsigned int i = start_block_no; i <= end_block_no; i++) {
+        fss->fcb_dirty[i] = true;
+    }
+    if (++fss->fcb_deferred >= FCB_MAX_DEFERRED) {
+        flush_fcb_dirty(fss);
+    }
+}
+
+/* Write all dirty blocks of the FCB array.  Returns whether there were
+ * any.
+ */
+static bool flush_fcb_dirty(struct file_server_state *fss) {
+    unsigned int size = fss->num_fcbs * sizeof(*fss->fcb_cache);
+    unsigned int nblocks = (size - 1) / BLOCK_SIZE + 1;
+    char *blocks = (char *) fss->fcb_cache;
+    bool any = false;
+
+    fss->fcb_deferred = 0;
+    for (unsigned int i = 0; i < nblocks; i++) {
+        if (!fss->fcb_dirty[i]) {
+            continue;
+        }
+
+        // Write runs of dirty blocks at once.
+        unsigned int n = 1;
+        while (i + n < nblocks && fss->fcb_dirty[i + n]) {
+            n++;
+        }
+        if (!multiblock_write(fss->block_svr, 0, i, blocks + i * BLOCK_SIZE, n)) {
+            printf("flush_fcb_dirty: error\n");
+        }
+        memset(&fss->fcb_dirty[i], 0, n * sizeof(*fss->fcb_dirty));
+        any = true;
+        i += n - 1;
+    }
+    return any;
 }
 
 static bool load_fcb_cache(struct file_server_state *fss) {
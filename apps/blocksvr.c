@@ -11,7 +11,9 @@
 #include <egos/block_store.h>
 
 #define DISK_SIZE		(16 * 1024)     // size of "physical" disk in blocks
-#define NCACHE_BLOCKS	20				// size of cache
+#ifndef NCACHE_BLOCKS
+#define NCACHE_BLOCKS	20				// size of cache (-DNCACHE_BLOCKS=n to override)
+#endif
 #define MAX_STACK_SIZE	100				// probably enough...
 #define NINODES			256
 
@@ -51,10 +53,10 @@ static void block_proc(void *arg){
 
 	printf("BLOCK SERVER (layered block storage): pid=%u\n\r", sys_getpid());
 
-	struct block_request *req = new_alloc_ext(struct block_request, PAGESIZE);
+	struct block_request *req = new_alloc_ext(struct block_request, BLOCK_MAX_MSG_SIZE);
 	for (;;) {
 		gpid_t src;
-		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src, 0);
+		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + BLOCK_MAX_MSG_SIZE, &src, 0);
 		if (req_size < 0) {
 			printf("block server shutting down\n\r");
 			free(bss);
@@ -229,42 +231,62 @@ static void block_respond(struct block_request *req, enum block_status status,
 	free(rep);
 }
 
-/* Respond to a read block request.
+/* Respond to a read block request.  Up to req->nblock blocks are returned
+ * in a single reply.  If the whole run cannot be read (e.g., it extends
+ * beyond the end of the inode), the longest readable prefix is returned.
  */
 static void block_do_read(struct block_server_state *bss, struct block_request *req, gpid_t src){
 	// req->file_no
 	// req->offset_nblock
+	// req->nblock
+
+	unsigned int nblock = req->nblock == 0 ? 1 : req->nblock;
+	if (nblock > BLOCK_MAX_NBLOCK) {
+		nblock = BLOCK_MAX_NBLOCK;
+	}
 
 	/* Allocate room for the reply.
 	 */
-	struct block_reply *rep = new_alloc_ext(struct block_reply, BLOCK_SIZE);
+	struct block_reply *rep = new_alloc_ext(struct block_reply, nblock * BLOCK_SIZE);
 
-	/* Read the block from block store
+	/* Read the blocks from block store
 	 */
 	int result;
 	block_t *buffer = (block_t *) &rep[1];
 	block_store_t *bs = *bss->sp;
-	result = (*bs->read)(bs, req->ino, req->offset_nblock, buffer);
+	result = block_store_readv(bs, req->ino, req->offset_nblock, nblock, buffer);
+	if (result < 0 && nblock > 1) {
+		unsigned int i;
+
+		for (i = 0; i < nblock; i++) {
+			if ((*bs->read)(bs, req->ino, req->offset_nblock + i, &buffer[i]) < 0) {
+				break;
+			}
+		}
+		nblock = i;
+		result = nblock == 0 ? -1 : 0;
+	}
 	if (result < 0) {
 		printf("block_do_read: bad offset: %u in inode %u\n", req->offset_nblock, req->ino);
 		block_respond(req, BLOCK_ERROR, 0, 0, src);
 	}
 	else {
 		rep->status = BLOCK_OK;
-		rep->size_nblock = 1;
-		sys_send(src, MSG_REPLY, rep, sizeof(*rep) + BLOCK_SIZE);
+		rep->size_nblock = nblock;
+		sys_send(src, MSG_REPLY, rep, sizeof(*rep) + nblock * BLOCK_SIZE);
 	}
 	free(rep);
 }
 
-/* Respond to a write block request.
+/* Respond to a write block request.  The number of blocks is determined
+ * by the size of the message.
  */
 static void block_do_write(struct block_server_state *bss, struct block_request *req, void *data, unsigned int nblock, gpid_t src){
 	// req->file_no
 	// req->offset_nblock
 
-	if (nblock != 1) {
-		printf("block_do_write: size mismatch %u %u\n", 1, nblock);
+	if (nblock == 0 || (req->nblock != 0 && req->nblock != nblock)) {
+		printf("block_do_write: size mismatch %u %u\n", req->nblock, nblock);
 		block_respond(req, BLOCK_ERROR, 0, 0, src);
 		return;
 	}
@@ -272,7 +294,7 @@ static void block_do_write(struct block_server_state *bss, struct block_request
 	int result;
 	block_t *buffer = (block_t *) data;
 	block_store_t *bs = *bss->sp;
-	result = (*bs->write)(bs, req->ino, req->offset_nblock, buffer);
+	result = block_store_writev(bs, req->ino, req->offset_nblock, nblock, buffer);
 	if (result < 0) {
 		printf("block_do_write: bad offset: %u in inode %u\n", req->offset_nblock, req->ino);
 		block_respond(req, BLOCK_ERROR, 0, 0, src);
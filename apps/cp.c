@@ -2,7 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 
-#define BUF_SIZE		4096
+#define BUF_SIZE		(256 * 1024)
 
 int cp(char *from, char *to){
 	FILE *f_from, *f_to;
@@ -17,7 +17,7 @@ int cp(char *from, char *to){
 		return 1;
 	}
 
-	static char buf[BUF_SIZE];
+	char *buf = malloc(BUF_SIZE);
 	int n;
 	while ((n = fread(buf, 1, BUF_SIZE, f_from)) > 0) {
 		int m = fwrite(buf, 1, n, f_to);
@@ -26,6 +26,7 @@ int cp(char *from, char *to){
 			break;
 		}
 	}
+	free(buf);
 	fclose(f_from);
 	fclose(f_to);
 
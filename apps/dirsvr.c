@@ -10,6 +10,38 @@
 
 #define MAX_PATH_NAME	1024
 #define NENTRIES		(PAGESIZE / DIR_ENTRY_SIZE)
+#define DIR_CACHE_SIZE	32				// #directories cached
+#define DIR_READ_SIZE	(16 * PAGESIZE)	// read directories in chunks of this size
+#define DIR_STAT_INTERVAL	1000		// ms between refreshes of owner and mode
+
+/* An entry of a cached directory, and where it is in the directory file.
+ */
+struct dir_name {
+	struct dir_name *next;			// hash chain
+	unsigned long offset;
+	struct dir_entry de;
+};
+
+/* A cached directory.  The entries are indexed by a hash of their name.
+ * The offsets of free entries are kept so they can be reused.  Updates
+ * go through to the directory file.
+ */
+struct dir_cache {
+	struct dir_cache *prev, *next;	// LRU list, most recently used first
+	fid_t dir;
+	struct file_control_block fcb;	// for permission checks
+	unsigned long stat_time;		// when fcb was last refreshed
+	struct dir_name **buckets;
+	unsigned int nbuckets;			// power of 2
+	unsigned int nnames;
+	unsigned long *free_offsets;
+	unsigned int nfree, free_size;
+	unsigned long end;				// size of directory file
+};
+
+static struct dir_cache *dir_lru_first, *dir_lru_last;
+static unsigned int dir_ncached;
+static unsigned long dir_generation = 1;	// bumped on every change
 
 /* See if the name in de->name is the same as in s for the given size.
  */
@@ -20,6 +52,15 @@ static bool name_cmp(struct dir_entry *de, char *s, unsigned int size){
 	return strncmp(de->name, s, size) == 0;
 }
 
+static unsigned int name_hash(const char *s, unsigned int size){
+	unsigned int h = 5381;
+
+	while (size-- > 0 && *s != 0) {
+		h = h * 33 + (unsigned char) *s++;
+	}
+	return h;
+}
+
 static void dir_respond(gpid_t src, enum dir_status status, fid_t *fid){
 	struct dir_reply rep;
 	memset(&rep, 0, sizeof(rep));
@@ -27,74 +68,309 @@ static void dir_respond(gpid_t src, enum dir_status status, fid_t *fid){
 	if (fid != 0) {
 		rep.fid = *fid;
 	}
+	rep.generation = dir_generation;
 	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
-/* Respond to a lookup request.
+/* Like dir_respond(), but also return the parent directory of *fid.
  */
-static void dir_do_lookup(struct dir_request *req, gpid_t src, unsigned int uid,
-										char *name, unsigned int size){
-	if (size > DIR_NAME_SIZE) {
-		dir_respond(src, DIR_ERROR, 0);
-		return;
+static void dir_respond_path(gpid_t src, enum dir_status status, fid_t fid, fid_t dir){
+	struct dir_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = status;
+	rep.fid = fid;
+	rep.dir = dir;
+	rep.generation = dir_generation;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
+/* Remove a directory from the LRU list.
+ */
+static void dir_lru_unlink(struct dir_cache *dc){
+	if (dc->prev == 0) {
+		dir_lru_first = dc->next;
+	}
+	else {
+		dc->prev->next = dc->next;
+	}
+	if (dc->next == 0) {
+		dir_lru_last = dc->prev;
 	}
+	else {
+		dc->next->prev = dc->prev;
+	}
+}
 
-	/* See if the directory is readable for the user.
-	 */
-	if (uid != 0) {
-		struct file_control_block stat;
-		bool status = file_stat(req->dir.server, req->dir.file_no, &stat);
-		if (!status) {
-			dir_respond(src, DIR_ERROR, 0);
-			return;
+/* Put a directory at the head of the LRU list.
+ */
+static void dir_lru_push(struct dir_cache *dc){
+	dc->prev = 0;
+	dc->next = dir_lru_first;
+	if (dir_lru_first == 0) {
+		dir_lru_last = dc;
+	}
+	else {
+		dir_lru_first->prev = dc;
+	}
+	dir_lru_first = dc;
+}
+
+/* Drop a cached directory, e.g., after failing to update it.
+ */
+static void dir_cache_drop(struct dir_cache *dc){
+	unsigned int i;
+
+	dir_lru_unlink(dc);
+	dir_ncached--;
+	for (i = 0; i < dc->nbuckets; i++) {
+		struct dir_name *dn;
+		while ((dn = dc->buckets[i]) != 0) {
+			dc->buckets[i] = dn->next;
+			free(dn);
 		}
+	}
+	free(dc->buckets);
+	free(dc->free_offsets);
+	free(dc);
+}
+
+/* Find a name in a cached directory.  Returns a pointer to the link to
+ * its entry, which points to null if it is not there.
+ */
+static struct dir_name **dir_find(struct dir_cache *dc, char *name, unsigned int size){
+	struct dir_name **pdn = &dc->buckets[name_hash(name, size) & (dc->nbuckets - 1)];
+
+	while (*pdn != 0 && !name_cmp(&(*pdn)->de, name, size)) {
+		pdn = &(*pdn)->next;
+	}
+	return pdn;
+}
 
-		if (stat.st_uid == uid) {
-			if (!(stat.st_mode & P_FILE_OWNER_READ)) {
-				dir_respond(src, DIR_ERROR, 0);
-				return;
+/* Add an entry to the index of a cached directory, growing the hash table
+ * when it gets too full.
+ */
+static void dir_index(struct dir_cache *dc, struct dir_entry *de, unsigned long offset){
+	if (dc->nnames >= 2 * dc->nbuckets) {
+		unsigned int i, nbuckets = 2 * dc->nbuckets;
+		struct dir_name **buckets = calloc(nbuckets, sizeof(*buckets));
+
+		for (i = 0; i < dc->nbuckets; i++) {
+			struct dir_name *dn;
+			while ((dn = dc->buckets[i]) != 0) {
+				dc->buckets[i] = dn->next;
+				unsigned int b = name_hash(dn->de.name, DIR_NAME_SIZE) & (nbuckets - 1);
+				dn->next = buckets[b];
+				buckets[b] = dn;
 			}
 		}
-		else {
-			if (!(stat.st_mode & P_FILE_OTHER_READ)) {
-				dir_respond(src, DIR_ERROR, 0);
-				return;
-			}
+		free(dc->buckets);
+		dc->buckets = buckets;
+		dc->nbuckets = nbuckets;
+	}
+
+	struct dir_name *dn = malloc(sizeof(*dn));
+	unsigned int b = name_hash(de->name, DIR_NAME_SIZE) & (dc->nbuckets - 1);
+	dn->de = *de;
+	dn->offset = offset;
+	dn->next = dc->buckets[b];
+	dc->buckets[b] = dn;
+	dc->nnames++;
+}
+
+/* Remember that the entry at the given offset is free.
+ */
+static void dir_add_free(struct dir_cache *dc, unsigned long offset){
+	if (dc->nfree == dc->free_size) {
+		dc->free_size = dc->free_size == 0 ? 16 : 2 * dc->free_size;
+		dc->free_offsets = realloc(dc->free_offsets,
+								dc->free_size * sizeof(*dc->free_offsets));
+	}
+	dc->free_offsets[dc->nfree++] = offset;
+}
+
+/* Find a cached directory.
+ */
+static struct dir_cache *dir_cache_find(fid_t dir){
+	struct dir_cache *dc;
+
+	for (dc = dir_lru_first; dc != 0; dc = dc->next) {
+		if (fid_eq(dc->dir, dir)) {
+			return dc;
 		}
 	}
+	return 0;
+}
 
-	/* Read the directory one page at a time.
+/* (Re)load the FCB of a cached directory.  Drops the directory and
+ * returns false if that fails.
+ */
+static bool dir_cache_restat(struct dir_cache *dc){
+	if (!file_stat(dc->dir.server, dc->dir.file_no, &dc->fcb)) {
+		dir_cache_drop(dc);
+		return false;
+	}
+	dc->stat_time = sys_gettime();
+	return true;
+}
+
+/* Get a directory from the cache, reading and indexing it if necessary.
+ * Returns null if the directory cannot be read.
+ */
+static struct dir_cache *dir_cache_get(fid_t dir){
+	struct dir_cache *dc;
+
+	/* All changes to the contents go through this server, so a hit needs
+	 * no RPC.  Only the owner and mode, which are used for permission
+	 * checks, can change elsewhere, so they are refreshed now and then.
 	 */
-	char *buf = malloc(PAGESIZE);
-	unsigned long offset;
-	for (offset = 0;;) {
-		unsigned int n = PAGESIZE;
-		bool status = file_read(req->dir.server, req->dir.file_no,
-					offset, buf, &n);
-		if (!status) {
-			dir_respond(src, DIR_ERROR, 0);			// file error
+	if ((dc = dir_cache_find(dir)) != 0) {
+		if (sys_gettime() - dc->stat_time >= DIR_STAT_INTERVAL &&
+									!dir_cache_restat(dc)) {
+			return 0;
+		}
+		dir_lru_unlink(dc);
+		dir_lru_push(dc);
+		return dc;
+	}
+
+	dc = calloc(1, sizeof(*dc));
+	dc->dir = dir;
+	dc->nbuckets = 16;
+	dc->buckets = calloc(dc->nbuckets, sizeof(*dc->buckets));
+	dir_lru_push(dc);
+	dir_ncached++;
+
+	if (!dir_cache_restat(dc)) {
+		return 0;
+	}
+
+	/* Read the directory a chunk at a time.
+	 */
+	char *buf = malloc(DIR_READ_SIZE);
+	for (;;) {
+		unsigned int n = DIR_READ_SIZE;
+		if (!file_read(dir.server, dir.file_no, dc->end, buf, &n)) {
 			free(buf);
-			return;
+			dir_cache_drop(dc);
+			return 0;
 		}
 		if (n == 0) {
-			dir_respond(src, DIR_ERROR, 0);			// not found
-			free(buf);
-			return;
+			break;
 		}
 		assert(n % DIR_ENTRY_SIZE == 0);
 		unsigned int i;
-		for (i = 0; i < n; i += DIR_ENTRY_SIZE, offset += DIR_ENTRY_SIZE) {
+		for (i = 0; i < n; i += DIR_ENTRY_SIZE, dc->end += DIR_ENTRY_SIZE) {
 			struct dir_entry *de = (struct dir_entry *) &buf[i];
-			if (name_cmp(de, name, size)) {
-				if (de->fid.server == 0) {
-					de->fid.server = req->dir.server;
-				}
-				dir_respond(src, DIR_OK, &de->fid);
-				free(buf);
-				return;
+			if (de->name[0] == 0) {
+				dir_add_free(dc, dc->end);
+			}
+			else {
+				dir_index(dc, de, dc->end);
+			}
+		}
+	}
+	free(buf);
+
+	/* Keep the cache bounded.
+	 */
+	if (dir_ncached > DIR_CACHE_SIZE) {
+		dir_cache_drop(dir_lru_last);
+	}
+	return dc;
+}
+
+/* See if the user has the given access to the directory.
+ */
+static bool dir_allowed(struct dir_cache *dc, unsigned int uid,
+						gmode_t owner_mode, gmode_t other_mode){
+	if (uid == 0) {
+		return true;
+	}
+	if (dc->fcb.st_uid == uid) {
+		return (dc->fcb.st_mode & owner_mode) != 0;
+	}
+	return (dc->fcb.st_mode & other_mode) != 0;
+}
+
+/* Look up a name in directory dir on behalf of the given user.
+ */
+static bool dir_resolve(fid_t dir, unsigned int uid, char *name,
+										unsigned int size, fid_t *pfid){
+	if (size > DIR_NAME_SIZE) {
+		return false;
+	}
+
+	/* See if the directory is readable for the user.
+	 */
+	struct dir_cache *dc = dir_cache_get(dir);
+	if (dc == 0 || !dir_allowed(dc, uid, P_FILE_OWNER_READ, P_FILE_OTHER_READ)) {
+		return false;
+	}
+
+	struct dir_name *dn = *dir_find(dc, name, size);
+	if (dn == 0) {
+		return false;							// not found
+	}
+	*pfid = dn->de.fid;
+	if (pfid->server == 0) {
+		pfid->server = dir.server;
+	}
+	return true;
+}
+
+/* Respond to a lookup request.
+ */
+static void dir_do_lookup(struct dir_request *req, gpid_t src, unsigned int uid,
+										char *name, unsigned int size){
+	fid_t fid;
+
+	if (dir_resolve(req->dir, uid, name, size, &fid)) {
+		dir_respond(src, DIR_OK, &fid);
+	}
+	else {
+		dir_respond(src, DIR_ERROR, 0);
+	}
+}
+
+/* Respond to a request to look up a path relative to a directory.  Every
+ * component but the last, and the last one if req->is_dir is set, names
+ * a directory and gets a ".dir" suffix.  The parent directory of the
+ * last component is returned too, even if the last one is not found.
+ */
+static void dir_do_lookup_path(struct dir_request *req, gpid_t src,
+						unsigned int uid, char *path, unsigned int size){
+	char name[DIR_NAME_SIZE];
+	char *end = &path[size];
+	fid_t dir = req->dir, fid = dir;
+
+	while (path < end) {
+		char *e = memchr(path, '/', end - path);
+		unsigned int n = (e == 0 ? end : e) - path;
+		bool suffix = e != 0 || req->is_dir;
+		bool found = n + (suffix ? 4 : 0) <= DIR_NAME_SIZE;
+
+		/* Take the next step.
+		 */
+		if (found) {
+			memcpy(name, path, n);
+			if (suffix) {
+				memcpy(&name[n], ".dir", 4);
+				n += 4;
 			}
+			found = dir_resolve(dir, uid, name, n, &fid);
+		}
+		if (e == 0) {
+			dir_respond_path(src, found ? DIR_OK : DIR_ERROR, fid, dir);
+			return;
+		}
+		if (!found) {
+			dir_respond_path(src, DIR_ERROR, fid_val(0, 0), fid_val(0, 0));
+			return;
 		}
+		path = e + 1;
+		dir = fid;
 	}
+	dir_respond_path(src, DIR_OK, fid, dir);
 }
 
 /* Respond to an insert request.
@@ -109,76 +385,31 @@ static void dir_do_insert(struct dir_request *req, gpid_t src, unsigned int uid,
 
 	/* See if the directory is writable for the user.
 	 */
-	if (uid != 0) {
-		struct file_control_block stat;
-		bool status = file_stat(req->dir.server, req->dir.file_no, &stat);
-		if (!status) {
-			fprintf(stderr, "dir_do_insert: directory not writable\n");
-			dir_respond(src, DIR_ERROR, 0);
-			return;
-		}
-
-		if (stat.st_uid == uid) {
-			if (!(stat.st_mode & P_FILE_OWNER_WRITE)) {
-				fprintf(stderr, "dir_do_insert: owner can't write\n");
-				dir_respond(src, DIR_ERROR, 0);
-				return;
-			}
-		}
-		else {
-			if (!(stat.st_mode & P_FILE_OTHER_WRITE)) {
-				fprintf(stderr, "dir_do_insert: other can't write\n");
-				dir_respond(src, DIR_ERROR, 0);
-				return;
-			}
-		}
+	struct dir_cache *dc = dir_cache_get(req->dir);
+	if (dc == 0) {
+		fprintf(stderr, "dir_do_insert: can't read directory\n");
+		dir_respond(src, DIR_ERROR, 0);
+		return;
 	}
-
-	/* Read the directory one page at a time.
-	 */
-	char *buf = malloc(PAGESIZE);
-	bool found_free_entry = false;
-	unsigned long offset, free_offset;
-	for (offset = 0;;) {
-		unsigned int n = PAGESIZE;
-		bool status = file_read(req->dir.server, req->dir.file_no,
-					offset, buf, &n);
-		if (!status) {
-			free(buf);
-			fprintf(stderr, "dir_do_insert: can't read directory\n");
-			dir_respond(src, DIR_ERROR, 0);			// file error
-			return;
-		}
-		if (n == 0) {
-			break;
-		}
-		if (n % DIR_ENTRY_SIZE != 0) {
-			fprintf(stderr, "dir_do_insert: svr=%u file_no=%u offset=%u n=%d src=%d name=%s\n",
-						req->dir.server, req->dir.file_no, offset, (int) n, (int) src, name);
-		}
-		assert(n % DIR_ENTRY_SIZE == 0);
-		unsigned int i;
-		for (i = 0; i < n; i += DIR_ENTRY_SIZE, offset += DIR_ENTRY_SIZE) {
-			struct dir_entry *de = (struct dir_entry *) &buf[i];
-			if (de->name[0] == 0) {
-				if (!found_free_entry) {
-					free_offset = offset;
-					found_free_entry = true;
-				}
-			}
-			else if (name_cmp(de, name, size)) {
-				free(buf);
-				fprintf(stderr, "dir_do_insert: already exists\n");
-				dir_respond(src, DIR_ERROR, 0);			// already exists
-				return;
-			}
-		}
+	if (!dir_allowed(dc, uid, P_FILE_OWNER_WRITE, P_FILE_OTHER_WRITE)) {
+		fprintf(stderr, "dir_do_insert: directory not writable\n");
+		dir_respond(src, DIR_ERROR, 0);
+		return;
+	}
+	if (*dir_find(dc, name, size) != 0) {
+		fprintf(stderr, "dir_do_insert: already exists\n");
+		dir_respond(src, DIR_ERROR, 0);
+		return;
 	}
 
-	/* Add the new entry.
+	/* Add the new entry, reusing a free one if any.
 	 */
-	if (found_free_entry) {
-		offset = free_offset;
+	unsigned long offset;
+	if (dc->nfree > 0) {
+		offset = dc->free_offsets[dc->nfree - 1];
+	}
+	else {
+		offset = dc->end;
 	}
 	struct dir_entry nde;
 	memset(&nde, 0, sizeof(nde));
@@ -186,7 +417,19 @@ static void dir_do_insert(struct dir_request *req, gpid_t src, unsigned int uid,
 	nde.fid = req->fid;
 	bool wstatus = file_write(req->dir.server, req->dir.file_no,
 											offset, &nde, sizeof(nde));
-	free(buf);
+	dir_generation++;
+	if (!wstatus) {
+		dir_cache_drop(dc);
+	}
+	else {
+		if (dc->nfree > 0) {
+			dc->nfree--;
+		}
+		else {
+			dc->end += DIR_ENTRY_SIZE;
+		}
+		dir_index(dc, &nde, offset);
+	}
 	dir_respond(src, wstatus ? DIR_OK : DIR_ERROR, &req->fid);
 }
 
@@ -201,64 +444,42 @@ static void dir_do_remove(struct dir_request *req, gpid_t src, unsigned int uid,
 
 	/* See if the directory is writable for the user.
 	 */
-	if (uid != 0) {
-		struct file_control_block stat;
-		bool status = file_stat(req->dir.server, req->dir.file_no, &stat);
-		if (!status) {
-			dir_respond(src, DIR_ERROR, 0);
-			return;
-		}
-
-		if (stat.st_uid == uid) {
-			if (!(stat.st_mode & P_FILE_OWNER_WRITE)) {
-				dir_respond(src, DIR_ERROR, 0);
-				return;
-			}
-		}
-		else {
-			if (!(stat.st_mode & P_FILE_OTHER_WRITE)) {
-				dir_respond(src, DIR_ERROR, 0);
-				return;
-			}
-		}
+	struct dir_cache *dc = dir_cache_get(req->dir);
+	if (dc == 0 || !dir_allowed(dc, uid, P_FILE_OWNER_WRITE, P_FILE_OTHER_WRITE)) {
+		dir_respond(src, DIR_ERROR, 0);
+		return;
 	}
 
-	/* Read the directory one page at a time.
+	/* If it isn't there, pretend it went ok.
 	 */
-	char *buf = malloc(PAGESIZE);
-	unsigned long offset;
-	for (offset = 0;;) {
-		unsigned int n = PAGESIZE;
-		bool status = file_read(req->dir.server, req->dir.file_no,
-					offset, buf, &n);
-		if (!status) {
-			free(buf);
-			dir_respond(src, DIR_ERROR, 0);			// file error
-			return;
-		}
-		if (n == 0) {
-			/* Didn't find it, but pretend it went ok.
-			 */
-			free(buf);
-			dir_respond(src, DIR_OK, &req->fid);
-			return;
-		}
-		assert(n % DIR_ENTRY_SIZE == 0);
-		unsigned int i;
-		for (i = 0; i < n; i += DIR_ENTRY_SIZE, offset += DIR_ENTRY_SIZE) {
-			struct dir_entry *de = (struct dir_entry *) &buf[i];
-			if (de->name[0] != 0
-						&& memcmp(&de->fid, &req->fid, sizeof(de->fid)) == 0
-						&& name_cmp(de, name, size)) {
-				memset(de, 0, sizeof(*de));
-				bool wstatus = file_write(req->dir.server, req->dir.file_no,
-											offset, de, sizeof(*de));
-				free(buf);
-				dir_respond(src, wstatus ? DIR_OK : DIR_ERROR, &req->fid);
-				return;
-			}
+	struct dir_name **pdn = dir_find(dc, name, size), *dn = *pdn;
+	if (dn == 0 || !fid_eq(dn->de.fid, req->fid)) {
+		dir_respond(src, DIR_OK, &req->fid);
+		return;
+	}
+
+	struct dir_entry de;
+	memset(&de, 0, sizeof(de));
+	bool wstatus = file_write(req->dir.server, req->dir.file_no,
+										dn->offset, &de, sizeof(de));
+	dir_generation++;
+	if (!wstatus) {
+		dir_cache_drop(dc);
+	}
+	else {
+		*pdn = dn->next;
+		dc->nnames--;
+		dir_add_free(dc, dn->offset);
+		free(dn);
+
+		/* The entry may be a directory that is about to be deleted, and
+		 * its file number reused.
+		 */
+		if ((dc = dir_cache_find(req->fid)) != 0) {
+			dir_cache_drop(dc);
 		}
 	}
+	dir_respond(src, wstatus ? DIR_OK : DIR_ERROR, &req->fid);
 }
 
 /* The directory server.
@@ -293,6 +514,13 @@ static void dir_proc(){
 			dir_do_remove(req, src, uid,
 						(char *) &req[1], req_size - sizeof(*req));
 			break;
+		case DIR_LOOKUP_PATH:
+			dir_do_lookup_path(req, src, uid,
+						(char *) &req[1], req_size - sizeof(*req));
+			break;
+		case DIR_GENERATION:
+			dir_respond(src, DIR_OK, 0);
+			break;
 		default:
 			assert(0);
 		}
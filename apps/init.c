@@ -37,6 +37,7 @@ static struct fs_init fs_table[] = {
 	{ FI_FILE, 0, "/bin.dir/ls.exe", "bin/ls.exe" },
 	{ FI_FILE, 0, "/bin.dir/passwd.exe", "bin/passwd.exe" },
 	{ FI_FILE, 0, "/bin.dir/pwd.exe", "bin/pwd.exe" },
+	{ FI_FILE, 0, "/bin.dir/sched.exe", "bin/sched.exe" },
 	{ FI_FILE, 0, "/bin.dir/shell.exe", "bin/shell.exe" },
 	{ FI_FILE, 0, "/bin.dir/shutdown.exe", "bin/shutdown.exe" },
 	{ FI_FILE, 0, "/bin.dir/sync.exe", "bin/sync.exe" },
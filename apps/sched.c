@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <egos/spawn.h>
+
+/* Usage:
+ *	sched policy				select the scheduling policy
+ *	sched pid weight [period]	set the scheduling parameters of a process
+ */
+int main(int argc, char **argv){
+	gpid_t svr = GRASS_ENV->servers[GPID_SPAWN];
+
+	if (argc == 2) {
+		if (!spawn_set_policy(svr, argv[1])) {
+			fprintf(stderr, "sched: can't select policy %s\n", argv[1]);
+			return 1;
+		}
+		return 0;
+	}
+	if (argc == 3 || argc == 4) {
+		gpid_t pid = (gpid_t) atoi(argv[1]);
+		unsigned int weight = atoi(argv[2]);
+		unsigned int period = argc == 4 ? atoi(argv[3]) : 0;
+
+		if (!spawn_set_sched(svr, pid, weight, period)) {
+			fprintf(stderr, "sched: can't set parameters of process %u\n", pid);
+			return 1;
+		}
+		return 0;
+	}
+	fprintf(stderr, "Usage: sched policy | sched pid weight [period]\n");
+	return 1;
+}
@@ -0,0 +1,87 @@
+/* Generic support for the optional multi-block methods of block stores.
+ * See <egos/block_store.h> for the interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <egos/block_store.h>
+
+/* Read a run of consecutive blocks, using the native readv method of the
+ * block store if it has one, and a sequence of reads otherwise.
+ */
+int block_store_readv(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	if (bs->readv != 0) {
+		return (*bs->readv)(bs, ino, offset, nblocks, blocks);
+	}
+	for (block_no i = 0; i < nblocks; i++) {
+		if ((*bs->read)(bs, ino, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write a run of consecutive blocks, using the native writev method of the
+ * block store if it has one, and a sequence of writes otherwise.
+ */
+int block_store_writev(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	if (bs->writev != 0) {
+		return (*bs->writev)(bs, ino, offset, nblocks, blocks);
+	}
+	for (block_no i = 0; i < nblocks; i++) {
+		if ((*bs->write)(bs, ino, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Return the length of the run of consecutive block numbers in map[]
+ * starting at map[0].
+ */
+static block_no block_store_runlength(const block_no *map, block_no nblocks){
+	block_no n = 1;
+	while (n < nblocks && map[n] != BLOCK_NONE && map[n] == map[0] + n) {
+		n++;
+	}
+	return n;
+}
+
+/* Read blocks[i] from block map[i] for each i, skipping holes.  Runs of
+ * consecutive block numbers are read with a single readv.
+ */
+int block_store_readruns(block_if bs, unsigned int ino, const block_no *map, block_no nblocks, block_t *blocks){
+	block_no i = 0;
+	while (i < nblocks) {
+		if (map[i] == BLOCK_NONE) {
+			i++;
+			continue;
+		}
+		block_no n = block_store_runlength(&map[i], nblocks - i);
+		if (block_store_readv(bs, ino, map[i], n, &blocks[i]) < 0) {
+			return -1;
+		}
+		i += n;
+	}
+	return 0;
+}
+
+/* Write blocks[i] to block map[i] for each i, skipping holes.  Runs of
+ * consecutive block numbers are written with a single writev.
+ */
+int block_store_writeruns(block_if bs, unsigned int ino, const block_no *map, block_no nblocks, block_t *blocks){
+	block_no i = 0;
+	while (i < nblocks) {
+		if (map[i] == BLOCK_NONE) {
+			i++;
+			continue;
+		}
+		block_no n = block_store_runlength(&map[i], nblocks - i);
+		if (block_store_writev(bs, ino, map[i], n, &blocks[i]) < 0) {
+			return -1;
+		}
+		i += n;
+	}
+	return 0;
+}
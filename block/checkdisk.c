@@ -61,13 +61,9 @@ static int checkdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no
 	return (*cs->below->setsize)(cs->below, ino, nblocks);
 }
 
-static int checkdisk_read(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
-	struct checkdisk_state *cs = this_bs->state;
-
-	if ((*cs->below->read)(cs->below, ino, offset, block) < 0) {
-		return -1;
-	}
-
+/* Check a block that was read against what was read or written before.
+ */
+static void checkdisk_check_read(struct checkdisk_state *cs, unsigned int ino, block_no offset, block_t *block){
 	/* See if I read or wrote the block before.
 	 */
 	struct block_list *bl;
@@ -79,7 +75,7 @@ static int checkdisk_read(block_store_t *this_bs, unsigned int ino, block_no off
 				fprintf(stderr, "!!CHKDISK %s: checkdisk_read: corrupted\n\r", cs->descr);
 				exit(1);
 			}
-			return 0;
+			return;
 		}
 	}
 
@@ -91,17 +87,11 @@ static int checkdisk_read(block_store_t *this_bs, unsigned int ino, block_no off
 	bl->block = *block;
 	bl->next = cs->bl;
 	cs->bl = bl;
-	return 0;
 }
 
-static int checkdisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
-	struct checkdisk_state *cs = this_bs->state;
-
-	int result = (*cs->below->write)(cs->below, ino, offset, block);
-	if (result < 0) {
-		return -1;
-	}
-
+/* Remember the contents of a block that was written.
+ */
+static void checkdisk_record_write(struct checkdisk_state *cs, unsigned int ino, block_no offset, block_t *block){
 	/* See if I read or wrote the block before.
 	 */
 	struct block_list *bl;
@@ -122,9 +112,53 @@ static int checkdisk_write(block_store_t *this_bs, unsigned int ino, block_no of
 	/* Update the block list entry.
 	 */
 	bl->block = *block;
+}
+
+static int checkdisk_read(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
+	struct checkdisk_state *cs = this_bs->state;
+
+	if ((*cs->below->read)(cs->below, ino, offset, block) < 0) {
+		return -1;
+	}
+	checkdisk_check_read(cs, ino, offset, block);
+	return 0;
+}
+
+static int checkdisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
+	struct checkdisk_state *cs = this_bs->state;
+
+	int result = (*cs->below->write)(cs->below, ino, offset, block);
+	if (result < 0) {
+		return -1;
+	}
+	checkdisk_record_write(cs, ino, offset, block);
 	return result;
 }
 
+static int checkdisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct checkdisk_state *cs = this_bs->state;
+
+	if (block_store_readv(cs->below, ino, offset, nblocks, blocks) < 0) {
+		return -1;
+	}
+	for (block_no i = 0; i < nblocks; i++) {
+		checkdisk_check_read(cs, ino, offset + i, &blocks[i]);
+	}
+	return 0;
+}
+
+static int checkdisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct checkdisk_state *cs = this_bs->state;
+
+	if (block_store_writev(cs->below, ino, offset, nblocks, blocks) < 0) {
+		return -1;
+	}
+	for (block_no i = 0; i < nblocks; i++) {
+		checkdisk_record_write(cs, ino, offset + i, &blocks[i]);
+	}
+	return 0;
+}
+
 static void checkdisk_release(block_store_t *this_bs){
 	struct checkdisk_state *cs = this_bs->state;
 	struct block_list *bl;
@@ -160,5 +194,7 @@ block_store_t *checkdisk_init(block_store_t *below, const char *descr){
 	this_bs->write = checkdisk_write;
 	this_bs->release = checkdisk_release;
 	this_bs->sync = checkdisk_sync;
+	this_bs->readv = checkdisk_readv;
+	this_bs->writev = checkdisk_writev;
 	return this_bs;
 }
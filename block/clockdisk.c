@@ -20,8 +20,17 @@
 
 /* State contains the pointer to the block module below as well as caching
  * information and caching statistics.
+ *
+ * Cached blocks are indexed by (ino, offset) in a chained hash table so
+ * that lookups do not depend on the size of the cache.  In addition, dirty
+ * blocks are kept on doubly-linked lists hashed by inode number so that
+ * clockdisk_sync only needs to visit the dirty blocks of the given inode.
+ * All links are slot numbers in metadatas[], with NO_SLOT as the null link.
  */
 
+#define NO_SLOT		(-1)
+#define NDIRTY_LISTS	64		// must be a power of 2
+
 struct block_info
 {
 	unsigned int use_bit;
@@ -29,6 +38,8 @@ struct block_info
 	unsigned int ino;
 	unsigned int offset;
 	unsigned int dirty_bit;
+	int hash_next;				// next slot in same hash bucket
+	int dirty_prev, dirty_next;	// neighbors on the dirty list
 };
 
 struct clockdisk_state
@@ -39,12 +50,118 @@ struct clockdisk_state
 	struct block_info *metadatas;
 	int clock_hand;
 
+	int *hash_buckets;	// (ino, offset) --> first slot in bucket
+	unsigned int hash_mask;	// #buckets - 1
+	int dirty_lists[NDIRTY_LISTS];	// ino --> first dirty slot
+
 	/* Stats.
 	 */
 	unsigned int read_hit, read_miss, write_hit, write_miss;
+	unsigned long nlookups, nprobes;
 };
 
-static void cache_update(struct clockdisk_state *cs, unsigned int ino, block_no offset, block_t *block)
+static unsigned int cache_hash(struct clockdisk_state *cs, unsigned int ino, block_no offset)
+{
+	return ((ino * 2654435761U) ^ (offset * 40503U) ^ (offset >> 16)) & cs->hash_mask;
+}
+
+/* Find the slot that caches block (ino, offset), or NO_SLOT if not cached.
+ */
+static int cache_lookup(struct clockdisk_state *cs, unsigned int ino, block_no offset)
+{
+	cs->nlookups++;
+	int i = cs->hash_buckets[cache_hash(cs, ino, offset)];
+	while (i != NO_SLOT)
+	{
+		cs->nprobes++;
+		if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset)
+		{
+			return i;
+		}
+		i = cs->metadatas[i].hash_next;
+	}
+	return NO_SLOT;
+}
+
+static void cache_hash_insert(struct clockdisk_state *cs, int slot)
+{
+	struct block_info *bi = &cs->metadatas[slot];
+	int *bucket = &cs->hash_buckets[cache_hash(cs, bi->ino, bi->offset)];
+
+	bi->hash_next = *bucket;
+	*bucket = slot;
+}
+
+static void cache_hash_remove(struct clockdisk_state *cs, int slot)
+{
+	struct block_info *bi = &cs->metadatas[slot];
+	int *link = &cs->hash_buckets[cache_hash(cs, bi->ino, bi->offset)];
+
+	while (*link != slot)
+	{
+		link = &cs->metadatas[*link].hash_next;
+	}
+	*link = bi->hash_next;
+	bi->hash_next = NO_SLOT;
+}
+
+/* Mark the given slot dirty and put it on the dirty list of its inode.
+ */
+static void cache_mark_dirty(struct clockdisk_state *cs, int slot)
+{
+	struct block_info *bi = &cs->metadatas[slot];
+	if (bi->dirty_bit == 1)
+	{
+		return;
+	}
+
+	int *head = &cs->dirty_lists[bi->ino & (NDIRTY_LISTS - 1)];
+	bi->dirty_bit = 1;
+	bi->dirty_prev = NO_SLOT;
+	bi->dirty_next = *head;
+	if (*head != NO_SLOT)
+	{
+		cs->metadatas[*head].dirty_prev = slot;
+	}
+	*head = slot;
+}
+
+/* Mark the given slot clean and take it off the dirty list of its inode.
+ */
+static void cache_mark_clean(struct clockdisk_state *cs, int slot)
+{
+	struct block_info *bi = &cs->metadatas[slot];
+	if (bi->dirty_bit == 0)
+	{
+		return;
+	}
+
+	if (bi->dirty_prev == NO_SLOT)
+	{
+		cs->dirty_lists[bi->ino & (NDIRTY_LISTS - 1)] = bi->dirty_next;
+	}
+	else
+	{
+		cs->metadatas[bi->dirty_prev].dirty_next = bi->dirty_next;
+	}
+	if (bi->dirty_next != NO_SLOT)
+	{
+		cs->metadatas[bi->dirty_next].dirty_prev = bi->dirty_prev;
+	}
+	bi->dirty_bit = 0;
+	bi->dirty_prev = bi->dirty_next = NO_SLOT;
+}
+
+/* Drop the given slot from the cache without writing it back.
+ */
+static void cache_invalidate(struct clockdisk_state *cs, int slot)
+{
+	cache_mark_clean(cs, slot);
+	cache_hash_remove(cs, slot);
+	cs->metadatas[slot].use_bit = 0;
+}
+
+static int cache_update(struct clockdisk_state *cs, unsigned int ino, block_no offset, block_t *block, int dirty)
 {
 	//Find slot in the clock to update by moving clock_hand
 	for (;;)
@@ -66,19 +183,30 @@ static void cache_update(struct clockdisk_state *cs, unsigned int ino, block_no
 	}
 
 	//If dirty, write to disk 
-	if (cs->metadatas[cs->clock_hand].dirty_bit == 1 && cs->metadatas[cs->clock_hand].use_bit == 1) {
-		(*cs->below->write)(cs->below, cs->metadatas[cs->clock_hand].ino, cs->metadatas[cs->clock_hand].offset, &cs->blocks[cs->clock_hand]);
+	struct block_info *victim = &cs->metadatas[cs->clock_hand];
+	if (victim->use_bit == 1) {
+		if (victim->dirty_bit == 1) {
+			if ((*cs->below->write)(cs->below, victim->ino, victim->offset, &cs->blocks[cs->clock_hand]) < 0) {
+				return -1;
+			}
+		}
+		cache_invalidate(cs, cs->clock_hand);
 	}
 
 	// Edit acutal cache memory
 	memcpy(&cs->blocks[cs->clock_hand], block, BLOCK_SIZE);
 
 	// Edit slot in the clock
-	cs->metadatas[cs->clock_hand].use_bit = 1;
-	cs->metadatas[cs->clock_hand].recent_bit = 1;
-	cs->metadatas[cs->clock_hand].dirty_bit = 1;
-	cs->metadatas[cs->clock_hand].ino = ino;
-	cs->metadatas[cs->clock_hand].offset = offset;
+	victim->use_bit = 1;
+	victim->recent_bit = 1;
+	victim->ino = ino;
+	victim->offset = offset;
+	cache_hash_insert(cs, cs->clock_hand);
+	if (dirty)
+	{
+		cache_mark_dirty(cs, cs->clock_hand);
+	}
+	return 0;
 }
 
 static int clockdisk_getninodes(block_store_t *this_bs)
@@ -101,8 +229,7 @@ static int clockdisk_setsize(block_if bi, unsigned int ino, block_no nblocks)
 	{
 		if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset >= nblocks && cs->metadatas[i].use_bit == 1)
 		{
-			cs->metadatas[i].use_bit = 0;
-			cs->metadatas[i].dirty_bit = 0;
+			cache_invalidate(cs, i);
 		}
 	}
 
@@ -113,19 +240,9 @@ static int clockdisk_setsize(block_if bi, unsigned int ino, block_no nblocks)
 static int clockdisk_read(block_if bi, unsigned int ino, block_no offset, block_t *block)
 {
 	struct clockdisk_state *cs = bi->state;
-	int i = 0;
-	while (i < cs->nblocks)
-	{
-		if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset && cs->metadatas[i].use_bit == 1)
-		{
-			break;
-		}
+	int i = cache_lookup(cs, ino, offset);
 
-		i += 1;
-	}
-
-
-	if (i == cs->nblocks)
+	if (i == NO_SLOT)
 	{
 		cs->read_miss += 1;
 		if ((*cs->below->read)(cs->below, ino, offset, block) == -1)
@@ -133,11 +250,12 @@ static int clockdisk_read(block_if bi, unsigned int ino, block_no offset, block_
 			return -1;
 		}
 
-		cache_update(cs, ino, offset, block);
+		return cache_update(cs, ino, offset, block, 0);
 	}
 	else
 	{
 		cs->read_hit += 1;
+		cs->metadatas[i].recent_bit = 1;
 		memcpy(block, &cs->blocks[i], BLOCK_SIZE);
 	}
 
@@ -147,45 +265,132 @@ static int clockdisk_read(block_if bi, unsigned int ino, block_no offset, block_
 static int clockdisk_write(block_if bi, unsigned int ino, block_no offset, block_t *block)
 {
 	struct clockdisk_state *cs = bi->state;
-	int i = 0;
-	while (i < cs->nblocks)
-	{
-		if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset && cs->metadatas[i].use_bit == 1)
-		{
-			break;
-		}
-
-		i += 1;
-	}
+	int i = cache_lookup(cs, ino, offset);
 
-	if (i == cs->nblocks)
+	if (i == NO_SLOT)
 	{
 		cs->write_miss += 1;
-		cache_update(cs, ino, offset, block);
+		return cache_update(cs, ino, offset, block, 1);
 	}
 	else
 	{
 		cs->write_hit += 1;
+		cs->metadatas[i].recent_bit = 1;
 		memcpy(&cs->blocks[i], block, BLOCK_SIZE);
-		cs->metadatas[i].dirty_bit = 1;
+		cache_mark_dirty(cs, i);
 	}
 
 	return 0;
 }
 
-static int clockdisk_sync(block_if bi, unsigned int ino)
+/* Read a run of blocks.  Blocks that are cached are copied from the cache,
+ * and each run of blocks that are not is read from below in one go.
+ */
+static int clockdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
 {
 	struct clockdisk_state *cs = bi->state;
-	for (int i = 0; i < cs->nblocks; i++)
+	block_no i = 0;
+	int slot = NO_SLOT;
+	int looked_up = 0;		// slot is already known for block i
+	while (i < nblocks)
 	{
-		if (cs->metadatas[i].ino == ino && cs->metadatas[i].use_bit == 1 && cs->metadatas[i].dirty_bit == 1)
+		if (!looked_up)
+		{
+			slot = cache_lookup(cs, ino, offset + i);
+		}
+		looked_up = 0;
+		if (slot != NO_SLOT)
+		{
+			cs->read_hit += 1;
+			cs->metadatas[slot].recent_bit = 1;
+			memcpy(&blocks[i], &cs->blocks[slot], BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		/* Find the end of the run of misses, and remember the slot of the
+		 * cached block that ends it so it need not be looked up again.
+		 */
+		block_no n = 1;
+		int next = NO_SLOT;
+		while (i + n < nblocks && (next = cache_lookup(cs, ino, offset + i + n)) == NO_SLOT)
 		{
-			if ((*cs->below->write)(cs->below, ino, cs->metadatas[i].offset, &cs->blocks[i]) == -1)
+			n++;
+		}
+		cs->read_miss += n;
+		if (block_store_readv(cs->below, ino, offset + i, n, &blocks[i]) == -1)
+		{
+			return -1;
+		}
+		for (block_no j = i; j < i + n; j++)
+		{
+			if (cache_update(cs, ino, offset + j, &blocks[j], 0) < 0)
 			{
 				return -1;
 			}
+		}
+		i += n;
 
-			cs->metadatas[i].dirty_bit = 0;
+		/* Loading the run may have evicted that block, in which case it
+		 * is a miss.
+		 */
+		if (next != NO_SLOT)
+		{
+			if (cs->metadatas[next].ino != ino || cs->metadatas[next].offset != offset + i)
+			{
+				next = NO_SLOT;
+			}
+			slot = next;
+			looked_up = 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Write a run of blocks.  The cache is write-back, so this only updates
+ * the cache and the writes reach the store below on eviction or sync.
+ */
+static int clockdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
+{
+	for (block_no i = 0; i < nblocks; i++)
+	{
+		if (clockdisk_write(bi, ino, offset + i, &blocks[i]) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write back the dirty blocks of the given inode, or of all inodes if
+ * ino is (unsigned int) -1.
+ */
+static int clockdisk_sync(block_if bi, unsigned int ino)
+{
+	struct clockdisk_state *cs = bi->state;
+	int first = 0, last = NDIRTY_LISTS - 1;
+
+	if (ino != (unsigned int) -1)
+	{
+		first = last = ino & (NDIRTY_LISTS - 1);
+	}
+	for (int l = first; l <= last; l++)
+	{
+		int i = cs->dirty_lists[l];
+		while (i != NO_SLOT)
+		{
+			int next = cs->metadatas[i].dirty_next;
+			if (ino == (unsigned int) -1 || cs->metadatas[i].ino == ino)
+			{
+				if ((*cs->below->write)(cs->below, cs->metadatas[i].ino, cs->metadatas[i].offset, &cs->blocks[i]) == -1)
+				{
+					return -1;
+				}
+
+				cache_mark_clean(cs, i);
+			}
+			i = next;
 		}
 	}
 
@@ -195,6 +400,8 @@ static int clockdisk_sync(block_if bi, unsigned int ino)
 static void clockdisk_release(block_if bi)
 {
 	struct clockdisk_state *cs = bi->state;
+	free(cs->hash_buckets);
+	free(cs->metadatas);
 	free(cs);
 	free(bi);
 }
@@ -207,6 +414,7 @@ void clockdisk_dump_stats(block_if bi)
 	printf("!$CLOCK: #read misses:  %u\n", cs->read_miss);
 	printf("!$CLOCK: #write hits:   %u\n", cs->write_hit);
 	printf("!$CLOCK: #write misses: %u\n", cs->write_miss);
+	printf("!$CLOCK: #lookups:      %lu (%lu probes)\n", cs->nlookups, cs->nprobes);
 }
 
 /* Create a new block store module on top of the specified module below.
@@ -231,9 +439,30 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks)
 		cs->metadatas[i].use_bit = 0;
 		cs->metadatas[i].recent_bit = 0;
 		cs->metadatas[i].dirty_bit = 0;
+		cs->metadatas[i].hash_next = NO_SLOT;
+		cs->metadatas[i].dirty_prev = NO_SLOT;
+		cs->metadatas[i].dirty_next = NO_SLOT;
 	}
 	cs->clock_hand = 0;
 
+	/* Use about two buckets per cache slot, rounded up to a power of 2.
+	 */
+	unsigned int nbuckets = 1;
+	while (nbuckets < 2 * nblocks)
+	{
+		nbuckets <<= 1;
+	}
+	cs->hash_mask = nbuckets - 1;
+	cs->hash_buckets = malloc(sizeof(int) * nbuckets);
+	for (unsigned int i = 0; i < nbuckets; i++)
+	{
+		cs->hash_buckets[i] = NO_SLOT;
+	}
+	for (int i = 0; i < NDIRTY_LISTS; i++)
+	{
+		cs->dirty_lists[i] = NO_SLOT;
+	}
+
 	/* Return a block interface to this inode.
 	 */
 	block_if bi = new_alloc(block_store_t);
@@ -245,5 +474,7 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks)
 	bi->write = clockdisk_write;
 	bi->release = clockdisk_release;
 	bi->sync = clockdisk_sync;
+	bi->readv = clockdisk_readv;
+	bi->writev = clockdisk_writev;
 	return bi;
 }
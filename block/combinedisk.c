@@ -82,6 +82,30 @@ static int combinedisk_write(block_if bi, unsigned int ino, block_no offset, blo
 	return (*cs->below[i]->write)(cs->below[i], nino, offset, block);
 }
 
+static int combinedisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct combinedisk_state *cs = bi->state;
+	unsigned int nino = ino;
+	unsigned int i = 0;
+	while ((int) (nino - cs->belowninodes[i]) >= 0) {
+		nino -= cs->belowninodes[i];
+		i++;
+	}
+	assert(i <= cs->nbelow);
+	return block_store_readv(cs->below[i], nino, offset, nblocks, blocks);
+}
+
+static int combinedisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct combinedisk_state *cs = bi->state;
+	unsigned int nino = ino;
+	unsigned int i = 0;
+	while ((int) (nino - cs->belowninodes[i]) >= 0) {
+		nino -= cs->belowninodes[i];
+		i++;
+	}
+	assert(i <= cs->nbelow);
+	return block_store_writev(cs->below[i], nino, offset, nblocks, blocks);
+}
+
 static void combinedisk_release(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -121,5 +145,7 @@ block_if combinedisk_init(block_if *below, unsigned int nbelow){
 	bi->write = combinedisk_write;
 	bi->release = combinedisk_release;
 	bi->sync = combinedisk_sync;
+	bi->readv = combinedisk_readv;
+	bi->writev = combinedisk_writev;
 	return bi;
 }
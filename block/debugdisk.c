@@ -62,6 +62,24 @@ static int debugdisk_write(block_if bi, unsigned int ino, block_no offset, block
 	return r;
 }
 
+static int debugdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct debugdisk_state *ds = bi->state;
+
+	fprintf(stderr, "%s: invoke readv(ino = %u, offset = %u, nblocks = %u)\n", ds->descr, ino, offset, nblocks);
+	int r = block_store_readv(ds->below, ino, offset, nblocks, blocks);
+	fprintf(stderr, "%s: readv(ino = %u, offset = %u, nblocks = %u) --> %d\n", ds->descr, ino, offset, nblocks, r);
+	return r;
+}
+
+static int debugdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct debugdisk_state *ds = bi->state;
+
+	fprintf(stderr, "%s: invoke writev(ino = %u, offset = %u, nblocks = %u)\n", ds->descr, ino, offset, nblocks);
+	int r = block_store_writev(ds->below, ino, offset, nblocks, blocks);
+	fprintf(stderr, "%s: writev(ino = %u, offset = %u, nblocks = %u) --> %d\n", ds->descr, ino, offset, nblocks, r);
+	return r;
+}
+
 static void debugdisk_release(block_if bi){
 	struct debugdisk_state *ds = bi->state;
 	fprintf(stderr, "%s: release()\n", ds->descr);
@@ -92,5 +110,7 @@ block_if debugdisk_init(block_if below, const char *descr){
 	bi->write = debugdisk_write;
 	bi->release = debugdisk_release;
 	bi->sync = debugdisk_sync;
+	bi->readv = debugdisk_readv;
+	bi->writev = debugdisk_writev;
 	return bi;
 }
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <egos/block_store.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,21 +8,52 @@
 #ifdef HW_FS
 #include "fatdisk.h"
 
+/* The superblock and the FAT are kept resident in memory (the FAT is only
+ * n_fatblocks blocks), and written back on sync and release.  In addition,
+ * each inode gets an index that maps file offsets to FAT entries.  It is
+ * built by following the (resident) FAT chain the first time the inode is
+ * touched, and kept up to date as the file grows.  Finding the block below
+ * of any offset is then O(1).
+ */
+
+#define FAT_EOF ((fatentry_no)-1) // end of a chain (or empty file)
+
 /* Temporary information about the file system and a particular inode.
  * Convenient for all operations. See "fatdisk.h" for field details.
  */
 struct fatdisk_snapshot {
-  union fatdisk_block superblock;
   union fatdisk_block inodeblock;
   block_no inode_blockno;
   unsigned int inode_no;
   struct fatdisk_inode *inode;
 };
 
+/* Offset -> FAT entry index of an inode.  entries[i] is the FAT entry (and
+ * thus the data block) of block i of the file.
+ */
+struct fatdisk_index {
+  fatentry_no *entries;
+  block_no nentries; // == nblocks of the inode
+  block_no size;     // # allocated entries
+};
+
 struct fatdisk_state {
   block_store_t *below;   // block store below
   unsigned int below_ino; // inode number to use for the block store below
   unsigned int ninodes;   // number of inodes
+
+  union fatdisk_block superblock; // resident superblock
+  bool super_dirty;               // superblock needs to be written back
+  struct fatdisk_fatentry *fat;   // resident FAT (n_fatblocks blocks)
+  bool *fat_dirty;                // per FAT block: needs to be written back
+  struct fatdisk_index *indexes;  // per inode; entries == 0 if not built
+
+  /* Statistics.
+   */
+  unsigned long nindex_builds; // # indexes built
+  unsigned long nchain_hops;   // # FAT entries followed to build indexes
+  unsigned long nfat_reads;    // # FAT blocks read from below
+  unsigned long nfat_writes;   // # FAT blocks written to below
 };
 
 static void panic(char *s) {
@@ -29,24 +61,26 @@ static void panic(char *s) {
   exit(1);
 }
 
+/* Block numbers below of the FAT and the data blocks.
+ */
+static block_no fatdisk_fat_start(struct fatdisk_state *fs) {
+  return 1 + fs->superblock.superblock.n_inodeblocks;
+}
+
+static block_no fatdisk_data_start(struct fatdisk_state *fs) {
+  return fatdisk_fat_start(fs) + fs->superblock.superblock.n_fatblocks;
+}
+
 static int fatdisk_get_snapshot(struct fatdisk_snapshot *snapshot,
                                 struct fatdisk_state *fs,
                                 unsigned int inode_no) {
   snapshot->inode_no = inode_no;
 
-  /* Get the super block.
-   */
-  if ((*fs->below->read)(fs->below, fs->below_ino, 0,
-                         (block_t *)&snapshot->superblock) < 0) {
-    return -1;
-  }
-
   /* Check the inode number.
    */
-  if (inode_no >=
-      snapshot->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
+  if (inode_no >= fs->ninodes) {
     fprintf(stderr, "!!FATDISK: inode number too large %u %u\n", inode_no,
-            snapshot->superblock.superblock.n_inodeblocks);
+            fs->superblock.superblock.n_inodeblocks);
     return -1;
   }
 
@@ -63,6 +97,94 @@ static int fatdisk_get_snapshot(struct fatdisk_snapshot *snapshot,
   return 0;
 }
 
+/* Write the inode block in the snapshot back.
+ */
+static int fatdisk_put_snapshot(struct fatdisk_snapshot *snapshot,
+                                struct fatdisk_state *fs) {
+  return (*fs->below->write)(fs->below, fs->below_ino, snapshot->inode_blockno,
+                             (block_t *)&snapshot->inodeblock);
+}
+
+/* Update a FAT entry in the resident FAT.
+ */
+static void fatdisk_set_next(struct fatdisk_state *fs, fatentry_no entry,
+                             fatentry_no next) {
+  fs->fat[entry].next = next;
+  fs->fat_dirty[entry / FAT_PER_BLOCK] = true;
+}
+
+/* Add an entry to the index of an inode.
+ */
+static void fatdisk_index_append(struct fatdisk_index *fi, fatentry_no entry) {
+  if (fi->nentries == fi->size) {
+    fi->size = fi->size == 0 ? 16 : fi->size * 2;
+    fi->entries = realloc(fi->entries, fi->size * sizeof(fatentry_no));
+  }
+  fi->entries[fi->nentries++] = entry;
+}
+
+static void fatdisk_index_drop(struct fatdisk_index *fi) {
+  free(fi->entries);
+  memset(fi, 0, sizeof(*fi));
+}
+
+/* Get the index of the inode in the snapshot, building it from the FAT
+ * chain if this is the first time the inode is touched.
+ */
+static struct fatdisk_index *fatdisk_get_index(struct fatdisk_state *fs,
+                                            struct fatdisk_snapshot *snapshot) {
+  struct fatdisk_index *fi = &fs->indexes[snapshot->inode_no];
+  if (fi->entries != 0) {
+    assert(fi->nentries == snapshot->inode->nblocks);
+    return fi;
+  }
+
+  fi->size = snapshot->inode->nblocks < 16 ? 16 : snapshot->inode->nblocks;
+  fi->entries = malloc(fi->size * sizeof(fatentry_no));
+  fi->nentries = 0;
+  fs->nindex_builds++;
+
+  fatentry_no f_entry_no = snapshot->inode->head;
+  block_no nfatentries = fs->superblock.superblock.n_fatblocks * FAT_PER_BLOCK;
+  while (fi->nentries < snapshot->inode->nblocks) {
+    if (f_entry_no >= nfatentries) {
+      fprintf(stderr, "!!FATDISK: bad FAT chain in inode %u\n",
+              snapshot->inode_no);
+      fatdisk_index_drop(fi);
+      return 0;
+    }
+    fi->entries[fi->nentries++] = f_entry_no;
+    f_entry_no = fs->fat[f_entry_no].next;
+    fs->nchain_hops++;
+  }
+  return fi;
+}
+
+/* Write back the superblock and the FAT blocks that were modified.
+ */
+static int fatdisk_flush(struct fatdisk_state *fs) {
+  if (fs->super_dirty) {
+    if ((*fs->below->write)(fs->below, fs->below_ino, 0,
+                            &fs->superblock.datablock) < 0) {
+      return -1;
+    }
+    fs->super_dirty = false;
+  }
+
+  block_no fat_start = fatdisk_fat_start(fs);
+  for (block_no i = 0; i < fs->superblock.superblock.n_fatblocks; i++) {
+    if (fs->fat_dirty[i]) {
+      if ((*fs->below->write)(fs->below, fs->below_ino, fat_start + i,
+                              (block_t *)&fs->fat[i * FAT_PER_BLOCK]) < 0) {
+        return -1;
+      }
+      fs->fat_dirty[i] = false;
+      fs->nfat_writes++;
+    }
+  }
+  return 0;
+}
+
 /* Create a new FAT file system on the specified inode of the block store below
  */
 int fatdisk_create(block_store_t *below, unsigned int below_ino,
@@ -124,7 +246,7 @@ int fatdisk_create(block_store_t *below, unsigned int below_ino,
       }
     }
 
-    if ((*below->write)(below, below_ino, offset, &f_block_inode.datablock) ==
+    if ((*below->write)(below, below_ino, offset, &f_block_fat.datablock) ==
         -1) {
       return -1;
     }
@@ -133,6 +255,7 @@ int fatdisk_create(block_store_t *below, unsigned int below_ino,
   }
 
   union fatdisk_block superblock;
+  memset(&superblock, 0, sizeof(superblock));
   superblock.superblock.n_inodeblocks = num_inodeblocks;
   superblock.superblock.n_fatblocks = num_fatblocks;
   superblock.superblock.fat_free_list = 0;
@@ -143,96 +266,106 @@ int fatdisk_create(block_store_t *below, unsigned int below_ino,
   return 0;
 }
 
+/* Release all the blocks of the inode in the snapshot to the free list.
+ * The chain is put in front of the free list as a whole.
+ */
 static void fatdisk_free_file(struct fatdisk_snapshot *snapshot,
-                              struct fatdisk_state *fs) {
-  // struct fatdisk_snapshot cur_snapshot;
-  // if (fatdisk_get_snapshot(&cur_snapshot, fs, ino) < 0) {
-  //   return -1;
-  // }
+                              struct fatdisk_state *fs,
+                              struct fatdisk_index *fi) {
+  if (snapshot->inode->nblocks > 0) {
+    fatentry_no last = fi->entries[fi->nentries - 1];
+    fatdisk_set_next(fs, last, fs->superblock.superblock.fat_free_list);
+    fs->superblock.superblock.fat_free_list = snapshot->inode->head;
+    fs->super_dirty = true;
+  }
+  snapshot->inode->head = FAT_EOF;
+  snapshot->inode->nblocks = 0;
+  fatdisk_index_drop(fi);
 }
 
-/* Write *block at the given block number 'offset'.
+/* Extend the file in the snapshot so that it has nblocks blocks, taking
+ * entries from the free list.  The new blocks other than the last one are
+ * zeroed (they would be holes in other file systems).  Nothing changes
+ * unless all of it succeeds.  The superblock and the FAT go out before the
+ * inode, so that a crash can leak entries but never hand them out twice.
  */
-static int fatdisk_write(block_store_t *this_bs, unsigned int ino,
-                         block_no offset, block_t *block) {
-  struct fatdisk_state *fs = this_bs->state;
-  struct fatdisk_snapshot snapshot;
-  if (offset >= snapshot.inode->nblocks) {
-    if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+static int fatdisk_extend(struct fatdisk_snapshot *snapshot,
+                          struct fatdisk_state *fs, struct fatdisk_index *fi,
+                          block_no nblocks) {
+  static block_t null_block;
+
+  /* The entries at the front of the free list are already chained, so
+   * they can be linked to the end of the file as a whole.
+   */
+  block_no nnew = nblocks - fi->nentries;
+  fatentry_no *entries = malloc(nnew * sizeof(fatentry_no));
+  fatentry_no entry = fs->superblock.superblock.fat_free_list;
+  for (block_no i = 0; i < nnew; i++) {
+    if (entry == FAT_EOF) {
+      fprintf(stderr, "!!FATDISK: file system is full\n");
+      free(entries);
       return -1;
     }
+    entries[i] = entry;
+    entry = fs->fat[entry].next;
+  }
 
-    // Expand fs
-    fatentry_no head = snapshot.superblock.superblock.fat_free_list;
-    fatentry_no tail = snapshot.superblock.superblock.fat_free_list;
-    fatentry_no prev_last = snapshot.superblock.superblock.fat_free_list;
-    for (int i = 0; i <= snapshot.inode->nblocks - 1; i++) {
-      union fatdisk_block fat;
-      int fat_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                       prev_last / FAT_PER_BLOCK;
-      if ((fs->below->read)(fs->below, fs->below_ino, fat_offset,
-                            &fat.datablock) == -1) {
-        return -1;
-      }
-
-      if (i == snapshot.inode->nblocks - 1) {
-        fat.fatblock.entries[prev_last % FAT_PER_BLOCK].next = head;
-      } else {
-        prev_last = fat.fatblock.entries[prev_last % FAT_PER_BLOCK].next;
-      }
+  for (block_no i = 0; i + 1 < nnew; i++) {
+    if ((*fs->below->write)(fs->below, fs->below_ino,
+                            fatdisk_data_start(fs) + entries[i],
+                            &null_block) < 0) {
+      free(entries);
+      return -1;
     }
+  }
 
-    for (int i = 0; i <= offset - snapshot.inode->nblocks; i++) {
-      union fatdisk_block fat;
-      int fat_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                       tail / FAT_PER_BLOCK;
-      if ((fs->below->read)(fs->below, fs->below_ino, fat_offset,
-                            &fat.datablock) == -1) {
-        return -1;
-      }
-
-      if (i == offset - snapshot.inode->nblocks) {
-        snapshot.superblock.superblock.fat_free_list =
-            fat.fatblock.entries[tail % FAT_PER_BLOCK].next;
-        fat.fatblock.entries[tail % FAT_PER_BLOCK].next = -1;
-      } else {
-        tail = fat.fatblock.entries[tail % FAT_PER_BLOCK].next;
-      }
-    }
+  /* Take them off the free list and link them to the end of the file.
+   */
+  fs->superblock.superblock.fat_free_list = entry;
+  fs->super_dirty = true;
+  fatdisk_set_next(fs, entries[nnew - 1], FAT_EOF);
+  if (fi->nentries == 0) {
+    snapshot->inode->head = entries[0];
+  } else {
+    fatdisk_set_next(fs, fi->entries[fi->nentries - 1], entries[0]);
+  }
+  for (block_no i = 0; i < nnew; i++) {
+    fatdisk_index_append(fi, entries[i]);
+  }
+  snapshot->inode->nblocks = fi->nentries;
+  free(entries);
 
-    snapshot.inodeblock.inodeblock.inodes[snapshot.inode_no].nblocks =
-        offset + 1;
-    if (snapshot.inodeblock.inodeblock.inodes[snapshot.inode_no].head == -1) {
-      snapshot.inodeblock.inodeblock.inodes[snapshot.inode_no].head = head;
-    }
+  if (fatdisk_flush(fs) < 0) {
+    return -1;
   }
+  return fatdisk_put_snapshot(snapshot, fs);
+}
 
+/* Write *block at the given block number 'offset'.
+ */
+static int fatdisk_write(block_store_t *this_bs, unsigned int ino,
+                         block_no offset, block_t *block) {
+  struct fatdisk_state *fs = this_bs->state;
+  struct fatdisk_snapshot snapshot;
   if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
     return -1;
   }
 
-  fatentry_no f_entry_no = snapshot.inode->head;
-  for (int i = 0; i < offset; i++) {
-    union fatdisk_block fat;
-    int fat_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                     f_entry_no / FAT_PER_BLOCK;
-    if ((fs->below->read)(fs->below, fs->below_ino, fat_offset,
-                          &fat.datablock) == -1) {
-      return -1;
-    }
-
-    f_entry_no = fat.fatblock.entries[f_entry_no % FAT_PER_BLOCK].next;
+  struct fatdisk_index *fi = fatdisk_get_index(fs, &snapshot);
+  if (fi == 0) {
+    return -1;
   }
 
-  int datablock_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                         snapshot.superblock.superblock.n_fatblocks +
-                         f_entry_no;
-  if ((fs->below->write)(fs->below, fs->below_ino, datablock_offset, block) ==
-      -1) {
-    return -1;
+  // Expand file
+  if (offset >= snapshot.inode->nblocks) {
+    if (fatdisk_extend(&snapshot, fs, fi, offset + 1) < 0) {
+      return -1;
+    }
   }
 
-  return 0;
+  return (*fs->below->write)(fs->below, fs->below_ino,
+                             fatdisk_data_start(fs) + fi->entries[offset],
+                             block);
 }
 
 /* Read a block at the given block number 'offset' and return in *block.
@@ -249,38 +382,95 @@ static int fatdisk_read(block_store_t *this_bs, unsigned int ino,
     return -1;
   }
 
-  fatentry_no f_entry_no = snapshot.inode->head;
-  for (int i = 0; i < offset; i++) {
-    union fatdisk_block fat;
-    int fat_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                     f_entry_no / FAT_PER_BLOCK;
-    if ((fs->below->read)(fs->below, fs->below_ino, fat_offset,
-                          &fat.datablock) == -1) {
-      return -1;
-    }
-
-    f_entry_no = fat.fatblock.entries[f_entry_no % FAT_PER_BLOCK].next;
+  struct fatdisk_index *fi = fatdisk_get_index(fs, &snapshot);
+  if (fi == 0) {
+    return -1;
   }
 
-  int datablock_offset = 1 + snapshot.superblock.superblock.n_inodeblocks +
-                         snapshot.superblock.superblock.n_fatblocks +
-                         f_entry_no;
-  if ((*fs->below->read)(fs->below, fs->below_ino, datablock_offset, &block) ==
-      -1) {
+  return (*fs->below->read)(fs->below, fs->below_ino,
+                            fatdisk_data_start(fs) + fi->entries[offset],
+                            block);
+}
+
+/* Fill in map[] with the block numbers below of blocks offset ..
+ * offset + nblocks - 1 of the inode in the snapshot.
+ */
+static int fatdisk_map_run(struct fatdisk_state *fs,
+                           struct fatdisk_snapshot *snapshot, block_no offset,
+                           block_no nblocks, block_no *map) {
+  struct fatdisk_index *fi = fatdisk_get_index(fs, snapshot);
+  if (fi == 0) {
     return -1;
   }
 
+  block_no data_start = fatdisk_data_start(fs);
+  for (block_no i = 0; i < nblocks; i++) {
+    map[i] = data_start + fi->entries[offset + i];
+  }
   return 0;
 }
 
-static int fatdisk_getninodes(block_store_t *this_bs) {
+/* Read a run of blocks, coalescing blocks that are consecutive below.
+ */
+static int fatdisk_readv(block_store_t *this_bs, unsigned int ino,
+                         block_no offset, block_no nblocks, block_t *blocks) {
   struct fatdisk_state *fs = this_bs->state;
-  union fatdisk_block superblock;
-  if ((*fs->below->read)(fs->below, fs->below_ino, 0, (block_t *)&superblock) <
-      0) {
+  struct fatdisk_snapshot snapshot;
+  if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+    return -1;
+  }
+
+  if (offset + nblocks > snapshot.inode->nblocks) {
+    return -1;
+  }
+
+  block_no *map = malloc(nblocks * sizeof(block_no));
+  int result = fatdisk_map_run(fs, &snapshot, offset, nblocks, map);
+  if (result == 0) {
+    result = block_store_readruns(fs->below, fs->below_ino, map, nblocks, blocks);
+  }
+  free(map);
+  return result;
+}
+
+/* Write a run of blocks.  Blocks within the file are overwritten in runs
+ * where possible.  Blocks beyond the end go through fatdisk_write, which
+ * extends the FAT chain.
+ */
+static int fatdisk_writev(block_store_t *this_bs, unsigned int ino,
+                          block_no offset, block_no nblocks, block_t *blocks) {
+  struct fatdisk_state *fs = this_bs->state;
+  struct fatdisk_snapshot snapshot;
+  if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
     return -1;
   }
-  return superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+
+  block_no ninside = 0;
+  if (offset < snapshot.inode->nblocks) {
+    ninside = snapshot.inode->nblocks - offset;
+    if (ninside > nblocks) {
+      ninside = nblocks;
+    }
+  }
+
+  int result = 0;
+  if (ninside > 0) {
+    block_no *map = malloc(ninside * sizeof(block_no));
+    result = fatdisk_map_run(fs, &snapshot, offset, ninside, map);
+    if (result == 0) {
+      result = block_store_writeruns(fs->below, fs->below_ino, map, ninside, blocks);
+    }
+    free(map);
+  }
+  for (block_no i = ninside; result == 0 && i < nblocks; i++) {
+    result = fatdisk_write(this_bs, ino, offset + i, &blocks[i]);
+  }
+  return result;
+}
+
+static int fatdisk_getninodes(block_store_t *this_bs) {
+  struct fatdisk_state *fs = this_bs->state;
+  return fs->ninodes;
 }
 
 /* Get size.
@@ -305,7 +495,9 @@ static int fatdisk_setsize(block_store_t *this_bs, unsigned int ino,
   struct fatdisk_state *fs = this_bs->state;
 
   struct fatdisk_snapshot snapshot;
-  fatdisk_get_snapshot(&snapshot, fs, ino);
+  if (fatdisk_get_snapshot(&snapshot, fs, ino) < 0) {
+    return -1;
+  }
   if (nblocks == snapshot.inode->nblocks) {
     return nblocks;
   }
@@ -314,21 +506,50 @@ static int fatdisk_setsize(block_store_t *this_bs, unsigned int ino,
     return -1;
   }
 
-  fatdisk_free_file(&snapshot, fs);
-  return 0;
+  struct fatdisk_index *fi = fatdisk_get_index(fs, &snapshot);
+  if (fi == 0) {
+    return -1;
+  }
+  block_no oldsize = snapshot.inode->nblocks;
+  fatdisk_free_file(&snapshot, fs, fi);
+  if (fatdisk_put_snapshot(&snapshot, fs) < 0) {
+    return -1;
+  }
+  return oldsize;
 }
 
 static void fatdisk_release(block_store_t *this_bs) {
-  free(this_bs->state);
+  struct fatdisk_state *fs = this_bs->state;
+
+  if (fatdisk_flush(fs) < 0) {
+    fprintf(stderr, "!!FATDISK: can't write back FAT\n");
+  }
+  for (unsigned int i = 0; i < fs->ninodes; i++) {
+    free(fs->indexes[i].entries);
+  }
+  free(fs->indexes);
+  free(fs->fat);
+  free(fs->fat_dirty);
+  free(fs);
   free(this_bs);
 }
 
 static int fatdisk_sync(block_if bi, unsigned int ino) {
   struct fatdisk_state *fs = bi->state;
+  if (fatdisk_flush(fs) < 0) {
+    return -1;
+  }
   return (*fs->below->sync)(fs->below, fs->below_ino);
 }
 
-static int ceil_int(int a, int b) { return a / b + (int)a % b != 0; }
+void fatdisk_dump_stats(block_if bi) {
+  struct fatdisk_state *fs = bi->state;
+
+  printf("!$FAT: #index builds: %lu\n", fs->nindex_builds);
+  printf("!$FAT: #chain hops:   %lu\n", fs->nchain_hops);
+  printf("!$FAT: #FAT reads:    %lu\n", fs->nfat_reads);
+  printf("!$FAT: #FAT writes:   %lu\n", fs->nfat_writes);
+}
 
 /* Open a new virtual block store at the given inode number of block store
  * "below".
@@ -340,6 +561,25 @@ block_store_t *fatdisk_init(block_store_t *below, unsigned int below_ino) {
   fs->below = below;
   fs->below_ino = below_ino;
 
+  /* Load the superblock and the FAT.
+   */
+  if ((*below->read)(below, below_ino, 0, &fs->superblock.datablock) < 0) {
+    free(fs);
+    return 0;
+  }
+  block_no n_fatblocks = fs->superblock.superblock.n_fatblocks;
+  fs->ninodes = fs->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+  fs->fat = calloc(n_fatblocks == 0 ? 1 : n_fatblocks, BLOCK_SIZE);
+  fs->fat_dirty = calloc(n_fatblocks == 0 ? 1 : n_fatblocks, sizeof(bool));
+  fs->indexes = calloc(fs->ninodes == 0 ? 1 : fs->ninodes,
+                       sizeof(struct fatdisk_index));
+  if (n_fatblocks > 0 &&
+      block_store_readv(below, below_ino, fatdisk_fat_start(fs), n_fatblocks,
+                        (block_t *)fs->fat) < 0) {
+    panic("fatdisk_init: can't read FAT");
+  }
+  fs->nfat_reads += n_fatblocks;
+
   /* Return a block interface to this block store.
    */
   block_store_t *this_bs = new_alloc(block_store_t);
@@ -351,6 +591,8 @@ block_store_t *fatdisk_init(block_store_t *below, unsigned int below_ino) {
   this_bs->write = fatdisk_write;
   this_bs->release = fatdisk_release;
   this_bs->sync = fatdisk_sync;
+  this_bs->readv = fatdisk_readv;
+  this_bs->writev = fatdisk_writev;
   return this_bs;
 }
 
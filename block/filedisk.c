@@ -92,6 +92,54 @@ static int filedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 	return 0;
 }
 
+static int filedisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct filedisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!filedisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset + nblocks > rs->nblocks) {
+		fprintf(stderr, "filedisk_readv: bad offset %u\n", offset);
+		return -1;
+	}
+
+	/* Read the part that has been written in one go, and return null
+	 * blocks for the rest.
+	 */
+	block_no nread = 0;
+	if (offset < rs->current) {
+		nread = rs->current - offset < nblocks ? rs->current - offset : nblocks;
+		fseek(rs->fp, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+		int n = fread(blocks, BLOCK_SIZE, nread, rs->fp);
+		assert(n == (int) nread);
+	}
+	memset(&blocks[nread], 0, (nblocks - nread) * BLOCK_SIZE);
+	return 0;
+}
+
+static int filedisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct filedisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!filedisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset + nblocks > rs->nblocks) {
+		fprintf(stderr, "filedisk_writev: bad offset\n");
+		return -1;
+	}
+	if (offset + nblocks > rs->current) {
+		rs->current = offset + nblocks;
+	}
+	fseek(rs->fp, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+	int n = fwrite(blocks, BLOCK_SIZE, nblocks, rs->fp);
+	assert(n == (int) nblocks);
+	return 0;
+}
+
 static void filedisk_release(block_store_t *this_bs){
 	struct filedisk_state *rs = this_bs->state;
 
@@ -135,5 +183,7 @@ block_store_t *filedisk_init(const char *file, block_no nblocks){
 	this_bs->write = filedisk_write;
 	this_bs->release = filedisk_release;
 	this_bs->sync = filedisk_sync;
+	this_bs->readv = filedisk_readv;
+	this_bs->writev = filedisk_writev;
 	return this_bs;
 }
@@ -62,6 +62,26 @@ static int mapdisk_write(block_if bi, unsigned int ino, block_no offset, block_t
 	return (*ms->below->write)(ms->below, ms->ino, offset, block);
 }
 
+static int mapdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	if (ino != 0) {
+		fprintf(stderr, "!!mapdisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	struct mapdisk_state *ms = bi->state;
+	return block_store_readv(ms->below, ms->ino, offset, nblocks, blocks);
+}
+
+static int mapdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	if (ino != 0) {
+		fprintf(stderr, "!!mapdisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	struct mapdisk_state *ms = bi->state;
+	return block_store_writev(ms->below, ms->ino, offset, nblocks, blocks);
+}
+
 static void mapdisk_release(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -95,5 +115,7 @@ block_if mapdisk_init(block_if below, unsigned int ino){
 	bi->write = mapdisk_write;
 	bi->release = mapdisk_release;
 	bi->sync = mapdisk_sync;
+	bi->readv = mapdisk_readv;
+	bi->writev = mapdisk_writev;
 	return bi;
 }
@@ -80,6 +80,46 @@ static int partdisk_write(block_if bi, unsigned int ino, block_no offset, block_
 	return (*ps->below->write)(ps->below, 0, noffset, block);
 }
 
+static int partdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	unsigned int ninodes = (unsigned int) partdisk_getninodes(bi);
+	if (ino >= ninodes) {
+		fprintf(stderr, "partdisk_readv: ino too large\n");
+		return -1;
+	}
+	if (offset + nblocks > ps->partsizes[ino]) {
+		fprintf(stderr, "partdisk_readv: offset too large\n");
+		return -1;
+	}
+	block_no noffset = offset;
+	unsigned int i = 0;
+	for (i = 0; i < ino; i++) {
+		noffset += ps->partsizes[i];
+	}
+	return block_store_readv(ps->below, 0, noffset, nblocks, blocks);
+}
+
+static int partdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	unsigned int ninodes = (unsigned int) partdisk_getninodes(bi);
+	if (ino >= ninodes) {
+		fprintf(stderr, "partdisk_writev: ino too large\n");
+		return -1;
+	}
+	if (offset + nblocks > ps->partsizes[ino]) {
+		fprintf(stderr, "partdisk_writev: offset too large\n");
+		return -1;
+	}
+	block_no noffset = offset;
+	unsigned int i = 0;
+	for (i = 0; i < ino; i++) {
+		noffset += ps->partsizes[i];
+	}
+	return block_store_writev(ps->below, 0, noffset, nblocks, blocks);
+}
+
 static void partdisk_release(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -112,5 +152,7 @@ block_if partdisk_init(block_if below, unsigned int ninodes, block_no partsizes[
 	bi->write = partdisk_write;
 	bi->release = partdisk_release;
 	bi->sync = partdisk_sync;
+	bi->readv = partdisk_readv;
+	bi->writev = partdisk_writev;
 	return bi;
 }
@@ -76,6 +76,33 @@ static int protdisk_write(block_if bi, unsigned int ino, block_no offset, block_
 	return r ? 0 : -1;
 }
 
+/* Read a run of blocks using as few round trips to the server as possible.
+ */
+static int protdisk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct protdisk_state *ps = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!PROTDISK: ino != 0 not supported\n");
+		return -1;
+	}
+
+	unsigned int n = nblocks;
+	bool r = block_readv(ps->below, ps->ino, offset, blocks, &n);
+	return r && n == nblocks ? 0 : -1;
+}
+
+static int protdisk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct protdisk_state *ps = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!PROTDISK: ino != 0 not supported\n");
+		return -1;
+	}
+
+	bool r = block_writev(ps->below, ps->ino, offset, blocks, nblocks);
+	return r ? 0 : -1;
+}
+
 static void protdisk_release(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -112,5 +139,7 @@ block_if protdisk_init(gpid_t below, unsigned int ino){
 	bi->write = protdisk_write;
 	bi->release = protdisk_release;
 	bi->sync = protdisk_sync;
+	bi->readv = protdisk_readv;
+	bi->writev = protdisk_writev;
 	return bi;
 }
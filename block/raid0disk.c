@@ -71,6 +71,55 @@ static int raid0disk_write(block_if bi, unsigned int ino, block_no offset, block
 	return (*rds->below[i]->write)(rds->below[i], ino, offset, block);
 }
 
+/* Blocks offset, offset + 1, ... are striped round-robin over the block
+ * stores below, so each block store below holds a run of consecutive
+ * blocks.  Gather each such run through a temporary buffer so that it can
+ * be moved with a single readv or writev.
+ */
+static int raid0disk_vector(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks, int write){
+	struct raid0disk_state *rds = bi->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!raid0disk_vector: ino != 0 not supported\n");
+		return -1;
+	}
+
+	block_t *buf = malloc(((nblocks + rds->nbelow - 1) / rds->nbelow) * BLOCK_SIZE);
+	for (unsigned int k = 0; k < rds->nbelow && k < nblocks; k++) {
+		block_no first = offset + k;		// first block on this disk
+		unsigned int i = first % rds->nbelow;
+		block_no n = (nblocks - k + rds->nbelow - 1) / rds->nbelow;
+		int r;
+
+		if (write) {
+			for (block_no j = 0; j < n; j++) {
+				buf[j] = blocks[k + j * rds->nbelow];
+			}
+			r = block_store_writev(rds->below[i], ino, first / rds->nbelow, n, buf);
+		}
+		else {
+			r = block_store_readv(rds->below[i], ino, first / rds->nbelow, n, buf);
+			for (block_no j = 0; r >= 0 && j < n; j++) {
+				blocks[k + j * rds->nbelow] = buf[j];
+			}
+		}
+		if (r < 0) {
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+static int raid0disk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	return raid0disk_vector(bi, ino, offset, nblocks, blocks, 0);
+}
+
+static int raid0disk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	return raid0disk_vector(bi, ino, offset, nblocks, blocks, 1);
+}
+
 static void raid0disk_release(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -112,5 +161,7 @@ block_if raid0disk_init(block_if *below, unsigned int nbelow){
 	bi->write = raid0disk_write;
 	bi->release = raid0disk_release;
 	bi->sync = raid0disk_sync;
+	bi->readv = raid0disk_readv;
+	bi->writev = raid0disk_writev;
 	return bi;
 }
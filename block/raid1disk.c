@@ -118,6 +118,44 @@ static int raid1disk_write(block_if bi, unsigned int ino, block_no offset, block
 	return result;
 }
 
+static int raid1disk_readv(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i;
+
+	/* Same as raid1disk_read, but for a run of blocks.
+	 */
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i]) {
+			continue;
+		}
+		if (block_store_readv(rds->below[i], ino, offset, nblocks, blocks) >= 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int raid1disk_writev(block_if bi, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i;
+	int result = -1;
+
+	/* Same as raid1disk_write, but for a run of blocks.
+	 */
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i]) {
+			continue;
+		}
+		if (block_store_writev(rds->below[i], ino, offset, nblocks, blocks) < 0) {
+			rds->broken[i] = 1;
+		}
+		else {
+			result = 0;
+		}
+	}
+	return result;
+}
+
 static void raid1disk_release(block_if bi){
 	struct raid1disk_state *rds = bi->state;
 
@@ -164,5 +202,7 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	bi->write = raid1disk_write;
 	bi->release = raid1disk_release;
 	bi->sync = raid1disk_sync;
+	bi->readv = raid1disk_readv;
+	bi->writev = raid1disk_writev;
 	return bi;
 }
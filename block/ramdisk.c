@@ -78,6 +78,38 @@ static int ramdisk_write(block_store_t *this_bs, unsigned int ino, block_no offs
 	return 0;
 }
 
+static int ramdisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct ramdisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ramdisk_readv: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset + nblocks > rs->nblocks) {
+		fprintf(stderr, "ramdisk_readv: bad offset %u\n", offset);
+		return -1;
+	}
+	memcpy(blocks, &rs->blocks[offset], nblocks * BLOCK_SIZE);
+	return 0;
+}
+
+static int ramdisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct ramdisk_state *rs = this_bs->state;
+
+	if (ino != 0) {
+		fprintf(stderr, "!!ramdisk_writev: ino != 0 not supported\n");
+		return -1;
+	}
+
+	if (offset + nblocks > rs->nblocks) {
+		fprintf(stderr, "ramdisk_writev: bad offset\n");
+		return -1;
+	}
+	memcpy(&rs->blocks[offset], blocks, nblocks * BLOCK_SIZE);
+	return 0;
+}
+
 static void ramdisk_release(block_store_t *this_bs){
 	free(this_bs->state);
 	free(this_bs);
@@ -103,5 +135,7 @@ block_store_t *ramdisk_init(block_t *blocks, block_no nblocks){
 	this_bs->write = ramdisk_write;
 	this_bs->release = ramdisk_release;
 	this_bs->sync = ramdisk_sync;
+	this_bs->readv = ramdisk_readv;
+	this_bs->writev = ramdisk_writev;
 	return this_bs;
 }
@@ -24,6 +24,9 @@ struct statdisk_state {
 	unsigned int nread;		// #read operations
 	unsigned int nwrite;	// #write operations
 	unsigned int nsync;		// #sync operations
+	unsigned int nreadv;	// #readv operations
+	unsigned int nwritev;	// #writev operations
+	unsigned int nvblocks;	// #blocks moved by readv and writev
 };
 
 static int statdisk_getninodes(block_store_t *this_bs){
@@ -58,6 +61,20 @@ static int statdisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 	return (*sds->below->write)(sds->below, ino, offset, block);
 }
 
+static int statdisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	sds->nreadv++;
+	sds->nvblocks += nblocks;
+	return block_store_readv(sds->below, ino, offset, nblocks, blocks);
+}
+
+static int statdisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	sds->nwritev++;
+	sds->nvblocks += nblocks;
+	return block_store_writev(sds->below, ino, offset, nblocks, blocks);
+}
+
 static void statdisk_release(block_store_t *this_bs){
 	free(this_bs->state);
 	free(this_bs);
@@ -77,6 +94,9 @@ void statdisk_dump_stats(block_store_t *this_bs){
 	printf("!$STAT: #read:     %u\n", sds->nread);
 	printf("!$STAT: #write:    %u\n", sds->nwrite);
 	printf("!$STAT: #sync:     %u\n", sds->nsync);
+	printf("!$STAT: #readv:    %u\n", sds->nreadv);
+	printf("!$STAT: #writev:   %u\n", sds->nwritev);
+	printf("!$STAT: #vblocks:  %u\n", sds->nvblocks);
 }
 
 block_store_t *statdisk_init(block_store_t *below){
@@ -96,5 +116,7 @@ block_store_t *statdisk_init(block_store_t *below){
 	this_bs->write = statdisk_write;
 	this_bs->release = statdisk_release;
 	this_bs->sync = statdisk_sync;
+	this_bs->readv = statdisk_readv;
+	this_bs->writev = statdisk_writev;
 	return this_bs;
 }
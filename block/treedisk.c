@@ -22,35 +22,78 @@
  *			Opens a virtual block store within inode below_ino of the block store below.
  *
  * The layout of the file system is described in the file "treedisk.h".
+ *
+ * The superblock and the inode blocks are kept resident in memory and
+ * written back on sync (and release).  The in-memory copy is shared by
+ * all treedisk instances opened on the same inode of the same block
+ * store below, so opening it twice does not lead to stale copies.  In
+ * addition, for a few recently used inodes, the last indirect block on
+ * the path from the root to a data block is cached along with them, so
+ * that sequential accesses do not walk the whole tree each time.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 #include <egos/block_store.h>
 #include "treedisk.h"
 
-/* Temporary information about the file system and a particular inode.
- * Convenient for all operations. See "treedisk.h" for field details.
+/* Information about the file system and a particular inode.  Convenient
+ * for all operations.  The pointers refer to the resident metadata (see
+ * below).  See "treedisk.h" for field details.
  */
 struct treedisk_snapshot {
-	union treedisk_block superblock; 
-	union treedisk_block inodeblock; 
+	union treedisk_block *superblock;
+	union treedisk_block *inodeblock;
 	block_no inode_blockno;
 	struct treedisk_inode *inode;
 };
 
+/* Cached path to a data block: the last indirect block on the path from
+ * the root of the inode.  It is valid as long as the shape of the tree
+ * (root and #levels) is unchanged and no block was allocated in the inode.
+ */
+#define TREEDISK_NPATHS		16		// # entries in the path cache
+
+struct treedisk_path {
+	bool valid;
+	unsigned int ino;				// inode number
+	block_no root;					// root of the inode when cached
+	unsigned int nlevels;			// # levels of the tree when cached
+	block_no index;					// offset >> log_rpb of the data blocks covered
+	struct treedisk_indirblock tib;	// contents of the indirect block
+};
+
+/* Resident copy of the superblock and the inode blocks of a treedisk file
+ * system.  There is one of these per (below, below_ino) pair, shared by
+ * all treedisk instances opened on it.
+ */
+struct treedisk_meta {
+	struct treedisk_meta *next;		// linked list of all resident metadata
+	block_store_t *below;			// block store below
+	unsigned int below_ino;			// inode number in the block store below
+	unsigned int refcnt;			// # treedisk instances using this
+	union treedisk_block superblock;
+	union treedisk_block *inodeblocks;	// superblock.n_inodeblocks of these
+	bool super_dirty;				// superblock needs to be written back
+	bool *inode_dirty;				// per inode block: needs to be written back
+	struct treedisk_path paths[TREEDISK_NPATHS];	// path cache
+};
+
 /* The state of a virtual block store, which is identified by an inode number.
  */
 struct treedisk_state {
 	block_store_t *below;			// block store below
 	unsigned int below_ino;			// inode number to use for the block store below
 	unsigned int ninodes;			// number of inodes in the treedisk
+	struct treedisk_meta *meta;		// resident superblock and inode blocks
 };
 
 static unsigned int log_rpb;		// log2(REFS_PER_BLOCK)
 static block_t null_block;			// a block filled with null bytes
+static struct treedisk_meta *treedisk_metas;	// all resident metadata
 
 static void panic(const char *s){
 	fprintf(stderr, "Panic: %s\n", s);
@@ -67,34 +110,105 @@ static block_no log_shift_r(block_no x, unsigned int nbits){
 	return x >> nbits;
 }
 
+/* Find the resident metadata of the file system on the given inode of the
+ * block store below.
+ */
+static struct treedisk_meta *treedisk_meta_find(block_store_t *below, unsigned int below_ino){
+	struct treedisk_meta *tm;
+
+	for (tm = treedisk_metas; tm != 0; tm = tm->next) {
+		if (tm->below == below && tm->below_ino == below_ino) {
+			return tm;
+		}
+	}
+	return 0;
+}
+
+/* (Re)load the superblock and the inode blocks from the block store below.
+ */
+static int treedisk_meta_load(struct treedisk_meta *tm){
+	if ((*tm->below->read)(tm->below, tm->below_ino, 0, (block_t *) &tm->superblock) < 0) {
+		return -1;
+	}
+	block_no n = tm->superblock.superblock.n_inodeblocks;
+
+	free(tm->inodeblocks);
+	free(tm->inode_dirty);
+	tm->inodeblocks = calloc(n == 0 ? 1 : n, sizeof(*tm->inodeblocks));
+	tm->inode_dirty = calloc(n == 0 ? 1 : n, sizeof(*tm->inode_dirty));
+	tm->super_dirty = false;
+	if (n > 0 && block_store_readv(tm->below, tm->below_ino, 1, n, (block_t *) tm->inodeblocks) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Write back the superblock and inode blocks if they were modified.
+ */
+static int treedisk_meta_flush(struct treedisk_meta *tm){
+	if (tm->super_dirty) {
+		if ((*tm->below->write)(tm->below, tm->below_ino, 0, (block_t *) &tm->superblock) < 0) {
+			return -1;
+		}
+		tm->super_dirty = false;
+	}
+
+	block_no i;
+	for (i = 0; i < tm->superblock.superblock.n_inodeblocks; i++) {
+		if (tm->inode_dirty[i]) {
+			if ((*tm->below->write)(tm->below, tm->below_ino, 1 + i, (block_t *) &tm->inodeblocks[i]) < 0) {
+				return -1;
+			}
+			tm->inode_dirty[i] = false;
+		}
+	}
+	return 0;
+}
+
 /* Get a snapshot of the file system, including the superblock and the block
- * containing the inode, from the block store below.
+ * containing the inode.  These are resident, so this does no I/O.
  */
 static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 								struct treedisk_state *ts, unsigned int inode_no){
-	/* Get the superblock.
-	 */
-	if ((*ts->below->read)(ts->below, ts->below_ino, 0, (block_t *) &snapshot->superblock) < 0) {
-		return -1;
-	}
+	struct treedisk_meta *tm = ts->meta;
 
 	/* Check the inode number.
 	 */
-	if (inode_no >= snapshot->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
-		fprintf(stderr, "!!TDERR: inode number too large %u %u\n", inode_no, snapshot->superblock.superblock.n_inodeblocks);
+	snapshot->superblock = &tm->superblock;
+	if (inode_no >= tm->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
+		fprintf(stderr, "!!TDERR: inode number too large %u %u\n", inode_no, tm->superblock.superblock.n_inodeblocks);
 		return -1;
 	}
 
 	/* Find the inode.
 	 */
 	snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
-	if ((*ts->below->read)(ts->below, ts->below_ino, snapshot->inode_blockno, (block_t *) &snapshot->inodeblock) < 0) {
-		return -1;
-	}
-	snapshot->inode = &snapshot->inodeblock.inodeblock.inodes[inode_no % INODES_PER_BLOCK];
+	snapshot->inodeblock = &tm->inodeblocks[snapshot->inode_blockno - 1];
+	snapshot->inode = &snapshot->inodeblock->inodeblock.inodes[inode_no % INODES_PER_BLOCK];
 	return 0;
 }
 
+/* The superblock or the inode block in the snapshot has been modified.
+ */
+static void treedisk_dirty_super(struct treedisk_state *ts){
+	ts->meta->super_dirty = true;
+}
+
+static void treedisk_dirty_inode(struct treedisk_state *ts, struct treedisk_snapshot *snapshot){
+	ts->meta->inode_dirty[snapshot->inode_blockno - 1] = true;
+}
+
+/* Drop the cached path of the given inode.  Called whenever blocks are
+ * allocated or freed in the inode.
+ */
+static void treedisk_path_invalidate(struct treedisk_state *ts, unsigned int ino){
+	struct treedisk_path *tp = &ts->meta->paths[ino % TREEDISK_NPATHS];
+
+	if (tp->ino == ino) {
+		tp->valid = false;
+	}
+}
+
 /* Allocate a block from the free list.
  */
 static block_no treedisk_alloc_block(struct treedisk_state *ts, struct treedisk_snapshot *snapshot){
@@ -103,7 +217,7 @@ static block_no treedisk_alloc_block(struct treedisk_state *ts, struct treedisk_
 	static int count;
 	count++;
 
-	if ((b = snapshot->superblock.superblock.free_list) == 0) {
+	if ((b = snapshot->superblock->superblock.free_list) == 0) {
 		panic("treedisk_alloc_block: block store is full\n");
 	}
 
@@ -121,15 +235,18 @@ static block_no treedisk_alloc_block(struct treedisk_state *ts, struct treedisk_
 	}
 
 	/* If there is a free block reference use that.  Otherwise use
-	 * the free list block itself and update the superblock.
+	 * the free list block itself and update the superblock.  The
+	 * superblock has to go out before the caller overwrites the old
+	 * head, or a crash would leave it pointing at a data block.
 	 */
 	block_no free_blockno;
 	if (i == 0) {
 		free_blockno = b;
-		snapshot->superblock.superblock.free_list = freelistblock.freelistblock.refs[0];
-		if ((*ts->below->write)(ts->below, ts->below_ino, 0, (block_t *) &snapshot->superblock) < 0) {
+		snapshot->superblock->superblock.free_list = freelistblock.freelistblock.refs[0];
+		if ((*ts->below->write)(ts->below, ts->below_ino, 0, (block_t *) snapshot->superblock) < 0) {
 			panic("treedisk_alloc_block: superblock");
 		}
+		ts->meta->super_dirty = false;
 	}
 	else {
 		free_blockno = freelistblock.freelistblock.refs[i];
@@ -157,11 +274,9 @@ static void treedisk_free_block(struct treedisk_state *ts, struct treedisk_snaps
 
 	// get the head of free list
 	block_no b;
-	if ((b = snapshot->superblock.superblock.free_list) == 0) {
-		snapshot->superblock.superblock.free_list = target;
-		if ((*ts->below->write)(ts->below, ts->below_ino, 0, (block_t*) &snapshot->superblock) < 0) {
-			panic("treedisk_free_block: superblock");
-		}
+	if ((b = snapshot->superblock->superblock.free_list) == 0) {
+		snapshot->superblock->superblock.free_list = target;
+		treedisk_dirty_super(ts);
 		return;
 	}
 
@@ -187,10 +302,8 @@ static void treedisk_free_block(struct treedisk_state *ts, struct treedisk_snaps
 	} else {
 		// target becomes the new head of freelist
 		((struct treedisk_freelistblock *)(zeros))->refs[0] = b;
-		snapshot->superblock.superblock.free_list = target;
-		if ((*ts->below->write)(ts->below, ts->below_ino, 0, (block_t *) &snapshot->superblock) < 0) {
-			panic("treedisk_free_block: superblock");
-		}
+		snapshot->superblock->superblock.free_list = target;
+		treedisk_dirty_super(ts);
 		if ((*ts->below->write)(ts->below, ts->below_ino, target, (block_t *) zeros) < 0) {
 			panic("treedisk_free_block: target block");
 		}
@@ -246,11 +359,7 @@ static void treedisk_free_file(struct treedisk_state *ts, struct treedisk_snapsh
 
 static int treedisk_getninodes(block_store_t *this_bs){
 	struct treedisk_state *ts = this_bs->state;
-	union treedisk_block superblock;
-	if ((*ts->below->read)(ts->below, ts->below_ino, 0, (block_t *) &superblock) < 0) {
-		return -1;
-	}
-	return superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+	return ts->meta->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
 }
 
 /* Retrieve the number of blocks in the file referenced by 'this_bs'.  This
@@ -272,7 +381,9 @@ static int treedisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
 	struct treedisk_state *ts = this_bs->state;
 
 	struct treedisk_snapshot snapshot;
-	treedisk_get_snapshot(&snapshot, ts, ino);
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
+		return -1;
+	}
 	if (nblocks == snapshot.inode->nblocks) {
 		return nblocks;
 	}
@@ -283,19 +394,82 @@ static int treedisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
 	block_no oldsize = snapshot.inode->nblocks;
 
 	//Release all the blocks used by this inode.
+	treedisk_path_invalidate(ts, ino);
 	treedisk_free_file(ts, &snapshot);
 
 	snapshot.inode->nblocks = 0;
 	snapshot.inode->root = 0;
-	if ((*ts->below->write)(ts->below, ts->below_ino, snapshot.inode_blockno, (block_t*) &snapshot.inodeblock) < 0) {
-		panic("treedisk_free_block: inode block");
-	}
+	treedisk_dirty_inode(ts, &snapshot);
 	return oldsize;
 
 	fprintf(stderr, "!!TDERR: setsize not supported\n");
 	return -1;
 }
 
+/* Figure out how many levels of indirect blocks there are in the tree
+ * of the given inode.
+ */
+static unsigned int treedisk_nlevels(struct treedisk_inode *inode){
+	unsigned int nlevels = 0;
+
+	if (inode->nblocks > 0) {
+		while (log_shift_r(inode->nblocks - 1, nlevels * log_rpb) != 0) {
+			nlevels++;
+		}
+	}
+	return nlevels;
+}
+
+/* Find the block number below of the block at the given block number
+ * 'offset' of the inode in the snapshot, without reading the block itself.
+ * *result is set to 0 if the block is a hole.  The last indirect block
+ * on the path is remembered in the path cache of the inode.
+ */
+static int treedisk_lookup(struct treedisk_state *ts, struct treedisk_snapshot *snapshot,
+						unsigned int ino, block_no offset, block_no *result){
+	unsigned int nlevels = treedisk_nlevels(snapshot->inode);
+	block_no b = snapshot->inode->root;
+
+	if (nlevels == 0 || b == 0) {
+		*result = b;
+		return 0;
+	}
+
+	/* See if the path is cached.
+	 */
+	struct treedisk_path *tp = &ts->meta->paths[ino % TREEDISK_NPATHS];
+	block_no index = log_shift_r(offset, log_rpb);
+	if (tp->valid && tp->ino == ino && tp->root == b &&
+							tp->nlevels == nlevels && tp->index == index) {
+		*result = tp->tib.refs[offset % REFS_PER_BLOCK];
+		return 0;
+	}
+
+	/* Walk down from the root block through the indirect blocks.
+	 */
+	tp->valid = false;
+	while (b != 0 && nlevels > 0) {
+		if ((*ts->below->read)(ts->below, ts->below_ino, b, (block_t *) &tp->tib) < 0) {
+			return -1;
+		}
+		nlevels--;
+		unsigned int i = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
+		b = tp->tib.refs[i];
+	}
+
+	/* If we got all the way down to the last indirect block, cache it.
+	 */
+	if (nlevels == 0) {
+		tp->valid = true;
+		tp->ino = ino;
+		tp->root = snapshot->inode->root;
+		tp->nlevels = treedisk_nlevels(snapshot->inode);
+		tp->index = index;
+	}
+	*result = b;
+	return 0;
+}
+
 /* Read a block at the given block number 'offset' and return in *block.
  */
 static int treedisk_read(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
@@ -315,77 +489,61 @@ static int treedisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
 		return -1;
 	}
 
-	/* Figure out how many levels there are in the tree.
+	/* Find the data block.  If there's a hole, return the null block.
 	 */
-	unsigned int nlevels = 0;
-	if (snapshot.inode->nblocks > 0) {
-		while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) != 0) {
-			nlevels++;
-		}
+	block_no b;
+	if (treedisk_lookup(ts, &snapshot, ino, offset, &b) < 0) {
+		return -1;
 	}
-
-	/* Walk down from the root block.
-	 */
-	block_no b = snapshot.inode->root;
-	for (;;) {
-		/* If there's a hole, return the null block.
-		 */
-		if (b == 0) {
-			memset(block, 0, BLOCK_SIZE);
-			return 0;
-		}
-
-		/* Return the next level.  If the last level, we're done.
-		 */
-		int result = (*ts->below->read)(ts->below, ts->below_ino, b, block);
-		if (result < 0) {
-			return result;
-		}
-		if (nlevels == 0) {
-			return 0;
-		}
-
-		/* The block is an indirect block.  Figure out the index into this
-		 * block and get the block number.
-		 */
-		nlevels--;
-		struct treedisk_indirblock *tib = (struct treedisk_indirblock *) block;
-		unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
-		b = tib->refs[index];
+	if (b == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
 	}
-	return 0;
+	return (*ts->below->read)(ts->below, ts->below_ino, b, block);
 }
 
 /* Write *block at the given block number 'offset'.
  */
 static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no offset, block_t *block){
 	struct treedisk_state *ts = this_bs->state;
-	int dirty_inode = 0;
 
 	/* Get info from underlying file system.
 	 */
-	struct treedisk_snapshot *snapshot = malloc(sizeof(*snapshot));
-	if (treedisk_get_snapshot(snapshot, ts, ino) < 0) {
-		free(snapshot);
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
 		return -1;
 	}
 
-	/* Figure out how many levels there are in the tree now.
+	/* Common case: the block already exists and can be overwritten in place.
 	 */
-	unsigned int nlevels = 0;
-	if (snapshot->inode->nblocks > 0) {
-		while (log_shift_r(snapshot->inode->nblocks - 1, nlevels * log_rpb) != 0) {
-			nlevels++;
+	block_no b;
+	if (offset < snapshot.inode->nblocks) {
+		if (treedisk_lookup(ts, &snapshot, ino, offset, &b) < 0) {
+			return -1;
+		}
+		if (b != 0) {
+			if ((*ts->below->write)(ts->below, ts->below_ino, b, block) < 0) {
+				panic("treedisk_write: data block");
+			}
+			return 0;
 		}
 	}
 
+	/* Blocks are going to be allocated, so the cached path may change.
+	 */
+	treedisk_path_invalidate(ts, ino);
+
+	/* Figure out how many levels there are in the tree now.
+	 */
+	unsigned int nlevels = treedisk_nlevels(snapshot.inode);
+
 	/* Figure out how many levels we need after writing.  Files cannot shrink
 	 * by writing.
 	 */
 	unsigned int nlevels_after;
-	if (offset >= snapshot->inode->nblocks) {
-		snapshot->inode->nblocks = offset + 1;
-		dirty_inode = 1;
+	if (offset >= snapshot.inode->nblocks) {
+		snapshot.inode->nblocks = offset + 1;
+		treedisk_dirty_inode(ts, &snapshot);
 		nlevels_after = 0;
 		while (log_shift_r(offset, nlevels_after * log_rpb) != 0) {
 			nlevels_after++;
@@ -397,20 +555,20 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 
 	/* Grow the number of levels as needed by inserting indirect blocks.
 	 */
-	if (snapshot->inode->nblocks == 0) {
+	if (snapshot.inode->nblocks == 0) {
 		nlevels = nlevels_after;
 	}
 	else if (nlevels_after > nlevels) {
 		while (nlevels_after > nlevels) {
-			block_no indir = treedisk_alloc_block(ts, snapshot);
+			block_no indir = treedisk_alloc_block(ts, &snapshot);
 
 			/* Insert the new indirect block into the inode.
 			 */
 			struct treedisk_indirblock tib;
 			memset(&tib, 0, BLOCK_SIZE);
-			tib.refs[0] = snapshot->inode->root;
-			snapshot->inode->root = indir;
-			dirty_inode = 1;
+			tib.refs[0] = snapshot.inode->root;
+			snapshot.inode->root = indir;
+			treedisk_dirty_inode(ts, &snapshot);
 			if ((*ts->below->write)(ts->below, ts->below_ino, indir, (block_t *) &tib) < 0) {
 				panic("treedisk_write: indirect block");
 			}
@@ -419,28 +577,23 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 		}
 	}
 
-	/* If the inode block was updated, write it back now.
-	 */
-	if (dirty_inode) {
-		if ((*ts->below->write)(ts->below, ts->below_ino, snapshot->inode_blockno, (block_t *) &snapshot->inodeblock) < 0) {
-			panic("treedisk_write: inode block");
-		}
-	}
-
 	/* Find the block by walking the tree, allocating new blocks
-	 * (and indirect blocks) if necessary.
+	 * (and indirect blocks) if necessary.  The inode block itself is
+	 * resident and only needs to be marked dirty.
 	 */
-	block_no b;
-	block_no *parent_no = &snapshot->inode->root;
-	block_no parent_off = snapshot->inode_blockno;
-	block_t *parent_block = (block_t *) &snapshot->inodeblock;
+	block_no *parent_no = &snapshot.inode->root;
+	block_no parent_off = 0;
+	block_t *parent_block = 0;
+	struct treedisk_indirblock tib;
 	for (;;) {
 		/* Get or allocate the next block.
 		 */
-		struct treedisk_indirblock tib;
 		if ((b = *parent_no) == 0) {
-			b = *parent_no = treedisk_alloc_block(ts, snapshot);
-			if ((*ts->below->write)(ts->below, ts->below_ino, parent_off, parent_block) < 0) {
+			b = *parent_no = treedisk_alloc_block(ts, &snapshot);
+			if (parent_block == 0) {
+				treedisk_dirty_inode(ts, &snapshot);
+			}
+			else if ((*ts->below->write)(ts->below, ts->below_ino, parent_off, parent_block) < 0) {
 				panic("treedisk_write: parent");
 			}
 			if (nlevels == 0) {
@@ -468,17 +621,103 @@ static int treedisk_write(block_store_t *this_bs, unsigned int ino, block_no off
 	if ((*ts->below->write)(ts->below, ts->below_ino, b, block) < 0) {
 		panic("treedisk_write: data block");
 	}
-	free(snapshot);
 	return 0;
 }
 
+/* Read a run of blocks.  The data blocks are located first, so that runs
+ * of them that are consecutive below can be read with a single readv.
+ */
+static int treedisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset,
+										block_no nblocks, block_t *blocks){
+	struct treedisk_state *ts = this_bs->state;
+
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
+		return -1;
+	}
+	if (offset + nblocks > snapshot.inode->nblocks) {
+		fprintf(stderr, "!!TDERR: offset too large %u %u\n", offset + nblocks, snapshot.inode->nblocks);
+		return -1;
+	}
+
+	block_no *map = malloc(nblocks * sizeof(block_no));
+	for (block_no i = 0; i < nblocks; i++) {
+		if (treedisk_lookup(ts, &snapshot, ino, offset + i, &map[i]) < 0) {
+			free(map);
+			return -1;
+		}
+		if (map[i] == 0) {
+			map[i] = BLOCK_NONE;
+			memset(&blocks[i], 0, BLOCK_SIZE);
+		}
+	}
+	int result = block_store_readruns(ts->below, ts->below_ino, map, nblocks, blocks);
+	free(map);
+	return result;
+}
+
+/* Write a run of blocks.  Blocks that already exist are overwritten in
+ * place, in runs where possible.  The others need allocation and go
+ * through treedisk_write one at a time.
+ */
+static int treedisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset,
+										block_no nblocks, block_t *blocks){
+	struct treedisk_state *ts = this_bs->state;
+
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) {
+		return -1;
+	}
+
+	block_no *map = malloc(nblocks * sizeof(block_no));
+	for (block_no i = 0; i < nblocks; i++) {
+		map[i] = 0;
+		if (offset + i < snapshot.inode->nblocks &&
+					treedisk_lookup(ts, &snapshot, ino, offset + i, &map[i]) < 0) {
+			free(map);
+			return -1;
+		}
+		if (map[i] == 0) {
+			map[i] = BLOCK_NONE;
+		}
+	}
+	int result = block_store_writeruns(ts->below, ts->below_ino, map, nblocks, blocks);
+	for (block_no i = 0; result == 0 && i < nblocks; i++) {
+		if (map[i] == BLOCK_NONE) {
+			result = treedisk_write(this_bs, ino, offset + i, &blocks[i]);
+		}
+	}
+	free(map);
+	return result;
+}
+
 static void treedisk_release(block_store_t *this_bs){
-	free(this_bs->state);
+	struct treedisk_state *ts = this_bs->state;
+	struct treedisk_meta *tm = ts->meta, **ptm;
+
+	/* Write back the metadata, and free it if this is the last user.
+	 */
+	if (treedisk_meta_flush(tm) < 0) {
+		fprintf(stderr, "!!TDERR: treedisk_release: can't write back metadata\n");
+	}
+	if (--tm->refcnt == 0) {
+		for (ptm = &treedisk_metas; *ptm != tm; ptm = &(*ptm)->next)
+			;
+		*ptm = tm->next;
+		free(tm->inodeblocks);
+		free(tm->inode_dirty);
+		free(tm);
+	}
+
+	free(ts);
 	free(this_bs);
 }
 
 static int treedisk_sync(block_store_t *this_bs, unsigned int ino){
 	struct treedisk_state *ts = this_bs->state;
+	if (treedisk_meta_flush(ts->meta) < 0) {
+		return -1;
+	}
 	return (*ts->below->sync)(ts->below, ts->below_ino);
 }
 
@@ -499,6 +738,28 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int below_ino){
 	ts->below = below;
 	ts->below_ino = below_ino;
 
+	/* Share the resident metadata if the file system is already open,
+	 * or load it otherwise.
+	 */
+	struct treedisk_meta *tm = treedisk_meta_find(below, below_ino);
+	if (tm == 0) {
+		tm = new_alloc(struct treedisk_meta);
+		tm->below = below;
+		tm->below_ino = below_ino;
+		if (treedisk_meta_load(tm) < 0) {
+			fprintf(stderr, "!!TDERR: treedisk_init: can't read metadata\n");
+			free(tm->inodeblocks);
+			free(tm->inode_dirty);
+			free(tm);
+			free(ts);
+			return 0;
+		}
+		tm->next = treedisk_metas;
+		treedisk_metas = tm;
+	}
+	tm->refcnt++;
+	ts->meta = tm;
+
 	/* Return a block interface to this inode.
 	 */
 	block_store_t *this_bs = new_alloc(block_store_t);
@@ -510,6 +771,8 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int below_ino){
 	this_bs->write = treedisk_write;
 	this_bs->release = treedisk_release;
 	this_bs->sync = treedisk_sync;
+	this_bs->readv = treedisk_readv;
+	this_bs->writev = treedisk_writev;
 	return this_bs;
 }
 
@@ -593,6 +856,17 @@ int treedisk_create(block_store_t *below, unsigned int below_ino, unsigned int n
 		printf("treedisk: Attempted to create a new filesystem, but one already exists with %lu inodes\n",
 			superblock.superblock.n_inodeblocks * INODES_PER_BLOCK);
 		assert(superblock.superblock.n_inodeblocks >= n_inodeblocks);
+		return 0;
+	}
+
+	/* If the file system is open already, its resident metadata is stale.
+	 */
+	struct treedisk_meta *tm = treedisk_meta_find(below, below_ino);
+	if (tm != 0) {
+		memset(tm->paths, 0, sizeof(tm->paths));
+		if (treedisk_meta_load(tm) < 0) {
+			return -1;
+		}
 	}
 
 	return 0;
@@ -20,6 +20,18 @@
  *  We were unable to test the triple indirect pointers because our test suite
  *  does not allocate enough data blocks in RAM for the triple indirect pointers
  *  to be used.
+ *
+ *  Allocation: the free list on disk is loaded into an in-memory bitmap at
+ *  init time, and all allocation decisions are made using the bitmap.  The
+ *  free list is rewritten from the bitmap on sync and release.  Data blocks
+ *  are allocated right after the previous data block of the inode when
+ *  possible, and otherwise at the start of a free run large enough for the
+ *  blocks being allocated, so that sequentially written files are laid out
+ *  contiguously.  Indirect blocks are taken from the top of the disk so they
+ *  do not break up data runs.  setsize() with a size larger than the
+ *  current one does not change the size, but reserves a contiguous run of
+ *  blocks for the inode that subsequent appends will use (a preallocation
+ *  hint).  Reservations are in memory only.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +49,7 @@
  */
 struct unixdisk_snapshot
 {
+    struct unixdisk_state *fs;
     union unixdisk_block superblock;
     union unixdisk_block inodeblock;
     block_no inode_blockno;
@@ -44,17 +57,68 @@ struct unixdisk_snapshot
     struct unixdisk_inode *inode;
 };
 
+#define UNIXDISK_META ((datablock_no)-1) // allocation goal for indirect blocks
+#define UNIXDISK_MAX_EXTENT 256            // longest run searched for
+
+/* A contiguous run of datablocks reserved for an inode by setsize().
+ */
+struct unixdisk_reservation
+{
+    datablock_no next;  // next reserved datablock
+    unsigned int count; // # reserved datablocks left
+};
+
 struct unixdisk_state
 {
     block_store_t *below; // block store below
     unsigned int ninodes; // number of inodes
+
+    datablock_no ndatablocks;                  // # datablocks
+    unsigned int *used;                        // bitmap of allocated datablocks
+    unsigned int *reserved;                    // bitmap of reserved datablocks
+    struct unixdisk_reservation *reservations; // one per inode
+    int dirty;                                 // free list must be rewritten
+
+    /* Where each datablock is listed in the free list on disk.  Blocks
+     * that are allocated are taken off it one entry at a time, before the
+     * inode that points at them is written.  The nodes of the on-disk
+     * list are not handed out, so that the list stays intact until the
+     * next flush rebuilds it.
+     */
+    block_no base;                             // first datablock below
+    unsigned int *listed;                      // bitmap of free list nodes
+    datablock_no *entry_node;                  // node listing a block, or -1
+    unsigned int *entry_index;                 // its entry in that node
+    datablock_no *pending;                     // allocated, but still listed
+    unsigned int npending;
+    int must_flush;                            // a list node was allocated
 };
 
 static block_t null_block; // a block filled with null bytes
 
+#define BITS_PER_WORD (8 * sizeof(unsigned int))
+
+static int bit_test(unsigned int *map, datablock_no b)
+{
+    return (map[b / BITS_PER_WORD] >> (b % BITS_PER_WORD)) & 1;
+}
+
+static void bit_set(unsigned int *map, datablock_no b)
+{
+    map[b / BITS_PER_WORD] |= 1U << (b % BITS_PER_WORD);
+}
+
+static void bit_clear(unsigned int *map, datablock_no b)
+{
+    map[b / BITS_PER_WORD] &= ~(1U << (b % BITS_PER_WORD));
+}
+
 static int unixdisk_get_snapshot(struct unixdisk_snapshot *snapshot,
-                                 block_store_t *below, unsigned int inode_no)
+                                 struct unixdisk_state *fs, unsigned int inode_no)
 {
+    block_store_t *below = fs->below;
+
+    snapshot->fs = fs;
     snapshot->inode_no = inode_no;
 
     /* Get the super block
@@ -278,118 +342,401 @@ static block_no unixdisk_traverse(block_store_t *below, struct unixdisk_snapshot
         return to_read;
     }
 }
+/* A datablock can be allocated if it is neither in use nor reserved.
+ */
+static int unixdisk_avail(struct unixdisk_state *fs, datablock_no b)
+{
+    return !bit_test(fs->used, b) && !bit_test(fs->reserved, b) && !bit_test(fs->listed, b);
+}
+
 /*
- * Helper function that returns the datablock_no of the next free entry.
- * Modifes the superblock and the free list as a side effect, so that the
- * head is no longer in the free list after this function is called.
- * 
+ * Find the start of a run of at least 'want' available datablocks, searching
+ * from 'goal' onward (wrapping around).  If there is no such run, returns the
+ * start of the longest run found.
+ *
+ * Returns (unsigned int)-1 if there are no available datablocks at all.
+ */
+static datablock_no unixdisk_find_run(struct unixdisk_state *fs, datablock_no goal, unsigned int want)
+{
+    datablock_no best = (datablock_no)-1;
+    unsigned int best_len = 0;
+
+    if (want > UNIXDISK_MAX_EXTENT)
+    {
+        want = UNIXDISK_MAX_EXTENT;
+    }
+    if (goal >= fs->ndatablocks)
+    {
+        goal = 0;
+    }
+
+    datablock_no n = 0;
+    while (n < fs->ndatablocks)
+    {
+        datablock_no b = (goal + n) % fs->ndatablocks;
+        if (!unixdisk_avail(fs, b))
+        {
+            n++;
+            continue;
+        }
+        unsigned int len = 0;
+        while (b + len < fs->ndatablocks && len < want && unixdisk_avail(fs, b + len))
+        {
+            len++;
+        }
+        if (len >= want)
+        {
+            return b;
+        }
+        if (len > best_len)
+        {
+            best = b;
+            best_len = len;
+        }
+        n += len;
+    }
+    return best;
+}
+
+/*
+ * Helper function that returns the datablock_no of a free datablock and
+ * marks it allocated.  Indirect blocks (goal == UNIXDISK_META) come from the
+ * top of the disk.  Data blocks come from the inode's reservation if it has
+ * one, otherwise from 'goal' if it is available, otherwise from the start
+ * of a free run of (preferably) 'want' blocks.
+ *
  * Returns (unsigned int)-1 on error
  */
-static datablock_no unixdisk_popfree(block_store_t *below, struct unixdisk_snapshot *snapshot)
+static datablock_no unixdisk_popfree(struct unixdisk_snapshot *snapshot, datablock_no goal, unsigned int want)
 {
-    // Check if free list is empty
-    if (snapshot->superblock.superblock.free_list == (unsigned int)-1)
+    struct unixdisk_state *fs = snapshot->fs;
+    struct unixdisk_reservation *res = &fs->reservations[snapshot->inode_no];
+    datablock_no next = (datablock_no)-1;
+
+    if (goal == UNIXDISK_META)
     {
-        fprintf(stderr, "!!TDERR: disk out of space!\n");
-        // panic("Out of space!");
-        return -1;
+        datablock_no b;
+        for (b = fs->ndatablocks; b-- > 0;)
+        {
+            if (unixdisk_avail(fs, b))
+            {
+                next = b;
+                break;
+            }
+        }
+    }
+    else if (res->count > 0)
+    {
+        next = res->next++;
+        res->count--;
+        bit_clear(fs->reserved, next);
+    }
+    else if (goal < fs->ndatablocks && unixdisk_avail(fs, goal))
+    {
+        next = goal;
+    }
+    else
+    {
+        next = unixdisk_find_run(fs, goal, want);
     }
 
-    // Compute next free datablock
-    unsigned int free_list = snapshot->superblock.superblock.free_list + 1 + snapshot->superblock.superblock.n_inodeblocks;
+    // Only free list nodes may be left; the list is then rebuilt in full
+    if (next == (datablock_no)-1)
+    {
+        datablock_no b;
+        for (b = 0; b < fs->ndatablocks; b++)
+        {
+            if (bit_test(fs->listed, b) && !bit_test(fs->used, b))
+            {
+                next = b;
+                break;
+            }
+        }
+    }
 
-    datablock_no next;
-    union unixdisk_block free_head;
-    if ((below->read)(below, 0, free_list, (block_t *)&free_head) < 0)
+    // Check if disk is full
+    if (next == (datablock_no)-1)
     {
+        fprintf(stderr, "!!TDERR: disk out of space!\n");
+        // panic("Out of space!");
         return -1;
     }
 
-    if (snapshot->superblock.superblock.free_offset > 0)
+    bit_set(fs->used, next);
+    fs->dirty = 1;
+    if (bit_test(fs->listed, next))
     {
-        // Head of free list has some pointers that can be allocated- take latest one out
-        next = free_head.freeblock.entries[--snapshot->superblock.superblock.free_offset];
+        bit_clear(fs->listed, next);
+        fs->must_flush = 1;
     }
-    else
+    else if (fs->entry_node[next] != (datablock_no)-1)
     {
-        assert(snapshot->superblock.superblock.free_offset == 0);
-        // Head of free list is empty- can allocate this block
-        next = snapshot->superblock.superblock.free_list;
-        snapshot->superblock.superblock.free_list = free_head.freeblock.next;
-        snapshot->superblock.superblock.free_offset = ENTRIES_PER_FREE_BLOCK;
+        if (fs->npending < fs->ndatablocks)
+        {
+            fs->pending[fs->npending++] = next;
+        }
+        else
+        {
+            fs->must_flush = 1;
+        }
     }
+    return next;
+}
 
-    // Write superblock back
-    if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+/*
+ * Helper function that returns a block to the free pool
+ *
+ * Returns -1 on error, 0 on success
+ */
+static int unixdisk_pushfree(struct unixdisk_snapshot *snapshot, datablock_no block_no)
+{
+    struct unixdisk_state *fs = snapshot->fs;
+
+    if (block_no >= fs->ndatablocks || !bit_test(fs->used, block_no))
     {
+        fprintf(stderr, "!!UNIXDISK: freeing free block %u\n", block_no);
         return -1;
     }
-    return next;
+    bit_clear(fs->used, block_no);
+    fs->dirty = 1;
+    return 0;
 }
 
 /*
- * Helper function that pushes a block onto the free list
- * 
+ * Drop the reservation of an inode, if any.
+ */
+static void unixdisk_unreserve(struct unixdisk_state *fs, unsigned int inode_no)
+{
+    struct unixdisk_reservation *res = &fs->reservations[inode_no];
+
+    while (res->count > 0)
+    {
+        bit_clear(fs->reserved, res->next++);
+        res->count--;
+    }
+}
+
+/*
+ * Rewrite the free list on disk (and the superblock) from the bitmap.  All
+ * non-head nodes of the free list are full, as unixdisk_create makes them.
+ *
  * Returns -1 on error, 0 on success
  */
-static int unixdisk_pushfree(block_store_t *below, struct unixdisk_snapshot *snapshot, datablock_no block_no)
+static int unixdisk_flush(struct unixdisk_state *fs)
 {
-    unsigned int free_list = snapshot->superblock.superblock.free_list + 1 + snapshot->superblock.superblock.n_inodeblocks;
+    block_store_t *below = fs->below;
 
-    union unixdisk_block free_head;
-    if ((below->read)(below, 0, free_list, (block_t *)&free_head) < 0)
+    if (!fs->dirty)
+    {
+        return 0;
+    }
+
+    union unixdisk_block superblock;
+    if ((*below->read)(below, 0, 0, (block_t *)&superblock) < 0)
     {
         return -1;
     }
+    block_no base = 1 + superblock.superblock.n_inodeblocks;
 
-    if (snapshot->superblock.superblock.free_offset < ENTRIES_PER_FREE_BLOCK)
+    /* Collect the free datablocks.  Reserved blocks are free on disk.
+     */
+    datablock_no *free_blocks = malloc((fs->ndatablocks + 1) * sizeof(datablock_no));
+    datablock_no nfree = 0, b;
+    for (b = 0; b < fs->ndatablocks; b++)
     {
-        // Head of free list has some free slots- stick the block_no in
-        free_head.freeblock.entries[snapshot->superblock.superblock.free_offset++] = block_no;
-        // Write head of freelist back
-        if ((*below->write)(below, 0, free_list, (block_t *)&free_head) < 0)
+        bit_clear(fs->listed, b);
+        fs->entry_node[b] = (datablock_no)-1;
+        if (!bit_test(fs->used, b))
         {
-            return -1;
+            free_blocks[nfree++] = b;
+        }
+    }
+    fs->npending = 0;
+    fs->must_flush = 0;
+
+    /* The highest free blocks become the nodes of the list, so that they
+     * don't break up the free runs lower on the disk.  All nodes but the
+     * head are full.  Build the list back to front.
+     */
+    unsigned int nnodes = (nfree + ENTRIES_PER_FREE_BLOCK) / (ENTRIES_PER_FREE_BLOCK + 1);
+    unsigned int nentries = nfree - nnodes;
+    datablock_no *nodes = &free_blocks[nentries];
+    datablock_no *fb = free_blocks;
+    datablock_no next = (datablock_no)-1;
+    union unixdisk_block node;
+    unsigned int i, j;
+    superblock.superblock.free_offset = 0;
+    for (i = nnodes; i-- > 0;)
+    {
+        unsigned int n = i > 0 ? ENTRIES_PER_FREE_BLOCK : nentries - (nnodes - 1) * ENTRIES_PER_FREE_BLOCK;
+        memset(&node, 0, sizeof(node));
+        node.freeblock.next = next;
+        node.freeblock.nblocks = n;
+        for (j = 0; j < n; j++)
+        {
+            node.freeblock.entries[j] = fb[j];
+            fs->entry_node[fb[j]] = nodes[i];
+            fs->entry_index[fb[j]] = j;
         }
-        // Write superblock back
-        if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+        if ((*below->write)(below, 0, base + nodes[i], (block_t *)&node) < 0)
         {
+            free(free_blocks);
             return -1;
         }
-        return 0;
+        bit_set(fs->listed, nodes[i]);
+        next = nodes[i];
+        superblock.superblock.free_offset = n;
+        fb += n;
     }
-    else
+    free(free_blocks);
+
+    superblock.superblock.free_list = next;
+    if (next == (datablock_no)-1)
+    {
+        superblock.superblock.free_offset = 0;
+    }
+    if ((*below->write)(below, 0, 0, (block_t *)&superblock) < 0)
+    {
+        return -1;
+    }
+    fs->dirty = 0;
+    return 0;
+}
+
+/*
+ * Take the blocks allocated since the last call off the free list on disk,
+ * by blanking their entries.  The loader skips such entries.
+ *
+ * Returns -1 on error, 0 on success
+ */
+static int unixdisk_persist(struct unixdisk_state *fs)
+{
+    block_store_t *below = fs->below;
+
+    if (fs->must_flush)
+    {
+        return unixdisk_flush(fs);
+    }
+
+    union unixdisk_block node;
+    datablock_no cur = (datablock_no)-1;
+    unsigned int i;
+    for (i = 0; i < fs->npending; i++)
     {
-        assert(snapshot->superblock.superblock.free_offset == ENTRIES_PER_FREE_BLOCK);
-        // Head of free list is full- use block_no as new head
-        free_head.freeblock.next = snapshot->superblock.superblock.free_list;
-        snapshot->superblock.superblock.free_list = block_no;
-        snapshot->superblock.superblock.free_offset = 0;
-        // Write head of freelist back
-        if ((*below->write)(below, 0, block_no + 1 + snapshot->superblock.superblock.n_inodeblocks, (block_t *)&free_head) < 0)
+        datablock_no b = fs->pending[i];
+        if (fs->entry_node[b] != cur)
         {
-            return -1;
+            if (cur != (datablock_no)-1 && (*below->write)(below, 0, fs->base + cur, (block_t *)&node) < 0)
+            {
+                return -1;
+            }
+            cur = fs->entry_node[b];
+            if ((*below->read)(below, 0, fs->base + cur, (block_t *)&node) < 0)
+            {
+                return -1;
+            }
         }
-        // Write superblock back
-        if ((*below->write)(below, 0, 0, (block_t *)&snapshot->superblock) < 0)
+        node.freeblock.entries[fs->entry_index[b]] = (datablock_no)-1;
+        fs->entry_node[b] = (datablock_no)-1;
+    }
+    if (cur != (datablock_no)-1 && (*below->write)(below, 0, fs->base + cur, (block_t *)&node) < 0)
+    {
+        return -1;
+    }
+    fs->npending = 0;
+    return 0;
+}
+
+/*
+ * Load the free list from disk into the bitmap.
+ *
+ * Returns -1 on error, 0 on success
+ */
+static int unixdisk_load_free(struct unixdisk_state *fs)
+{
+    block_store_t *below = fs->below;
+
+    union unixdisk_block superblock;
+    if ((*below->read)(below, 0, 0, (block_t *)&superblock) < 0)
+    {
+        return -1;
+    }
+    block_no base = 1 + superblock.superblock.n_inodeblocks;
+    fs->ninodes = superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+    fs->ndatablocks = (*below->getsize)(below, 0) - base;
+
+    unsigned int nwords = (fs->ndatablocks + BITS_PER_WORD - 1) / BITS_PER_WORD + 1;
+    fs->used = malloc(nwords * sizeof(unsigned int));
+    memset(fs->used, 0xFF, nwords * sizeof(unsigned int));
+    fs->reserved = calloc(nwords, sizeof(unsigned int));
+    fs->reservations = calloc(fs->ninodes + 1, sizeof(struct unixdisk_reservation));
+    fs->base = base;
+    fs->listed = calloc(nwords, sizeof(unsigned int));
+    fs->entry_node = malloc((fs->ndatablocks + 1) * sizeof(datablock_no));
+    memset(fs->entry_node, 0xFF, (fs->ndatablocks + 1) * sizeof(datablock_no));
+    fs->entry_index = malloc((fs->ndatablocks + 1) * sizeof(unsigned int));
+    fs->pending = malloc((fs->ndatablocks + 1) * sizeof(datablock_no));
+
+    /* Everything is in use except what's on the free list.
+     */
+    datablock_no node_no = superblock.superblock.free_list;
+    unsigned int nentries = superblock.superblock.free_offset;
+    while (node_no != (datablock_no)-1 && node_no < fs->ndatablocks)
+    {
+        union unixdisk_block node;
+        if ((*below->read)(below, 0, base + node_no, (block_t *)&node) < 0)
         {
             return -1;
         }
-        return 0;
+        bit_clear(fs->used, node_no);
+        bit_set(fs->listed, node_no);
+        for (unsigned int j = 0; j < nentries && j < ENTRIES_PER_FREE_BLOCK; j++)
+        {
+            datablock_no b = node.freeblock.entries[j];
+            if (b < fs->ndatablocks)
+            {
+                bit_clear(fs->used, b);
+                fs->entry_node[b] = node_no;
+                fs->entry_index[b] = j;
+            }
+        }
+        node_no = node.freeblock.next;
+        nentries = ENTRIES_PER_FREE_BLOCK;
     }
+    return 0;
+}
+
+/*
+ * Allocate the next data block of an inode, preferably right after the
+ * previous one (*prev), and update *prev.
+ */
+static datablock_no unixdisk_alloc_data(struct unixdisk_snapshot *snapshot, datablock_no *prev, unsigned int want)
+{
+    datablock_no goal = *prev == (datablock_no)-1 ? 0 : *prev + 1;
+    datablock_no next = unixdisk_popfree(snapshot, goal, want);
+    *prev = next;
+    return next;
 }
+
 static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapshot,
                           unsigned int offset)
 {
     assert(offset >= snapshot->inode->nblocks);
     unsigned int i = snapshot->inode->nblocks; // Overall index of data
 
+    // Find the last data block so the file can be extended contiguously
+    datablock_no prev = (datablock_no)-1;
+    if (i > 0)
+    {
+        prev = unixdisk_traverse(below, snapshot, i - 1) - 1 - snapshot->superblock.superblock.n_inodeblocks;
+    }
+
     unsigned int j, k;
 
     // Allocate in Direct Blocks
     while (i < 12 && i <= offset)
     {
-        datablock_no next = unixdisk_popfree(below, snapshot);
+        datablock_no next = unixdisk_alloc_data(snapshot, &prev, offset - i + 1);
         snapshot->inode->direct_blocks[i] = next;
         i++;
     }
@@ -400,7 +747,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12)
         {
-            snapshot->inode->single_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->single_indirect = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
         }
         // Allocate in Single Indirect Block
         union unixdisk_block indirectblock;
@@ -412,7 +759,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         }
         while (i < 12 + ENTRIES_PER_BLOCK && i <= offset)
         {
-            datablock_no next = unixdisk_popfree(below, snapshot);
+            datablock_no next = unixdisk_alloc_data(snapshot, &prev, offset - i + 1);
             indirectblock.indirectblock.entries[i - 12] = next;
             i++;
         }
@@ -427,7 +774,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK)
         {
-            snapshot->inode->double_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->double_indirect = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
         }
         // Allocate in Double Indirect Block
         union unixdisk_block indirect1, indirect2;
@@ -443,7 +790,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             // Check if we need to initialize indirect block
             if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + j * ENTRIES_PER_BLOCK)
             {
-                indirect1.indirectblock.entries[j] = unixdisk_popfree(below, snapshot);
+                indirect1.indirectblock.entries[j] = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
             }
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
@@ -453,7 +800,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             }
             while (i < 12 + ENTRIES_PER_BLOCK + (j + 1) * ENTRIES_PER_BLOCK && i <= offset)
             {
-                datablock_no next = unixdisk_popfree(below, snapshot);
+                datablock_no next = unixdisk_alloc_data(snapshot, &prev, offset - i + 1);
                 indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK] = next;
                 i++;
             }
@@ -474,7 +821,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
         // Check if we need to initialize indirect block
         if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2)
         {
-            snapshot->inode->triple_indirect = unixdisk_popfree(below, snapshot);
+            snapshot->inode->triple_indirect = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
         }
         // Allocate in Triple Indirect Block
         union unixdisk_block indirect1, indirect2, indirect3;
@@ -490,7 +837,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             // Check if we need to initialize indirect block
             if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2)
             {
-                indirect1.indirectblock.entries[j] = unixdisk_popfree(below, snapshot);
+                indirect1.indirectblock.entries[j] = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
             }
             datablock_no to_read = indirect1.indirectblock.entries[j];
             to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
@@ -504,7 +851,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
                 // Check if we need to initialize indirect block
                 if (snapshot->inode->nblocks <= 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + k * ENTRIES_PER_BLOCK)
                 {
-                    indirect2.indirectblock.entries[k] = unixdisk_popfree(below, snapshot);
+                    indirect2.indirectblock.entries[k] = unixdisk_popfree(snapshot, UNIXDISK_META, 1);
                 }
                 datablock_no to_read = indirect2.indirectblock.entries[k];
                 to_read += 1 + snapshot->superblock.superblock.n_inodeblocks;
@@ -514,7 +861,7 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
                 }
                 while (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + (k + 1) * ENTRIES_PER_BLOCK && i <= offset)
                 {
-                    datablock_no next = unixdisk_popfree(below, snapshot);
+                    datablock_no next = unixdisk_alloc_data(snapshot, &prev, offset - i + 1);
                     indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK] = next;
                     i++;
                 }
@@ -535,6 +882,13 @@ static int unixdisk_alloc(block_store_t *below, struct unixdisk_snapshot *snapsh
             return -1;
         }
     }
+    // Take the new blocks off the free list on disk before the inode that
+    // makes them reachable, so a crash can't hand them out twice
+    if (unixdisk_persist(snapshot->fs) < 0)
+    {
+        return -1;
+    }
+
     // Lastly Write the new inode
     snapshot->inode->nblocks = offset + 1;
     if ((below->write)(below, 0, snapshot->inode_blockno, (block_t *)&snapshot->inodeblock) < 0)
@@ -560,7 +914,7 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
     while (i < 12 && i < snapshot->inode->nblocks)
     {
         // Free Direct Blocks
-        unixdisk_pushfree(below, snapshot, snapshot->inode->direct_blocks[i]);
+        unixdisk_pushfree(snapshot, snapshot->inode->direct_blocks[i]);
         i++;
     }
     /* Free Single Indirect Blocks */
@@ -577,11 +931,11 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
         // Free Single Indirect Block Pointers
         while (i < 12 + ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
         {
-            unixdisk_pushfree(below, snapshot, indirectblock.indirectblock.entries[i - 12]);
+            unixdisk_pushfree(snapshot, indirectblock.indirectblock.entries[i - 12]);
             i++;
         }
         // Free Single Indirect block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->single_indirect);
+        unixdisk_pushfree(snapshot, snapshot->inode->single_indirect);
     }
     /* Free Double Indirect Blocks */
     if (i < EPB_2 + ENTRIES_PER_BLOCK + 12 && i < snapshot->inode->nblocks)
@@ -609,15 +963,15 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
             while (i < 12 + ENTRIES_PER_BLOCK + (j + 1) * ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
             {
                 // Free data blocks
-                unixdisk_pushfree(below, snapshot, indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK]);
+                unixdisk_pushfree(snapshot, indirect2.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - j * ENTRIES_PER_BLOCK]);
                 i++;
             }
             // Free Single Indirect Block
-            unixdisk_pushfree(below, snapshot, indirect1.indirectblock.entries[j]);
+            unixdisk_pushfree(snapshot, indirect1.indirectblock.entries[j]);
             j++;
         }
         // Free Double Indirect Block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->double_indirect);
+        unixdisk_pushfree(snapshot, snapshot->inode->double_indirect);
     }
     /* Free Third Indirect Blocks */
     if (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + EPB_3 && i < snapshot->inode->nblocks)
@@ -655,19 +1009,19 @@ static void unixdisk_free_file(struct unixdisk_snapshot *snapshot,
                 while (i < 12 + ENTRIES_PER_BLOCK + EPB_2 + j * EPB_2 + (k + 1) * ENTRIES_PER_BLOCK && i < snapshot->inode->nblocks)
                 {
                     // Free Data Block
-                    unixdisk_pushfree(below, snapshot, indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK]);
+                    unixdisk_pushfree(snapshot, indirect3.indirectblock.entries[i - 12 - ENTRIES_PER_BLOCK - EPB_2 - j * EPB_2 - k * ENTRIES_PER_BLOCK]);
                     i++;
                 }
                 // Free Single Indirect Block
-                unixdisk_pushfree(below, snapshot, indirect2.indirectblock.entries[k]);
+                unixdisk_pushfree(snapshot, indirect2.indirectblock.entries[k]);
                 k++;
             }
             // Free Double Indirect Block
-            unixdisk_pushfree(below, snapshot, indirect1.indirectblock.entries[j]);
+            unixdisk_pushfree(snapshot, indirect1.indirectblock.entries[j]);
             j++;
         }
         // Free Triple Indirect Block
-        unixdisk_pushfree(below, snapshot, snapshot->inode->triple_indirect);
+        unixdisk_pushfree(snapshot, snapshot->inode->triple_indirect);
     }
 
     assert(i == snapshot->inode->nblocks);
@@ -692,7 +1046,7 @@ static int unixdisk_write(block_store_t *this_bs, unsigned int ino, block_no off
     /* Get info from underlying file system.
 	 */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, ts->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
     {
         return -1;
     }
@@ -728,7 +1082,7 @@ static int unixdisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
     /* Get info from underlying file system.
 	 */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, ts->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
     {
         return -1;
     }
@@ -749,14 +1103,71 @@ static int unixdisk_read(block_store_t *this_bs, unsigned int ino, block_no offs
     return 0;
 }
 
-static int unixdisk_getninodes(block_store_t *this_bs)
+/* Read a run of blocks.  The data blocks are located first, so that runs
+ * of them that are consecutive below can be read with a single readv.
+ */
+static int unixdisk_readv(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
 {
-    struct unixdisk_state *fs = this_bs->state;
-    union unixdisk_block superblock;
-    if((*fs->below->read)(fs->below, 0, 0, (block_t*) &superblock) < 0) {
+    struct unixdisk_state *ts = this_bs->state;
+
+    struct unixdisk_snapshot snapshot;
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
+    {
+        return -1;
+    }
+
+    /* Check if offset is too big */
+    if (offset + nblocks > snapshot.inode->nblocks)
+    {
+        fprintf(stderr, "!!TDERR: offset too large\n");
+        return -1;
+    }
+
+    block_no *map = malloc(nblocks * sizeof(block_no));
+    for (block_no i = 0; i < nblocks; i++)
+    {
+        map[i] = unixdisk_traverse(ts->below, &snapshot, offset + i);
+    }
+    int result = block_store_readruns(ts->below, 0, map, nblocks, blocks);
+    free(map);
+    return result;
+}
+
+/* Write a run of blocks.  All blocks are allocated up front, so that runs
+ * of them that are consecutive below can be written with a single writev.
+ */
+static int unixdisk_writev(block_store_t *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks)
+{
+    struct unixdisk_state *ts = this_bs->state;
+
+    struct unixdisk_snapshot snapshot;
+    if (unixdisk_get_snapshot(&snapshot, ts, ino) < 0)
+    {
         return -1;
     }
-    return superblock.superblock.n_inodeblocks * INODES_PER_BLOCK;
+
+    if (offset + nblocks > snapshot.inode->nblocks)
+    {
+        if (unixdisk_alloc(ts->below, &snapshot, offset + nblocks - 1) < 0)
+        {
+            return -1;
+        }
+    }
+
+    block_no *map = malloc(nblocks * sizeof(block_no));
+    for (block_no i = 0; i < nblocks; i++)
+    {
+        map[i] = unixdisk_traverse(ts->below, &snapshot, offset + i);
+    }
+    int result = block_store_writeruns(ts->below, 0, map, nblocks, blocks);
+    free(map);
+    return result;
+}
+
+static int unixdisk_getninodes(block_store_t *this_bs)
+{
+    struct unixdisk_state *fs = this_bs->state;
+    return fs->ninodes;
 }
 
 /* Get size.
@@ -768,7 +1179,7 @@ static int unixdisk_getsize(block_store_t *this_bs, unsigned int ino)
     /* Get info from underlying file system.
      */
     struct unixdisk_snapshot snapshot;
-    if (unixdisk_get_snapshot(&snapshot, fs->below, ino) < 0)
+    if (unixdisk_get_snapshot(&snapshot, fs, ino) < 0)
     {
         return -1;
     }
@@ -783,30 +1194,80 @@ static int unixdisk_setsize(block_store_t *this_bs, unsigned int ino, block_no n
     struct unixdisk_state *fs = this_bs->state;
 
     struct unixdisk_snapshot snapshot;
-    unixdisk_get_snapshot(&snapshot, fs->below, ino);
+    if (unixdisk_get_snapshot(&snapshot, fs, ino) < 0)
+    {
+        return -1;
+    }
     if (nblocks == snapshot.inode->nblocks)
     {
         return nblocks;
     }
+
+    /* Growing is a preallocation hint: reserve a contiguous run for the
+     * blocks to come, right after the last block of the file if possible.
+     * The size of the file does not change.
+     */
+    if (nblocks > snapshot.inode->nblocks)
+    {
+        unsigned int want = nblocks - snapshot.inode->nblocks;
+        datablock_no goal = 0;
+        if (snapshot.inode->nblocks > 0)
+        {
+            goal = unixdisk_traverse(fs->below, &snapshot, snapshot.inode->nblocks - 1) - snapshot.superblock.superblock.n_inodeblocks;
+        }
+        unixdisk_unreserve(fs, ino);
+        if (want > UNIXDISK_MAX_EXTENT)
+        {
+            want = UNIXDISK_MAX_EXTENT;
+        }
+        datablock_no start = goal < fs->ndatablocks && unixdisk_avail(fs, goal) ? goal : unixdisk_find_run(fs, goal, want);
+        struct unixdisk_reservation *res = &fs->reservations[ino];
+        res->next = start;
+        while (start != (datablock_no)-1 && res->count < want &&
+               start + res->count < fs->ndatablocks && unixdisk_avail(fs, start + res->count))
+        {
+            bit_set(fs->reserved, start + res->count);
+            res->count++;
+        }
+        return snapshot.inode->nblocks;
+    }
+
     if (nblocks > 0)
     {
         fprintf(stderr, "!!UNIXDISK: nblocks > 0 not supported\n");
         return -1;
     }
 
+    unixdisk_unreserve(fs, ino);
     unixdisk_free_file(&snapshot, fs->below);
     return 0;
 }
 
 static void unixdisk_release(block_store_t *this_bs)
 {
-    free(this_bs->state);
+    struct unixdisk_state *fs = this_bs->state;
+    if (unixdisk_flush(fs) < 0)
+    {
+        fprintf(stderr, "!!UNIXDISK: can't write back free list\n");
+    }
+    free(fs->used);
+    free(fs->reserved);
+    free(fs->reservations);
+    free(fs->listed);
+    free(fs->entry_node);
+    free(fs->entry_index);
+    free(fs->pending);
+    free(fs);
     free(this_bs);
 }
 
 static int unixdisk_sync(block_if bi, unsigned int ino)
 {
     struct unixdisk_state *fs = bi->state;
+    if (unixdisk_flush(fs) < 0)
+    {
+        return -1;
+    }
     return (*fs->below->sync)(fs->below, 0);
 }
 
@@ -818,10 +1279,23 @@ block_store_t *unixdisk_init(block_store_t *below, unsigned int below_ino)
         fprintf(stderr, "!!UNIXDISK: below_ino != 0 not supported\n");
         return NULL;
     }
-    /* Create the block store state structure.
+    /* Create the block store state structure and load the free list.
      */
     struct unixdisk_state *fs = new_alloc(struct unixdisk_state);
     fs->below = below;
+    if (unixdisk_load_free(fs) < 0)
+    {
+        fprintf(stderr, "!!UNIXDISK: can't load free list\n");
+        free(fs->used);
+        free(fs->reserved);
+        free(fs->reservations);
+        free(fs->listed);
+        free(fs->entry_node);
+        free(fs->entry_index);
+        free(fs->pending);
+        free(fs);
+        return NULL;
+    }
 
     /* Return a block interface to this inode.
      */
@@ -834,5 +1308,7 @@ block_store_t *unixdisk_init(block_store_t *below, unsigned int below_ino)
     this_bs->write = unixdisk_write;
     this_bs->release = unixdisk_release;
     this_bs->sync = unixdisk_sync;
+    this_bs->readv = unixdisk_readv;
+    this_bs->writev = unixdisk_writev;
     return this_bs;
 }
@@ -24,7 +24,7 @@ struct wtclockdisk_state {
   block_t *blocks;  // memory for caching blocks
   block_no nblocks; // size of cache (not size of block store!)
   struct block_info *metadatas;
-  int clock_hand;
+  block_no clock_hand;
 
   /* Stats.
    */
@@ -58,6 +58,20 @@ static void cache_update(struct wtclockdisk_state *cs, unsigned int ino,
   cs->metadatas[cs->clock_hand].offset = offset;
 }
 
+#define NOT_CACHED ((block_no)-1)
+
+/* Return the slot that caches (ino, offset), or NOT_CACHED.
+ */
+static block_no cache_find(struct wtclockdisk_state *cs, unsigned int ino,
+                           block_no offset) {
+  for (block_no i = 0; i < cs->nblocks; i++) {
+    if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset && cs->metadatas[i].use_bit == 1) {
+      return i;
+    }
+  }
+  return NOT_CACHED;
+}
+
 static int wtclockdisk_getninodes(block_store_t *this_bs) {
   struct wtclockdisk_state *cs = this_bs->state;
   return (*cs->below->getninodes)(cs->below);
@@ -72,7 +86,7 @@ static int wtclockdisk_setsize(block_if bi, unsigned int ino,
                                block_no nblocks) {
   struct wtclockdisk_state *cs = bi->state;
   // Update cache
-  for (int i = 0; i < cs->nblocks; i++) {
+  for (block_no i = 0; i < cs->nblocks; i++) {
     if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset >= nblocks &&
         cs->metadatas[i].use_bit == 1) {
       cs->metadatas[i].use_bit = 0;
@@ -86,16 +100,8 @@ static int wtclockdisk_setsize(block_if bi, unsigned int ino,
 static int wtclockdisk_read(block_if bi, unsigned int ino, block_no offset,
                             block_t *block) {
   struct wtclockdisk_state *cs = bi->state;
-  int i = 0;
-  while (i < cs->nblocks) {
-    if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset && cs->metadatas[i].use_bit == 1) {
-      break;
-    }
-
-    i += 1;
-  }
-
-  if (i == cs->nblocks) {
+  block_no i = cache_find(cs, ino, offset);
+  if (i == NOT_CACHED) {
     cs->read_miss += 1;
     if ((*cs->below->read)(cs->below, ino, offset, block) == -1) {
       return -1;
@@ -113,16 +119,8 @@ static int wtclockdisk_read(block_if bi, unsigned int ino, block_no offset,
 static int wtclockdisk_write(block_if bi, unsigned int ino, block_no offset,
                              block_t *block) {
   struct wtclockdisk_state *cs = bi->state;
-  int i = 0;
-  while (i < cs->nblocks) {
-    if (cs->metadatas[i].ino == ino && cs->metadatas[i].offset == offset && cs->metadatas[i].use_bit == 1) {
-      break;
-    }
-
-    i += 1;
-  }
-
-  if (i == cs->nblocks) {
+  block_no i = cache_find(cs, ino, offset);
+  if (i == NOT_CACHED) {
     cs->write_miss += 1;
     cache_update(cs, ino, offset, block);
   } else {
@@ -133,6 +131,55 @@ static int wtclockdisk_write(block_if bi, unsigned int ino, block_no offset,
   return (*cs->below->write)(cs->below, ino, offset, block);
 }
 
+static int wtclockdisk_readv(block_if bi, unsigned int ino, block_no offset,
+                             block_no nblocks, block_t *blocks) {
+  struct wtclockdisk_state *cs = bi->state;
+  block_no i = 0;
+  while (i < nblocks) {
+    block_no slot = cache_find(cs, ino, offset + i);
+    if (slot != NOT_CACHED) {
+      cs->read_hit += 1;
+      memcpy(&blocks[i], &cs->blocks[slot], BLOCK_SIZE);
+      i++;
+      continue;
+    }
+
+    // Read the whole run of missing blocks from below at once
+    block_no n = 1;
+    while (i + n < nblocks && cache_find(cs, ino, offset + i + n) == NOT_CACHED) {
+      n++;
+    }
+    cs->read_miss += n;
+    if (block_store_readv(cs->below, ino, offset + i, n, &blocks[i]) == -1) {
+      return -1;
+    }
+    for (block_no j = i; j < i + n; j++) {
+      cache_update(cs, ino, offset + j, &blocks[j]);
+    }
+    i += n;
+  }
+
+  return 0;
+}
+
+static int wtclockdisk_writev(block_if bi, unsigned int ino, block_no offset,
+                              block_no nblocks, block_t *blocks) {
+  struct wtclockdisk_state *cs = bi->state;
+  for (block_no i = 0; i < nblocks; i++) {
+    block_no slot = cache_find(cs, ino, offset + i);
+    if (slot == NOT_CACHED) {
+      cs->write_miss += 1;
+      cache_update(cs, ino, offset + i, &blocks[i]);
+    } else {
+      cs->write_hit += 1;
+      memcpy(&cs->blocks[slot], &blocks[i], BLOCK_SIZE);
+    }
+  }
+
+  // Write through the whole run at once
+  return block_store_writev(cs->below, ino, offset, nblocks, blocks);
+}
+
 static void wtclockdisk_release(block_if bi) {
   struct wtclockdisk_state *cs = bi->state;
   free(cs);
@@ -169,7 +216,7 @@ block_if wtclockdisk_init(block_if below, block_t *blocks, block_no nblocks) {
   cs->write_hit = 0;
   cs->write_miss = 0;
   cs->metadatas = malloc(sizeof(struct block_info) * nblocks);
-  for (int i = 0; i < cs->nblocks; i++) {
+  for (block_no i = 0; i < cs->nblocks; i++) {
     cs->metadatas[i].use_bit = 0;
     cs->metadatas[i].recent_bit = 0;
   }
@@ -186,6 +233,8 @@ block_if wtclockdisk_init(block_if below, block_t *blocks, block_no nblocks) {
   bi->write = wtclockdisk_write;
   bi->release = wtclockdisk_release;
   bi->sync = wtclockdisk_sync;
+  bi->readv = wtclockdisk_readv;
+  bi->writev = wtclockdisk_writev;
   return bi;
 }
 
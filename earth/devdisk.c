@@ -1,20 +1,101 @@
+/* A "disk device" simulated on a file.
+ *
+ * Disk operations are carried out asynchronously by a small pool of worker
+ * threads that use pread/pwrite on the file, so the disk server can keep
+ * many operations in flight and the kernel does not stall on the latency
+ * of the host disk.  When an operation has completed, the worker adds it
+ * to a list of completed operations and writes a byte into a pipe.  The
+ * read end of the pipe is registered with the interrupt module, which
+ * invokes the completion upcalls (and raises SIGIO so that a process
+ * waiting for the operation can be scheduled).
+ *
+ * Operations on overlapping block ranges, at least one of which is a
+ * write, are carried out in the order in which they were issued.
+ *
+ * Writes that are queued while the I/O threads are busy are carried out
+ * together in a batch: writes to consecutive blocks are combined into a
+ * single pwritev, and in sync mode the batch shares a single fdatasync
+ * (group commit).  Completions are delivered only after that flush.  While
+ * one worker is in fdatasync, the others leave the writes alone, so that
+ * everything queued in the meantime goes into the next batch.
+ *
+ * Compile with -DDEV_DISK_NWORKERS=0 to do all I/O synchronously instead.
+ *
+ * Alternatively, with the DEV_DISK_MMAP flag, the file is mapped into memory
+ * and operations are simply memcpy's to and from the mapping.  Writes then
+ * only mark a range of blocks dirty, and the dirty range is msync'ed when
+ * the device is synced (or right away in sync mode).
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <assert.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <earth/earth.h>
 #include <earth/intf.h>
 
+#ifndef DEV_DISK_NWORKERS
+#define DEV_DISK_NWORKERS	4			// # I/O threads per disk device
+#endif
+#define DEV_DISK_MAX_BATCH	64			// max # writes combined in a batch
+
+/* An outstanding disk operation.
+ */
+struct dd_request {
+	struct dd_request *next;			// for linked lists
+	bool write;							// write (or read) operation
+	bool flush;							// flush earlier writes to disk
+	unsigned int offset;				// first block
+	unsigned int nblocks;				// # blocks
+	char *data;							// buffer (a private copy for writes)
+	void (*completion)(void *arg, bool success);
+	void *arg;
+	bool success;
+	int owner;							// worker carrying it out
+};
+
+struct dev_disk_worker {
+	struct dev_disk *dd;
+	int index;
+	pthread_t thread;
+};
+
 struct dev_disk {
 	int fd;
 	unsigned int nblocks;
 	bool sync;
+
+	/* Memory-mapped image, if any.  Blocks in [dirty_lo, dirty_hi) may
+	 * not have been written back yet.
+	 */
+	char *map;
+	unsigned int dirty_lo, dirty_hi;
+
+	/* Asynchronous I/O.  The lists are protected by 'lock'.
+	 */
+	bool async;							// I/O threads are running
+	pthread_mutex_t lock;
+	pthread_cond_t work;				// signaled when there may be work
+	struct dd_request *pending;			// FIFO of requests not yet started
+	struct dd_request **pending_tail;
+	struct dd_request *inflight;		// requests being carried out
+	struct dd_request *done;			// completed requests
+	bool flushing;						// a worker is in fdatasync
+	int notify[2];						// pipe to signal completions
+	struct dev_disk_worker workers[DEV_DISK_NWORKERS + 1];
 };
 
+static bool dev_disk_start(struct dev_disk *dd);
+static bool dev_disk_map(struct dev_disk *dd, char *file_name, unsigned int flags);
+
 struct dd_event {
 	struct dev_disk *dd;
 	void (*completion)(void *arg, bool success);
@@ -24,7 +105,7 @@ struct dd_event {
 
 /* Create a "disk device", simulated on a file.
  */
-static struct dev_disk *dev_disk_create(char *file_name, unsigned int nblocks, bool sync){
+static struct dev_disk *dev_disk_create(char *file_name, unsigned int nblocks, unsigned int flags){
 	struct dev_disk *dd = calloc(1, sizeof(struct dev_disk));
 
 	/* Open the disk.  Create if non-existent.
@@ -62,7 +143,10 @@ static struct dev_disk *dev_disk_create(char *file_name, unsigned int nblocks, b
 		assert(size > 0);
 		(void) write(dd->fd, "", 1);
 	}
-	dd->sync = sync;
+	dd->sync = (flags & DEV_DISK_SYNC) != 0;
+	if ((flags & DEV_DISK_MMAP) == 0 || !dev_disk_map(dd, file_name, flags)) {
+		dd->async = dev_disk_start(dd);
+	}
 	return dd;
 }
 
@@ -88,70 +172,470 @@ static void dev_disk_make_event(struct dev_disk *dd,
 	earth.intr.sched_event(dev_disk_complete, ddev);
 }
 
-/* Write a block.  Invoke completion() when done.
+/* The lock is also taken by the kernel, which may be preempted by clock
+ * or I/O interrupts that can switch to another process.  To avoid
+ * deadlock, those are disabled while holding the lock.
  */
-static void dev_disk_write(struct dev_disk *dd, unsigned int offset, const char *data,
-				void (*completion)(void *arg, bool success), void *arg){
-	bool success;
+static void dev_disk_lock(struct dev_disk *dd, sigset_t *old){
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGVTALRM);
+	sigaddset(&mask, SIGIO);
+	pthread_sigmask(SIG_BLOCK, &mask, old);
+	pthread_mutex_lock(&dd->lock);
+}
+
+static void dev_disk_unlock(struct dev_disk *dd, sigset_t *old){
+	pthread_mutex_unlock(&dd->lock);
+	pthread_sigmask(SIG_SETMASK, old, 0);
+}
+
+/* See if two requests must be carried out in order.
+ */
+static bool dev_disk_conflict(struct dd_request *r1, struct dd_request *r2){
+	return (r1->write || r2->write) &&
+				r1->offset < r2->offset + r2->nblocks &&
+				r2->offset < r1->offset + r1->nblocks;
+}
+
+/* See if carrying out the request involves an fdatasync.
+ */
+static bool dev_disk_flushes(struct dev_disk *dd, struct dd_request *r){
+	return r->flush || (r->write && dd->sync);
+}
+
+/* Take the next batch of requests off the pending list and move them to
+ * the in-flight list, owned by the given worker.  A request is eligible if
+ * it does not conflict with an earlier pending request or with a request
+ * in flight in another worker, and does not need an fdatasync while
+ * another worker is doing one.  A batch is either a single read, or a
+ * sequence of writes (in issue order) that are carried out together and
+ * share a single flush.  Returns the number of requests in the batch.
+ * Must hold the lock.
+ */
+static int dev_disk_next(struct dev_disk *dd, int me, struct dd_request **batch){
+	struct dd_request **pr, *r, *q;
+	int n = 0;
 
-	if (offset >= dd->nblocks) {
-		fprintf(stderr, "dev_disk_write: offset too large\n");
-		success = false;
+	for (pr = &dd->pending; (r = *pr) != 0;) {
+		if (n > 0 && (!r->write || r->flush || n == DEV_DISK_MAX_BATCH)) {
+			pr = &r->next;
+			continue;
+		}
+		if (dd->flushing && dev_disk_flushes(dd, r)) {
+			pr = &r->next;
+			continue;
+		}
+		for (q = dd->inflight; q != 0; q = q->next) {
+			if (q->owner != me && dev_disk_conflict(q, r)) {
+				break;
+			}
+		}
+		if (q == 0) {
+			for (q = dd->pending; q != r; q = q->next) {
+				if (dev_disk_conflict(q, r)) {
+					break;
+				}
+			}
+			if (q == r) {
+				q = 0;
+			}
+		}
+		if (q != 0) {
+			pr = &r->next;
+			continue;
+		}
+
+		if ((*pr = r->next) == 0) {
+			dd->pending_tail = pr;
+		}
+		r->next = dd->inflight;
+		dd->inflight = r;
+		r->owner = me;
+		batch[n++] = r;
+		if (!r->write || r->flush) {
+			break;
+		}
 	}
-	else {
-		lseek(dd->fd, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+	if (n > 0 && dev_disk_flushes(dd, batch[0])) {
+		dd->flushing = true;
+	}
+	return n;
+}
+
+/* Do the actual I/O of a single request.
+ */
+static bool dev_disk_do_io(struct dev_disk *dd, struct dd_request *r){
+	off_t off = (off_t) r->offset * BLOCK_SIZE;
+	int size = r->nblocks * BLOCK_SIZE;
 
-		int n = write(dd->fd, data, BLOCK_SIZE);
+	if (r->write) {
+		int n = pwrite(dd->fd, r->data, size, off);
 		if (n < 0) {
 			perror("dev_disk_write");
-			success = false;
+			return false;
 		}
-		else if (n != BLOCK_SIZE) {
+		if (n != size) {
 			fprintf(stderr, "disk_write: wrote only %d bytes\n", n);
-			success = false;
+			return false;
+		}
+		if (dd->sync) {
+			fdatasync(dd->fd);
+		}
+	}
+	else {
+		int n = pread(dd->fd, r->data, size, off);
+		if (n < 0) {
+			perror("dev_disk_read");
+			return false;
+		}
+		if (n < size) {
+			memset(r->data + n, 0, size - n);
+		}
+	}
+	return true;
+}
+
+/* Carry out a batch of writes.  Writes to consecutive block ranges are
+ * combined into a single pwritev.  In sync mode, there is one flush for
+ * the whole batch, and no write is reported successful before it is done.
+ */
+static void dev_disk_do_writes(struct dev_disk *dd, struct dd_request **batch, int n){
+	struct iovec iov[DEV_DISK_MAX_BATCH];
+	int i, j;
+
+	for (i = 0; i < n; i = j) {
+		unsigned int end = batch[i]->offset;
+		int size = 0;
+
+		for (j = i; j < n && batch[j]->offset == end; j++) {
+			iov[j - i].iov_base = batch[j]->data;
+			iov[j - i].iov_len = batch[j]->nblocks * BLOCK_SIZE;
+			end += batch[j]->nblocks;
+			size += batch[j]->nblocks * BLOCK_SIZE;
+		}
+
+		int cnt = pwritev(dd->fd, iov, j - i, (off_t) batch[i]->offset * BLOCK_SIZE);
+		if (cnt < 0) {
+			perror("dev_disk_write");
+		}
+		else if (cnt != size) {
+			fprintf(stderr, "disk_write: wrote only %d bytes\n", cnt);
+		}
+		for (int k = i; k < j; k++) {
+			batch[k]->success = cnt == size;
+		}
+	}
+
+	if (dd->sync && fdatasync(dd->fd) != 0) {
+		perror("dev_disk_write: fdatasync");
+		for (i = 0; i < n; i++) {
+			batch[i]->success = false;
+		}
+	}
+}
+
+/* I/O thread.  Takes batches of requests off the pending list, carries
+ * them out, and puts them on the completed list.
+ */
+static void *dev_disk_worker(void *arg){
+	struct dev_disk_worker *dw = arg;
+	struct dev_disk *dd = dw->dd;
+	struct dd_request *batch[DEV_DISK_MAX_BATCH], **pr;
+	sigset_t old;
+	int i, n;
+
+	dev_disk_lock(dd, &old);
+	for (;;) {
+		while ((n = dev_disk_next(dd, dw->index, batch)) == 0) {
+			pthread_cond_wait(&dd->work, &dd->lock);
+		}
+		dev_disk_unlock(dd, &old);
+
+		if (batch[0]->flush) {
+			batch[0]->success = fdatasync(dd->fd) == 0;
+		}
+		else if (batch[0]->write) {
+			dev_disk_do_writes(dd, batch, n);
 		}
 		else {
-			if (dd->sync) {
-				fsync(dd->fd);
-			}
-			success = true;
+			batch[0]->success = dev_disk_do_io(dd, batch[0]);
+		}
+
+		dev_disk_lock(dd, &old);
+		if (dev_disk_flushes(dd, batch[0])) {
+			dd->flushing = false;
+		}
+		for (i = 0; i < n; i++) {
+			for (pr = &dd->inflight; *pr != batch[i]; pr = &(*pr)->next)
+				;
+			*pr = batch[i]->next;
+			batch[i]->next = dd->done;
+			dd->done = batch[i];
 		}
+
+		/* Requests that were waiting for these, or for the flush, may
+		 * now go ahead.
+		 */
+		pthread_cond_broadcast(&dd->work);
+		(void) write(dd->notify[1], "", 1);
 	}
+	return 0;
+}
+
+/* Invoked through the interrupt module when the notification pipe is
+ * readable.  Deliver all completions.
+ */
+static void dev_disk_read_avail(void *arg){
+	struct dev_disk *dd = arg;
+	struct dd_request *done, *r, *prev;
+	char buf[64];
+	sigset_t old;
+
+	while (read(dd->notify[0], buf, sizeof(buf)) > 0)
+		;
 
-	dev_disk_make_event(dd, completion, arg, success);
+	dev_disk_lock(dd, &old);
+	done = dd->done;
+	dd->done = 0;
+	dev_disk_unlock(dd, &old);
+
+	/* Reverse the list so completions are delivered in order.
+	 */
+	for (prev = 0; done != 0; done = r) {
+		r = done->next;
+		done->next = prev;
+		prev = done;
+	}
+	while ((r = prev) != 0) {
+		prev = r->next;
+		(*r->completion)(r->arg, r->success);
+		if (r->write) {
+			free(r->data);
+		}
+		free(r);
+	}
 }
 
-static unsigned int dev_disk_getsize(struct dev_disk *dd){
-	return dd->nblocks;
+/* Add a request to the pending list and wake up an I/O thread.
+ */
+static void dev_disk_enqueue(struct dev_disk *dd, struct dd_request *r){
+	sigset_t old;
+
+	dev_disk_lock(dd, &old);
+	*dd->pending_tail = r;
+	dd->pending_tail = &r->next;
+	pthread_cond_signal(&dd->work);
+	dev_disk_unlock(dd, &old);
 }
 
-/* Read a block.  Invoke completion() when done.
+/* Queue a request for the I/O threads.
  */
-static void dev_disk_read(struct dev_disk *dd, unsigned int offset, char *data,
+static void dev_disk_submit(struct dev_disk *dd, bool write, unsigned int offset,
+				unsigned int nblocks, char *data,
 				void (*completion)(void *arg, bool success), void *arg){
-	bool success;
+	struct dd_request *r = calloc(1, sizeof(*r));
 
-	if (offset >= dd->nblocks) {
-		fprintf(stderr, "dev_disk_read: offset too large\n");
-		success = false;
+	r->write = write;
+	r->offset = offset;
+	r->nblocks = nblocks;
+	r->completion = completion;
+	r->arg = arg;
+
+	/* The caller may reuse the buffer of a write right away.
+	 */
+	if (write) {
+		r->data = malloc(nblocks * BLOCK_SIZE);
+		memcpy(r->data, data, nblocks * BLOCK_SIZE);
 	}
 	else {
-		lseek(dd->fd, (off_t) offset * BLOCK_SIZE, SEEK_SET);
+		r->data = data;
+	}
+	dev_disk_enqueue(dd, r);
+}
 
-		int n = read(dd->fd, data, BLOCK_SIZE);
-		if (n < 0) {
-			perror("dev_disk_read");
-			success = false;
+/* Start the I/O threads.  Returns false if that's not possible, in which
+ * case all I/O is done synchronously.
+ */
+static bool dev_disk_start(struct dev_disk *dd){
+	if (DEV_DISK_NWORKERS == 0) {
+		return false;
+	}
+	if (pipe(dd->notify) < 0) {
+		perror("dev_disk_start: pipe");
+		return false;
+	}
+
+	/* Set ASYNC so that processes get interrupted when I/O completes.
+	 */
+	if (fcntl(dd->notify[0], F_SETOWN, getpid()) != 0 ||
+			fcntl(dd->notify[0], F_SETFL, O_ASYNC | O_NONBLOCK) != 0) {
+		perror("dev_disk_start: fcntl");
+		close(dd->notify[0]);
+		close(dd->notify[1]);
+		return false;
+	}
+
+	pthread_mutex_init(&dd->lock, 0);
+	pthread_cond_init(&dd->work, 0);
+	dd->pending_tail = &dd->pending;
+
+	/* The I/O threads should never handle any signals.  They inherit
+	 * the signal mask of this thread.
+	 */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (int i = 0; i < DEV_DISK_NWORKERS; i++) {
+		dd->workers[i].dd = dd;
+		dd->workers[i].index = i;
+		if (pthread_create(&dd->workers[i].thread, 0, dev_disk_worker, &dd->workers[i]) != 0) {
+			perror("dev_disk_start: pthread_create");
+			exit(1);
 		}
-		else {
-			if (n < BLOCK_SIZE) {
-				memset((char *) data + n, 0, BLOCK_SIZE - n);
-			}
-			success = true;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+
+	earth.intr.register_dev(dd->notify[0], dev_disk_read_avail, dd);
+	return true;
+}
+
+/* Map the disk image into memory.  Returns false if that's not possible,
+ * in which case the file is accessed with system calls.
+ */
+static bool dev_disk_map(struct dev_disk *dd, char *file_name, unsigned int flags){
+	size_t size = (size_t) dd->nblocks * BLOCK_SIZE;
+
+	void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, dd->fd, 0);
+	if (map == MAP_FAILED) {
+		perror(file_name);
+		return false;
+	}
+	if (flags & DEV_DISK_SEQUENTIAL) {
+		(void) madvise(map, size, MADV_SEQUENTIAL);
+	}
+	if (flags & DEV_DISK_RANDOM) {
+		(void) madvise(map, size, MADV_RANDOM);
+	}
+	dd->map = map;
+	dd->dirty_lo = dd->nblocks;
+	dd->dirty_hi = 0;
+	return true;
+}
+
+/* Write back blocks [lo, hi) of the mapping.  msync needs a page-aligned
+ * address.
+ */
+static bool dev_disk_msync(struct dev_disk *dd, unsigned int lo, unsigned int hi){
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t start = (size_t) lo * BLOCK_SIZE / pagesize * pagesize;
+	size_t end = (size_t) hi * BLOCK_SIZE;
+
+	if (msync(dd->map + start, end - start, MS_SYNC) != 0) {
+		perror("dev_disk_msync");
+		return false;
+	}
+	return true;
+}
+
+/* Do a disk operation on the mapped image.
+ */
+static bool dev_disk_map_io(struct dev_disk *dd, struct dd_request *r){
+	char *addr = dd->map + (size_t) r->offset * BLOCK_SIZE;
+	size_t size = (size_t) r->nblocks * BLOCK_SIZE;
+
+	if (!r->write) {
+		memcpy(r->data, addr, size);
+		return true;
+	}
+	memcpy(addr, r->data, size);
+	if (dd->sync) {
+		return dev_disk_msync(dd, r->offset, r->offset + r->nblocks);
+	}
+	if (r->offset < dd->dirty_lo) {
+		dd->dirty_lo = r->offset;
+	}
+	if (r->offset + r->nblocks > dd->dirty_hi) {
+		dd->dirty_hi = r->offset + r->nblocks;
+	}
+	return true;
+}
+
+/* Start a disk operation.  If there are I/O threads, hand it to them.
+ * Otherwise do it right here and schedule the completion event.
+ */
+static void dev_disk_io(struct dev_disk *dd, bool write, unsigned int offset,
+				unsigned int nblocks, char *data,
+				void (*completion)(void *arg, bool success), void *arg){
+	if (offset >= dd->nblocks || nblocks > dd->nblocks - offset) {
+		fprintf(stderr, "dev_disk_%s: offset too large\n", write ? "write" : "read");
+		dev_disk_make_event(dd, completion, arg, false);
+	}
+	else if (dd->async) {
+		dev_disk_submit(dd, write, offset, nblocks, data, completion, arg);
+	}
+	else {
+		struct dd_request r;
+
+		memset(&r, 0, sizeof(r));
+		r.write = write;
+		r.offset = offset;
+		r.nblocks = nblocks;
+		r.data = data;
+		dev_disk_make_event(dd, completion, arg,
+				dd->map != 0 ? dev_disk_map_io(dd, &r) : dev_disk_do_io(dd, &r));
+	}
+}
+
+/* Make sure all writes issued so far are on disk.  Invoke completion()
+ * when done.  With I/O threads, this is a pseudo-write of the entire disk
+ * so that it is ordered after all earlier writes.
+ */
+static void dev_disk_sync(struct dev_disk *dd,
+				void (*completion)(void *arg, bool success), void *arg){
+	if (dd->map != 0) {
+		bool success = true;
+
+		if (dd->dirty_lo < dd->dirty_hi) {
+			success = dev_disk_msync(dd, dd->dirty_lo, dd->dirty_hi);
+			dd->dirty_lo = dd->nblocks;
+			dd->dirty_hi = 0;
 		}
+		dev_disk_make_event(dd, completion, arg, success);
+	}
+	else if (dd->async) {
+		struct dd_request *r = calloc(1, sizeof(*r));
+
+		r->write = r->flush = true;
+		r->offset = 0;
+		r->nblocks = dd->nblocks;
+		r->completion = completion;
+		r->arg = arg;
+		dev_disk_enqueue(dd, r);
+	}
+	else {
+		dev_disk_make_event(dd, completion, arg, fdatasync(dd->fd) == 0);
 	}
+}
+
+/* Write nblocks contiguous blocks.  Invoke completion() when done.
+ */
+static void dev_disk_write(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+				const char *data, void (*completion)(void *arg, bool success), void *arg){
+	dev_disk_io(dd, true, offset, nblocks, (char *) data, completion, arg);
+}
 
-	dev_disk_make_event(dd, completion, arg, success);
+static unsigned int dev_disk_getsize(struct dev_disk *dd){
+	return dd->nblocks;
+}
+
+/* Read nblocks contiguous blocks.  Invoke completion() when done.
+ */
+static void dev_disk_read(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+				char *data, void (*completion)(void *arg, bool success), void *arg){
+	dev_disk_io(dd, false, offset, nblocks, data, completion, arg);
 }
 
 void dev_disk_setup(struct dev_disk_intf *ddi){
@@ -159,4 +643,5 @@ void dev_disk_setup(struct dev_disk_intf *ddi){
 	ddi->getsize = dev_disk_getsize;
 	ddi->read = dev_disk_read;
 	ddi->write = dev_disk_write;
+	ddi->sync = dev_disk_sync;
 };
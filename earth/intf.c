@@ -20,6 +20,7 @@ void earth_setup(){
 	log_setup(&earth.log);
 	intr_setup(&earth.intr);
 	tlb_setup(&earth.tlb);
+	mem_setup(&earth.mem);
 	clock_setup(&earth.clock);
 	dev_disk_setup(&earth.dev_disk);
 	dev_gate_setup(&earth.dev_gate);
@@ -8,6 +8,7 @@
 #include <poll.h>
 #include <earth/earth.h>
 #include <earth/intr.h>
+#include <earth/tlb.h>
 #include <egos/queue.h>
 
 /* State about "device"
@@ -130,6 +131,13 @@ static void signal_handler(int sig, siginfo_t *si, void *arg){
 #endif
 #endif /* LINUX */
 
+	/* The first write to a clean page in the TLB is handled here, even
+	 * when it is the kernel that writes.
+	 */
+	if ((sig == SIGSEGV || sig == SIGBUS) && tlb_write_fault(si->si_addr)) {
+		return;
+	}
+
 	if (intr.sig_depth != 0) {
 		fprintf(stderr, "earth: signal_handler depth=%u sig=%d: addr=%"PRIaddr" ip=%"PRIaddr" sp=%"PRIaddr"\n\r",
 				intr.sig_depth, sig, (address_t) si->si_addr,
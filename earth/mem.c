@@ -0,0 +1,114 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <earth/earth.h>
+#include <earth/mem.h>
+
+/* Physical memory lives in a memfd (or, where memfd_create() is not
+ * available, an unlinked temporary file) that is mapped shared.  The TLB
+ * can then map a frame at a virtual page by mapping the same part of the
+ * file there, which takes no copying.  If no such object can be created,
+ * physical memory is plain allocated memory and the TLB falls back to
+ * copying frames.
+ */
+static struct mem {
+	int fd;							// memory object, or -1
+	char *base;						// where it is mapped
+	size_t size;					// its size in bytes
+} mem = { .fd = -1 };
+
+/* Create the memory object.  Returns a file descriptor or -1.
+ */
+static int mem_create(size_t size){
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("earth-mem", MFD_CLOEXEC);
+#else
+	char name[] = "/tmp/earth-memXXXXXX";
+
+	if ((fd = mkstemp(name)) >= 0) {
+		unlink(name);
+	}
+#endif
+	if (fd < 0) {
+		perror("mem_create");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("mem_create: ftruncate");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Find the memory object and offset of the given frame.
+ */
+bool mem_lookup(void *phys, int *fd, off_t *offset){
+	char *p = phys;
+
+	if (mem.fd < 0 || p < mem.base || p >= mem.base + mem.size) {
+		return false;
+	}
+	*fd = mem.fd;
+	*offset = p - mem.base;
+	return true;
+}
+
+/* Allocate physical memory of nframes frames.
+ */
+static void *mem_initialize(unsigned int nframes, unsigned int prot){
+	printf("earth: mem_initialize\n\r");
+
+	unsigned int mprot = 0;
+	if (prot & P_READ) {
+		mprot |= PROT_READ;
+	}
+	if (prot & P_WRITE) {
+		mprot |= PROT_WRITE;
+	}
+
+	mem.size = (size_t) nframes * PAGESIZE;
+	if ((mem.fd = mem_create(mem.size)) >= 0) {
+		mem.base = mmap(0, mem.size, mprot, MAP_SHARED, mem.fd, 0);
+		if (mem.base != MAP_FAILED) {
+			return mem.base;
+		}
+		perror("mem_initialize: mmap");
+		close(mem.fd);
+		mem.fd = -1;
+	}
+
+	/* Fall back to ordinary memory.
+	 */
+	mem.base = calloc(nframes, PAGESIZE);
+	return mem.base;
+}
+
+/* Allocate a stack of the given size (a multiple of PAGESIZE), with an
+ * inaccessible guard page below it so that overflows fault rather than
+ * corrupt whatever lies below.  Returns the lowest usable address, or 0.
+ */
+static void *mem_stack_alloc(unsigned int size){
+	char *base = mmap(0, size + PAGESIZE, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (base == MAP_FAILED) {
+		perror("mem_stack_alloc");
+		return 0;
+	}
+	if (mprotect(base, PAGESIZE, PROT_NONE) != 0) {
+		perror("mem_stack_alloc: mprotect");
+	}
+	return base + PAGESIZE;
+}
+
+void mem_setup(struct mem_intf *mi){
+	mi->initialize = mem_initialize;
+	mi->stack_alloc = mem_stack_alloc;
+}
@@ -7,12 +7,40 @@
 #include <earth/earth.h>
 #include <earth/intf.h>
 
+/* The TLB is emulated by mapping virtual pages at their actual addresses
+ * in the virtual address range.  If the frame is part of the shared memory
+ * object that holds physical memory (see mem.c), the frame itself is
+ * mapped at the virtual page, and the entry is "direct": the page and the
+ * frame are the same memory, so nothing ever needs to be copied.
+ * Otherwise the contents of frames are copied in and out of the virtual
+ * pages.  Since all address spaces share the same range, at most one
+ * entry can be "resident" at each virtual page.  The contents of a copied
+ * entry may be newer than its frame.  Entries of other address spaces
+ * than the current one remain resident but inaccessible, so that
+ * switching back to them does not require any copying.  Their contents
+ * are only written back to the frame when another entry needs the same
+ * virtual page, when they are replaced, or when they are explicitly
+ * unmapped or flushed.
+ *
+ * Copied entries that are writable are first made accessible read-only.
+ * The first write to such a page faults, which earth handles itself by
+ * setting the entry's dirty bit and making the page writable.  Only dirty
+ * entries are ever copied back to their frames.
+ *
+ * An entry for a virtual page can only be in set (virt % nsets), so all
+ * entries for the same virtual page are in the same set.
+ */
+
 /* An entry in the TLB.  If phys == 0, the entry is unused.
  */
 struct tlb_entry {
 	page_no virt;					// virtual page number
 	void *phys;						// physical address of frame
 	unsigned int prot;				// protection bits
+	unsigned int asid;				// address space identifier
+	bool referenced;				// used since last considered for replacement
+	bool direct;					// frame is mapped at the virtual page
+	bool dirty;						// written since copied in or synced
 };
 
 /* Global but private data.
@@ -21,7 +49,11 @@ struct tlb {
 	address_t virt_start;			// start of virtual address space
 	page_no virt_pages;				// size of virtual address space
 	unsigned int nentries;			// size of TLB
+	unsigned int nsets, nways;		// organization
+	unsigned int *hands;			// clock hand per set
+	unsigned int asid;				// current address space
 	struct tlb_entry *entries;		// array of tlb_entries
+	struct tlb_stats stats;
 };
 static struct tlb tlb;
 
@@ -42,43 +74,114 @@ static unsigned int prot_cvt(unsigned int prot){
 	return result;
 }
 
-/* Find a TLB mapping by virtual page number.
+/* Return the actual protection of the virtual page of the given entry
+ * when its address space is active.  A clean copied entry is read-only
+ * so that the first write to it can be detected.
  */
-static int tlb_get_entry(page_no virt){
+static unsigned int tlb_host_prot(struct tlb_entry *te){
+	unsigned int prot = prot_cvt(te->prot);
+
+	if (!te->direct && !te->dirty) {
+		prot &= ~PROT_WRITE;
+	}
+	return prot;
+}
+
+/* Find the resident entry for the given virtual page, if any.
+ */
+static struct tlb_entry *tlb_find(page_no virt){
+	struct tlb_entry *te = &tlb.entries[(virt % tlb.nsets) * tlb.nways];
 	unsigned int i;
-	struct tlb_entry *te;
 
-	for (i = 0, te = tlb.entries; i < tlb.nentries; i++, te++) {
+	for (i = 0; i < tlb.nways; i++, te++) {
 		if (te->virt == virt && te->phys != 0) {
-			return i;
+			return te;
 		}
 	}
-	return -1;
+	return 0;
+}
+
+/* Find a TLB mapping in the current address space by virtual page number.
+ */
+static int tlb_get_entry(page_no virt){
+	struct tlb_entry *te = tlb_find(virt);
+
+	tlb.stats.lookups++;
+	if (te == 0 || te->asid != tlb.asid) {
+		return -1;
+	}
+	tlb.stats.hits++;
+	te->referenced = true;
+	return te - tlb.entries;
 }
 
 /* Sync the given entry in the tlb.
  */
 static void tlb_sync_entry(struct tlb_entry *te){
+	/* A direct mapping is the frame itself, and a clean page has not
+	 * been modified.
+	 */
+	if (te->direct) {
+		return;
+	}
+	if (!te->dirty) {
+		if (te->prot & P_WRITE) {
+			tlb.stats.clean++;
+		}
+		return;
+	}
+
 	/* Find its virtual address.
 	 */
 	address_t addr = (address_t) te->virt * PAGESIZE;
 
-	/* If the page is writable, it may have been updated.  Save it.
+	/* Save the page.  It is not accessible if it's in another address
+	 * space.
 	 */
-	if (te->prot & P_WRITE) {
-		if (!(te->prot & P_READ)) {
-			mprotect((void *) addr, PAGESIZE, PROT_READ);
-		}
+	bool active = te->asid == tlb.asid;
+	if (!active || !(te->prot & P_READ)) {
+		mprotect((void *) addr, PAGESIZE, PROT_READ);
+	}
 
-		/* TODO.  If stack page, we do not have to save below stack pointer.
-		 */
-		memcpy(te->phys, (void *) addr, PAGESIZE);
+	/* TODO.  If stack page, we do not have to save below stack pointer.
+	 */
+	memcpy(te->phys, (void *) addr, PAGESIZE);
+	tlb.stats.bytes_copied += PAGESIZE;
+
+	/* The page is clean again, so catch the next write.
+	 */
+	te->dirty = false;
+	mprotect((void *) addr, PAGESIZE, active ? tlb_host_prot(te) : PROT_NONE);
+}
+
+/* Handle a fault on the given address.  If it is the first write to a
+ * writable page of the current address space, mark the entry dirty and
+ * make the page writable.  Returns whether the fault was handled.
+ */
+bool tlb_write_fault(void *addr){
+	if (tlb.nentries == 0 || (address_t) addr < VIRT_BASE ||
+									(address_t) addr >= VIRT_TOP) {
+		return false;
+	}
+
+	page_no virt = (address_t) addr / PAGESIZE;
+	struct tlb_entry *te = tlb_find(virt);
+	if (te == 0 || te->asid != tlb.asid || te->direct || te->dirty ||
+									!(te->prot & P_WRITE)) {
+		return false;
 	}
+
+	te->dirty = true;
+	te->referenced = true;
+	tlb.stats.dirty_faults++;
+	mprotect((void *) ((address_t) virt * PAGESIZE), PAGESIZE, tlb_host_prot(te));
+	return true;
 }
 
-/* Flush the given entry from the TLB.
+/* Flush the given entry from the TLB, writing the page back to its
+ * frame first if sync is set.
  */
-static void tlb_flush_entry(struct tlb_entry *te){
+static void tlb_flush_entry(struct tlb_entry *te, bool sync){
 	/* If not mapped, we're done.
 	 */
 	if (te->phys == 0) {
@@ -89,30 +192,44 @@ static void tlb_flush_entry(struct tlb_entry *te){
 
 	/* Write page back to frame.
 	 */
-	tlb_sync_entry(te);
+	if (sync) {
+		tlb_sync_entry(te);
+	}
 
-	/* Mark page as inaccessible.
+	/* Mark page as inaccessible.  A direct mapping is replaced by
+	 * anonymous memory again, so the frame is no longer reachable through
+	 * the virtual page.
 	 */
 	address_t addr = (address_t) te->virt * PAGESIZE;
-	mprotect((void *) addr, PAGESIZE, PROT_NONE);
+	if (te->direct) {
+		if (mmap((void *) addr, PAGESIZE, PROT_NONE,
+				MAP_FIXED | MAP_PRIVATE | MAP_ANON, -1, 0) != (void *) addr) {
+			perror("tlb_flush_entry: mmap");
+		}
+	}
+	else {
+		mprotect((void *) addr, PAGESIZE, PROT_NONE);
+	}
 
 	/* Release the entry.
 	 */
 	te->virt = 0;
 	te->phys = 0;
 	te->prot = 0;
+	te->asid = 0;
+	te->referenced = false;
+	te->direct = false;
+	te->dirty = false;
 }
 
-/* Unmap TLB entries corresponding to the given virtual page.
+/* Unmap the TLB entry of the given address space for the given virtual
+ * page, if any.
  */
-static void tlb_unmap(page_no virt){
-	unsigned int i;
-	struct tlb_entry *te;
+static void tlb_unmap(unsigned int asid, page_no virt){
+	struct tlb_entry *te = tlb_find(virt);
 
-	for (i = 0, te = tlb.entries; i < tlb.nentries; i++, te++) {
-		if (te->virt == virt) {
-			tlb_flush_entry(te);
-		}
+	if (te != 0 && te->asid == asid) {
+		tlb_flush_entry(te, true);
 	}
 }
 
@@ -140,17 +257,39 @@ static int tlb_get(unsigned int tlb_index, page_no *virt,
 	return 1;
 }
 
-/* In the TLB, map the given virtual page to the given physical address.
+/* Select an entry in the set of the given virtual page to replace, using
+ * the clock algorithm on the reference bits.
  */
-static int tlb_map(unsigned int tlb_index, page_no virt,
-									void *phys, unsigned int prot){
-	struct tlb_entry *te;
+static struct tlb_entry *tlb_victim(page_no virt){
+	unsigned int set = virt % tlb.nsets;
+	struct tlb_entry *base = &tlb.entries[set * tlb.nways];
 
-	if (tlb_index >= tlb.nentries) {
-		fprintf(stderr, "tlb_map: non-existing entry\n");
-		return 0;
+	/* This terminates within two rounds, as the first clears all the
+	 * reference bits.
+	 */
+	for (;;) {
+		struct tlb_entry *te = &base[tlb.hands[set]];
+
+		tlb.hands[set] = (tlb.hands[set] + 1) % tlb.nways;
+		if (te->phys == 0) {
+			return te;
+		}
+		if (!te->referenced) {
+			tlb.stats.evictions++;
+			tlb_flush_entry(te, true);
+			return te;
+		}
+		te->referenced = false;
 	}
-	te = &tlb.entries[tlb_index];
+}
+
+/* In the TLB, map the given virtual page in the current address space to
+ * the given physical address.  Returns the index of the entry used.
+ */
+static int tlb_map(page_no virt, void *phys, unsigned int prot){
+	struct tlb_entry *te = tlb_find(virt);
+
+	tlb.stats.maps++;
 
 	/* Figure out the base address.
 	 */
@@ -159,17 +298,24 @@ static int tlb_map(unsigned int tlb_index, page_no virt,
 	// printf("tlb_map %"PRIaddr" to %"PRIaddr"\n\r", addr, (uint64_t) phys);
 
 	/* Check to see if we're just changing the protection.
-	 *
-	 * TODO.  Optimize this case.
 	 */
-	if (te->virt == virt && te->phys == phys) {
-		// printf("tlb_map: changing protection bits\n\r");
+	if (te != 0 && te->asid == tlb.asid && te->phys == phys) {
+		te->prot = prot;
+		if (mprotect((void *) addr, PAGESIZE, tlb_host_prot(te)) != 0) {
+			perror("mprotect 0");
+		}
+		te->referenced = true;
+		return te - tlb.entries;
 	}
 
-	/* See if the entry is currently mapped.  If so, flush it.
+	/* If another mapping of the page is resident, write it back.
+	 * Otherwise make room in the set.
 	 */
-	if (te->phys != 0) {
-		tlb_flush_entry(te);
+	if (te != 0) {
+		tlb_flush_entry(te, true);
+	}
+	else {
+		te = tlb_victim(virt);
 	}
 
 	/* Fill the TLB entry.
@@ -177,19 +323,34 @@ static int tlb_map(unsigned int tlb_index, page_no virt,
 	te->virt = virt;
 	te->phys = phys;
 	te->prot = prot;
+	te->asid = tlb.asid;
+	te->referenced = true;
+	te->direct = false;
+	te->dirty = false;
 
-	/* Temporarily set write access so we can copy the frame into the
-	 * right position.
+	/* If possible, map the frame itself at the virtual page.
 	 */
-	if (!(prot & P_WRITE)) {
-		if (mprotect((void *) addr, PAGESIZE, PROT_WRITE) != 0) {
-			perror("mprotect 1");
+	int fd;
+	off_t offset;
+	if (mem_lookup(phys, &fd, &offset)) {
+		if (mmap((void *) addr, PAGESIZE, prot_cvt(prot),
+				MAP_FIXED | MAP_SHARED, fd, offset) == (void *) addr) {
+			te->direct = true;
+			tlb.stats.remaps++;
+			return te - tlb.entries;
 		}
+
+		/* The old mapping may be gone.  Restore it and copy instead.
+		 */
+		mmap((void *) addr, PAGESIZE, PROT_NONE,
+				MAP_FIXED | MAP_PRIVATE | MAP_ANON, -1, 0);
 	}
-	else {
-		if (mprotect((void *) addr, PAGESIZE, prot_cvt(prot)) != 0) {
-			perror("mprotect 2");
-		}
+
+	/* Temporarily set write access so we can copy the frame into the
+	 * right position.
+	 */
+	if (mprotect((void *) addr, PAGESIZE, PROT_READ | PROT_WRITE) != 0) {
+		perror("mprotect 1");
 	}
 
 	// printf("restore %x %"PRIaddr" to %"PRIaddr" %x\n\r",
@@ -197,16 +358,42 @@ static int tlb_map(unsigned int tlb_index, page_no virt,
 	/* TODO.  If stack do not restore below stack pointer.
 	 */
 	memcpy((void *) addr, phys, PAGESIZE);
+	tlb.stats.bytes_copied += PAGESIZE;
 
-	/* Now set the permissions correctly and we're done.
+	/* Now set the permissions correctly and we're done.  The page is
+	 * clean, so it's read-only until it is written.
 	 */
-	if (!(prot & P_WRITE)) {
-		if (mprotect((void *) addr, PAGESIZE, prot_cvt(prot)) != 0) {
-			perror("mprotect 3");
-		}
+	if (mprotect((void *) addr, PAGESIZE, tlb_host_prot(te)) != 0) {
+		perror("mprotect 2");
 	}
 
-	return 1;
+	return te - tlb.entries;
+}
+
+/* Switch to another address space.  The entries of the old one become
+ * inaccessible, and those of the new one accessible again, without
+ * copying anything.
+ */
+static void tlb_set_asid(unsigned int asid){
+	unsigned int i;
+	struct tlb_entry *te;
+
+	if (asid == tlb.asid) {
+		return;
+	}
+	for (i = 0, te = tlb.entries; i < tlb.nentries; i++, te++) {
+		if (te->phys == 0) {
+			continue;
+		}
+		address_t addr = (address_t) te->virt * PAGESIZE;
+		if (te->asid == tlb.asid) {
+			mprotect((void *) addr, PAGESIZE, PROT_NONE);
+		}
+		else if (te->asid == asid) {
+			mprotect((void *) addr, PAGESIZE, tlb_host_prot(te));
+		}
+	}
+	tlb.asid = asid;
 }
 
 /* Flush the TLB.
@@ -214,8 +401,23 @@ static int tlb_map(unsigned int tlb_index, page_no virt,
 static void tlb_flush(void){
 	unsigned int i;
 
+	tlb.stats.flushes++;
 	for (i = 0; i < tlb.nentries; i++) {
-		tlb_flush_entry(&tlb.entries[i]);
+		tlb_flush_entry(&tlb.entries[i], true);
+	}
+}
+
+/* Flush all entries of the given address space.  If sync is not set,
+ * modifications are discarded (e.g., because the address space is gone).
+ */
+static void tlb_flush_asid(unsigned int asid, bool sync){
+	unsigned int i;
+
+	tlb.stats.flushes++;
+	for (i = 0; i < tlb.nentries; i++) {
+		if (tlb.entries[i].phys != 0 && tlb.entries[i].asid == asid) {
+			tlb_flush_entry(&tlb.entries[i], sync);
+		}
 	}
 }
 
@@ -231,9 +433,14 @@ static void tlb_sync(void){
 	}
 }
 
-/* Set up everything.
+static void tlb_get_stats(struct tlb_stats *stats){
+	*stats = tlb.stats;
+}
+
+/* Set up everything.  The TLB has nentries entries, organized in sets
+ * of nways entries each.
  */
-static void tlb_initialize(unsigned int nentries){
+static void tlb_initialize(unsigned int nentries, unsigned int nways){
 	printf("earth: tlb_initialize\n\r");
 	unsigned int pagesize = getpagesize();
 
@@ -251,8 +458,15 @@ static void tlb_initialize(unsigned int nentries){
 		fprintf(stderr, "tlb_initialize: VIRT_BASE not a multiple of actual page size\n");
 		exit(1);
 	}
+	if (nways == 0 || nways > nentries || nentries % nways != 0) {
+		fprintf(stderr, "tlb_initialize: bad associativity %u\n", nways);
+		exit(1);
+	}
 
 	tlb.nentries = nentries;
+	tlb.nways = nways;
+	tlb.nsets = nentries / nways;
+	tlb.hands = (unsigned int *) calloc(tlb.nsets, sizeof(*tlb.hands));
 	tlb.entries = (struct tlb_entry *) calloc(nentries, sizeof(*tlb.entries));
 
 	/* Try to map the virtual address range.
@@ -269,8 +483,11 @@ void tlb_setup(struct tlb_intf *ti){
 	ti->initialize = tlb_initialize;
 	ti->flush = tlb_flush;
 	ti->sync = tlb_sync;
+	ti->set_asid = tlb_set_asid;
 	ti->map = tlb_map;
 	ti->get = tlb_get;
 	ti->unmap = tlb_unmap;
+	ti->flush_asid = tlb_flush_asid;
 	ti->get_entry = tlb_get_entry;
+	ti->get_stats = tlb_get_stats;
 }
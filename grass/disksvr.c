@@ -18,6 +18,7 @@ struct disk_server_state {
 
 struct disk_request {
 	gpid_t pid, src;
+	unsigned int nblock;		// #blocks being transferred
 	struct block_reply *rep;
 };
 
@@ -35,10 +36,10 @@ static void disk_respond(struct block_request *req, enum block_status status,
 static void disk_read_complete(void *arg, bool success){
 	struct disk_request *dr = arg;
 
-	dr->rep->size_nblock = 1;
+	dr->rep->size_nblock = dr->nblock;
 	if (success) {
 		dr->rep->status = BLOCK_OK;
-		proc_send(dr->pid, 0, dr->src, MSG_REPLY, dr->rep, sizeof(*dr->rep) + BLOCK_SIZE);
+		proc_send(dr->pid, 0, dr->src, MSG_REPLY, dr->rep, sizeof(*dr->rep) + dr->nblock * BLOCK_SIZE);
 	}
 	else {
 		dr->rep->status = BLOCK_ERROR;
@@ -48,7 +49,8 @@ static void disk_read_complete(void *arg, bool success){
 	m_free(dr);
 }
 
-/* Respond to a read block request.
+/* Respond to a read block request.  A run of up to req->nblock blocks is
+ * read with a single disk operation, truncated at the end of the disk.
  */
 static void disk_do_read(struct disk_server_state *dss, struct block_request *req, gpid_t src){
     if (req->ino != 0) {
@@ -57,17 +59,27 @@ static void disk_do_read(struct disk_server_state *dss, struct block_request *re
         return;
     }
 
+	unsigned int nblock = req->nblock == 0 ? 1 : req->nblock;
+	if (nblock > BLOCK_MAX_NBLOCK) {
+		nblock = BLOCK_MAX_NBLOCK;
+	}
+	unsigned int size = earth.dev_disk.getsize(dss->dd);
+	if (req->offset_nblock < size && nblock > size - req->offset_nblock) {
+		nblock = size - req->offset_nblock;
+	}
+
     /* Allocate room for the reply.
      */
-    struct block_reply *rep = new_alloc_ext(struct block_reply, BLOCK_SIZE);
+    struct block_reply *rep = new_alloc_ext(struct block_reply, nblock * BLOCK_SIZE);
 
 	/* Schedule the disk read operation.
 	 */
 	struct disk_request *dr = new_alloc(struct disk_request);
 	dr->pid = sys_getpid();
 	dr->src = src;
+	dr->nblock = nblock;
 	dr->rep = rep;
-	earth.dev_disk.read(dss->dd, req->offset_nblock, (char *) &rep[1], disk_read_complete, dr);
+	earth.dev_disk.read(dss->dd, req->offset_nblock, nblock, (char *) &rep[1], disk_read_complete, dr);
 }
 
 /* This is an interrupt handler, invoked when the write has completed.
@@ -76,17 +88,24 @@ static void disk_write_complete(void *arg, bool success){
 	struct disk_request *dr = arg;
 
 	dr->rep->status = success ? BLOCK_OK : BLOCK_ERROR;
-	dr->rep->size_nblock = 1;
+	dr->rep->size_nblock = dr->nblock;
 	proc_send(dr->pid, 0, dr->src, MSG_REPLY, dr->rep, sizeof(*dr->rep));
 	m_free(dr->rep);
 	m_free(dr);
 }
 
-/* Respond to a write block request.
+/* Respond to a write block request.  The number of blocks is determined
+ * by the size of the message.
  */
 static void disk_do_write(struct disk_server_state *dss, struct block_request *req,
 														unsigned int size, gpid_t src){
-	assert(size == BLOCK_SIZE);
+	unsigned int nblock = size / BLOCK_SIZE;
+	if (size == 0 || size % BLOCK_SIZE != 0 ||
+						(req->nblock != 0 && req->nblock != nblock)) {
+        printf("disk_do_write %s: bad size: %u\n\r", dss->filename, size);
+        disk_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+	}
     if (req->ino != 0) {
         printf("disk_do_write %s: bad inode: %u\n\r", dss->filename, req->ino);
         disk_respond(req, BLOCK_ERROR, 0, 0, src);
@@ -102,8 +121,9 @@ static void disk_do_write(struct disk_server_state *dss, struct block_request *r
 	struct disk_request *dr = new_alloc(struct disk_request);
 	dr->pid = sys_getpid();
 	dr->src = src;
+	dr->nblock = nblock;
 	dr->rep = rep;
-	earth.dev_disk.write(dss->dd, req->offset_nblock, (char *) &req[1], disk_write_complete, dr);
+	earth.dev_disk.write(dss->dd, req->offset_nblock, nblock, (char *) &req[1], disk_write_complete, dr);
 }
 
 /* Respond to a getsize block request.
@@ -131,10 +151,16 @@ static void disk_do_setsize(struct disk_server_state *dss, struct block_request
 	disk_respond(req, BLOCK_ERROR, 0, 0, src);
 }
 
-/* Respond to a sync request
+/* Respond to a sync request.  The reply is sent once all earlier writes
+ * have made it to the disk.
  */
 static void disk_do_sync(struct disk_server_state *dss, struct block_request *req, gpid_t src){
-	disk_respond(req, BLOCK_OK, 0, 0, src);
+	struct disk_request *dr = new_alloc(struct disk_request);
+	dr->pid = sys_getpid();
+	dr->src = src;
+	dr->nblock = 0;
+	dr->rep = new_alloc(struct block_reply);
+	earth.dev_disk.sync(dss->dd, disk_write_complete, dr);
 }
 
 static void disk_proc(void *arg){
@@ -144,11 +170,11 @@ static void disk_proc(void *arg){
 
 	snprintf(proc_current->descr, sizeof(proc_current->descr), "K %s", basename(dss->filename));
 
-    struct block_request *req = new_alloc_ext(struct block_request, BLOCK_SIZE);
+    struct block_request *req = new_alloc_ext(struct block_request, BLOCK_MAX_MSG_SIZE);
     for (;;) {
         gpid_t src;
 		unsigned int uid;
-        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + BLOCK_SIZE, &src, &uid);
+        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + BLOCK_MAX_MSG_SIZE, &src, &uid);
 		if (req_size < 0) {
 			printf("disk server shutting down\n\r");
 			// m_free(dss);			-- events may still come in
@@ -190,11 +216,12 @@ static void disk_proc(void *arg){
     }
 }
 
-/* Create a disk device.
+/* Create a disk device.  flags is a combination of DEV_DISK_* flags that
+ * select how the device is simulated (see h/earth/devdisk.h).
  */
-gpid_t disk_init(char *filename, unsigned int nblocks, bool sync){
+gpid_t disk_init(char *filename, unsigned int nblocks, unsigned int flags){
 	struct disk_server_state *dss = new_alloc(struct disk_server_state);
 	dss->filename = filename;
-	dss->dd = earth.dev_disk.create(filename, nblocks, sync);
+	dss->dd = earth.dev_disk.create(filename, nblocks, flags);
 	return proc_create(1, "disk", disk_proc, dss);
 }
@@ -29,7 +29,12 @@ static address_t kernel_sp;                  // kernel stack pointer
 static address_t signal_sp;                  // signal stack pointer
 static char signal_stack[SIGNAL_STACK_SIZE]; // stack for initial pgfault
 
+/* Give the process a signal stack in its initial state.
+ */
 void sigstk_init(struct process *proc) {
+  if (proc->sigstack == 0) {
+    proc->sigstack = m_alloc(SIGNAL_STACK_SIZE);
+  }
   memcpy(proc->sigstack, signal_stack, SIGNAL_STACK_SIZE);
   proc->sig_sp = signal_sp;
 }
@@ -214,10 +219,19 @@ void grass_main(void) {
   gpid_t ramfile_init(gpid_t gate);
   ge.servers[GPID_FILE_RAM] = ramfile_init(ge.servers[GPID_GATE]);
 
-  gpid_t disk_init(char *filename, unsigned int nblocks, bool sync);
-  ge.servers[GPID_DISK_PAGE] =
-      disk_init("storage/page.dev", PG_DEV_BLOCKS, false);
-  ge.servers[GPID_DISK_FS] = disk_init("storage/fs.dev", 16 * 1024, false);
+  // The paging device is accessed in a random pattern and need not survive
+  // a crash, so it is memory-mapped.
+  gpid_t disk_init(char *filename, unsigned int nblocks, unsigned int flags);
+  ge.servers[GPID_DISK_PAGE] = disk_init("storage/page.dev", PG_DEV_BLOCKS,
+                                         DEV_DISK_MMAP | DEV_DISK_RANDOM);
+  ge.servers[GPID_DISK_FS] = disk_init("storage/fs.dev", 16 * 1024, 0);
+  pgdev = fid_val(ge.servers[GPID_DISK_PAGE], 0);
+
+  // The terminal and disk servers are latency-sensitive and do little work
+  // per request, so give them a larger share and a short deadline.
+  proc_set_sched(ge.servers[GPID_TTY], 4 * SCHED_WEIGHT, 10);
+  proc_set_sched(ge.servers[GPID_DISK_PAGE], 4 * SCHED_WEIGHT, 20);
+  proc_set_sched(ge.servers[GPID_DISK_FS], 4 * SCHED_WEIGHT, 20);
 
   // The -c argument to the block server determines which type of filesystem it
   // uses
@@ -23,14 +23,12 @@
 /* The Earth layer is a bit ununusal in that we can specify the physical memory
  * and TLB size in software.
  */
-#define TLB_SIZE 16      // #entries in TLB
+#define TLB_SIZE 128     // #entries in TLB
+#define TLB_WAYS 4       // associativity of TLB
 #define PHYS_FRAMES 1024 // #physical frames
 
-#define MAX_PROCS 100 // maximum #processes
-
-#ifdef HW_MLFQ
-#define MLFQ_LEVELS 3 // #levels in MLFQ
-#endif
+#define MAX_PROCS 4096      // maximum #processes
+#define PROC_HASH_SIZE 1024 // size of pid hash table
 
 #ifdef HW_MEASURE
 #define ALPHA 0.01
@@ -41,14 +39,9 @@
  */
 struct process *proc_current;
 
-/* Run (aka ready) queue.F
+/* The scheduling class, which keeps the run (aka ready) queue.
  */
-#ifdef HW_MLFQ
-static struct queue proc_runnable_mlfq[MLFQ_LEVELS];
-static int quantums[MLFQ_LEVELS] = {10, 20, 30};
-#else
-static struct queue proc_runnable;
-#endif
+static struct sched_class *proc_sched;
 
 #ifdef HW_MEASURE
 struct ema_state es;
@@ -62,22 +55,72 @@ struct frame {
 static struct frame *proc_frames;    // array of frames
 static struct queue proc_freeframes; // list of free frames
 
-/* Information about frames.
+/* Read-only pages of executables are kept in a cache of frames that are
+ * shared by all processes running the same version of an executable.
+ * Pages no longer used by any process stay in the cache, on an LRU list,
+ * until their frames are needed.
  */
+struct text_page {
+  struct text_page *next;                // hash chain
+  struct text_page *lru_prev, *lru_next; // if refcnt == 0
+  gpid_t server;                         // executable
+  unsigned int file_no;
+  time_t modtime; // version of the executable
+  unsigned long size;
+  unsigned int page;   // page # in the executable file
+  unsigned int frame;  // frame holding the page
+  unsigned int refcnt; // #processes mapping the page
+};
+
+#define TEXT_HASH_SIZE 256
+static struct text_page *text_hash[TEXT_HASH_SIZE];
+static struct text_page *text_lru_first, *text_lru_last;
+
+/* Information about frames.  A frame that is being paged in or out is
+ * owned by the process doing the I/O (io_proc) and cannot be evicted.
+ * Frames that are shared, either in the text page cache or copy-on-write
+ * after a fork, have no owner either and are mapped read-only.
+ */
+struct frame_info {
+  struct process *owner;   // process whose page is in the frame, if any
+  unsigned int page;       // relative page number in the owner
+  int block;               // clean copy on the paging device, or -1
+  bool referenced;         // used since the clock hand last passed
+  bool dirty;              // must be written out when evicted
+  struct process *io_proc; // process paging the frame in or out
+  struct text_page *text;  // if in the text page cache
+  unsigned int refcnt;     // #pages sharing the frame copy-on-write
+};
+static struct frame_info *proc_frameinfo;
+static unsigned int proc_clock;     // clock hand for page replacement
+static struct queue proc_freeslots; // free pages on the paging device
+
+#define PG_BLOCKS (PAGESIZE / BLOCK_SIZE) // #blocks per page
+#define PG_CLUSTER_MIN 4                  // initial fault-around window
+#define PG_CLUSTER_MAX 16                 // maximum read-ahead window
 
 /* Other global variables.
  */
 static unsigned int proc_nprocs;    // #processes
 static unsigned int proc_nrunnable; // #runnable processes
-static struct queue proc_free;      // free processes
+static struct queue proc_free;      // released process records
+static struct queue proc_freestacks; // released kernel stacks
 static struct process *proc_next;   // next process to run after ctx switch
-static struct process proc_set[MAX_PROCS]; // set of all processes
-static bool proc_shutting_down;            // cleaning up
-static unsigned long proc_curfew;          // when to shut down
+static struct process *proc_first, *proc_last;    // all processes, by pid
+static struct process *proc_hash[PROC_HASH_SIZE]; // processes by pid
+static struct process *proc_alarms[MAX_PROCS];    // alarms, earliest first
+static unsigned int proc_nalarms;                 // #alarms set
+static bool proc_shutting_down;                   // cleaning up
+static unsigned long proc_curfew;                 // when to shut down
 
 /* We keep various statistics in this structure.
  */
-static struct stats { unsigned int npage_in, npage_out; } stats;
+static struct stats {
+  unsigned int npage_in, npage_out;
+  unsigned int nexec_read, nexec_pages; // executable page-in requests/pages
+  unsigned int ntext_hit, ntext_miss;   // text page cache lookups
+  unsigned int ncow_copy;               // copy-on-write page copies
+} stats;
 
 static void proc_cleanup() {
   printf("final clean up\n\r");
@@ -87,26 +130,23 @@ static void proc_cleanup() {
   unsigned int frame;
   while (queue_get_uint(&proc_freeframes, &frame))
     ;
+  while (queue_get_uint(&proc_freeslots, &frame))
+    ;
 
-  /* Release the free process list.
+  /* Release the free process list.  The kernel stacks are not returned
+   * to earth.
    */
-  while (queue_get(&proc_free) != 0)
+  struct process *p;
+  while ((p = queue_get(&proc_free)) != 0) {
+    m_free(p);
+  }
+  while (queue_get(&proc_freestacks) != 0)
     ;
 
-/* Release the run queue.
- */
-#ifdef HW_MLFQ
-  int cur_lv = 0;
-  while (cur_lv < MLFQ_LEVELS) {
-    while (queue_get(&proc_runnable_mlfq[cur_lv]) != 0)
-      ;
-    cur_lv++;
-  }
-#else
-  while (queue_get(&proc_runnable) != 0)
+  /* Release the run queue.
+   */
+  while (proc_sched->pick_next() != 0)
     ;
-  queue_release(&proc_runnable);
-#endif
 
   // my_dump(false);		// print info about allocated memory
 }
@@ -118,26 +158,38 @@ static void mq_init(struct msg_queue *mq) {
   queue_init(&mq->messages);
 }
 
-/* Allocate a process structure.
+/* Allocate a process structure.  Released ones are reused.
  */
 struct process *proc_alloc(gpid_t owner, char *descr, unsigned int uid) {
   static gpid_t pid_gen = 1; // to generate new process ids
-  struct process *p = queue_get(&proc_free);
 
-  if (p == 0) {
+  if (proc_nprocs >= MAX_PROCS) {
     printf("proc_alloc: no more slots\n");
     return 0;
   }
+  struct process *p = queue_get(&proc_free);
+  if (p == 0) {
+    p = new_alloc(struct process);
+  }
   memset(p, 0, sizeof(*p));
   p->pid = pid_gen++;
+  p->hash_next = proc_hash[p->pid % PROC_HASH_SIZE];
+  proc_hash[p->pid % PROC_HASH_SIZE] = p;
+
+  /* New process ids are increasing, so add it to the end of the list.
+   */
+  p->all_prev = proc_last;
+  if (proc_last == 0) {
+    proc_first = p;
+  } else {
+    proc_last->all_next = p;
+  }
+  proc_last = p;
   p->uid = uid;
   p->owner = owner;
   snprintf(p->descr, sizeof(p->descr), "K %s", descr);
   p->state = PROC_RUNNABLE;
-#ifdef HW_MLFQ
-  p->ticks_left = quantums[0];
-  p->priority_level = 0;
-#endif
+  p->weight = SCHED_WEIGHT;
 #ifdef HW_MEASURE
   p->init_time = sys_gettime();
   p->tick_count = 0;
@@ -146,10 +198,6 @@ struct process *proc_alloc(gpid_t owner, char *descr, unsigned int uid) {
   proc_nprocs++;
   proc_nrunnable++;
 
-  /* The kernel stack pointer must be aligned to 16 bytes.
-   */
-  p->kernel_sp = (address_t)&p->kernelstack[KERNEL_STACK_SIZE] & ~0xF;
-
   unsigned int i;
   for (i = 0; i < MSG_NTYPES; i++) {
     mq_init(&p->mboxes[i]);
@@ -189,6 +237,34 @@ static void proc_release(struct process *proc) {
     (*proc->finish)(proc->arg);
   }
 
+  /* Release the stacks.  The process is not running on its kernel
+   * stack any more, so that can be reused.
+   */
+  if (proc->sigstack != 0) {
+    m_free(proc->sigstack);
+  }
+  if (proc->kernelstack != 0) {
+    queue_add(&proc_freestacks, proc->kernelstack);
+  }
+
+  /* Remove it from the pid hash table and the list of all processes.
+   */
+  struct process **pp = &proc_hash[proc->pid % PROC_HASH_SIZE];
+  while (*pp != proc) {
+    pp = &(*pp)->hash_next;
+  }
+  *pp = proc->hash_next;
+  if (proc->all_prev == 0) {
+    proc_first = proc->all_next;
+  } else {
+    proc->all_prev->all_next = proc->all_next;
+  }
+  if (proc->all_next == 0) {
+    proc_last = proc->all_prev;
+  } else {
+    proc->all_next->all_prev = proc->all_prev;
+  }
+
   proc_nprocs--;
   proc->state = PROC_FREE;
   queue_add(&proc_free, proc);
@@ -198,11 +274,7 @@ static void proc_release(struct process *proc) {
  */
 static void proc_to_runqueue(struct process *p) {
   assert(p->state == PROC_RUNNABLE);
-#ifdef HW_MLFQ
-  queue_add(&proc_runnable_mlfq[p->priority_level], p);
-#else
-  queue_add(&proc_runnable, p);
-#endif
+  proc_sched->enqueue(p, false);
 }
 
 /* Find a process by process id.
@@ -210,19 +282,123 @@ static void proc_to_runqueue(struct process *p) {
 struct process *proc_find(gpid_t pid) {
   struct process *p;
 
-  for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-    if (p->state != PROC_FREE && p->pid == pid) {
+  for (p = proc_hash[pid % PROC_HASH_SIZE]; p != 0; p = p->hash_next) {
+    if (p->pid == pid) {
       return p;
     }
   }
   return 0;
 }
 
+/* Return the page table entry of the given page of process p, or 0 if
+ * its leaf has not been allocated (in which case the page is PI_UNINIT).
+ */
+static struct page_info *proc_page_lookup(struct process *p,
+                                          unsigned int page) {
+  struct page_info *leaf = p->pages[page / PT_LEAF_PAGES];
+
+  return leaf == 0 ? 0 : &leaf[page % PT_LEAF_PAGES];
+}
+
+/* Return the page table entry of the given page of process p, allocating
+ * its leaf if necessary.
+ */
+static struct page_info *proc_page(struct process *p, unsigned int page) {
+  struct page_info **leaf = &p->pages[page / PT_LEAF_PAGES];
+
+  if (*leaf == 0) {
+    *leaf = m_alloc(PT_LEAF_PAGES * sizeof(**leaf));
+    memset(*leaf, 0, PT_LEAF_PAGES * sizeof(**leaf)); // all PI_UNINIT
+  }
+  return &(*leaf)[page % PT_LEAF_PAGES];
+}
+
+/* Put process p at position i in the alarm heap.
+ */
+static void alarm_place(unsigned int i, struct process *p) {
+  proc_alarms[i] = p;
+  p->alarm_index = i;
+}
+
+/* Move the process at position i in the alarm heap up or down to where
+ * it belongs.
+ */
+static void alarm_sift(unsigned int i) {
+  struct process *p = proc_alarms[i];
+
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (proc_alarms[parent]->exptime <= p->exptime) {
+      break;
+    }
+    alarm_place(i, proc_alarms[parent]);
+    i = parent;
+  }
+  for (;;) {
+    unsigned int child = 2 * i + 1;
+    if (child >= proc_nalarms) {
+      break;
+    }
+    if (child + 1 < proc_nalarms &&
+        proc_alarms[child + 1]->exptime < proc_alarms[child]->exptime) {
+      child++;
+    }
+    if (proc_alarms[child]->exptime >= p->exptime) {
+      break;
+    }
+    alarm_place(i, proc_alarms[child]);
+    i = child;
+  }
+  alarm_place(i, p);
+}
+
+/* Set an alarm for process p at p->exptime.
+ */
+static void alarm_add(struct process *p) {
+  assert(!p->alarm_set);
+  p->alarm_set = true;
+  proc_alarms[proc_nalarms] = p;
+  alarm_sift(proc_nalarms++);
+}
+
+/* Cancel the alarm of process p.
+ */
+static void alarm_cancel(struct process *p) {
+  unsigned int i = p->alarm_index;
+
+  assert(p->alarm_set && proc_alarms[i] == p);
+  p->alarm_set = false;
+  struct process *last = proc_alarms[--proc_nalarms];
+  if (i < proc_nalarms) {
+    proc_alarms[i] = last;
+    alarm_sift(i);
+  }
+}
+
+/* Process p stops waiting.  Cancel its alarm, if any, and take it off
+ * the list of clients of the server it was waiting for, if any.
+ */
+static void proc_unwait(struct process *p) {
+  if (p->alarm_set) {
+    alarm_cancel(p);
+  }
+  if (p->client_pprev != 0) {
+    *p->client_pprev = p->client_next;
+    if (p->client_next != 0) {
+      p->client_next->client_pprev = p->client_pprev;
+    }
+    p->client_next = 0;
+    p->client_pprev = 0;
+  }
+}
+
 /* Current process wants to wait for a message on a particular queue
- * that it owns.
+ * that it owns.  Rather than copying the message, its contents buffer
+ * is returned in *pcontents and must be released with m_free().
  */
-bool proc_recv(enum msg_type mtype, unsigned int max_time, void *contents,
-               unsigned int *psize, gpid_t *psrc, unsigned int *puid) {
+bool proc_recv_buf(enum msg_type mtype, unsigned int max_time,
+                   void **pcontents, unsigned int *psize, gpid_t *psrc,
+                   unsigned int *puid) {
   assert(proc_current->state == PROC_RUNNABLE);
   struct msg_queue *mq = &proc_current->mboxes[mtype];
   assert(!mq->waiting);
@@ -237,7 +413,22 @@ bool proc_recv(enum msg_type mtype, unsigned int max_time, void *contents,
     proc_nrunnable--;
     if (max_time != 0) {
       proc_current->exptime = sys_gettime() + max_time;
-      proc_current->alarm_set = true;
+      alarm_add(proc_current);
+    }
+
+    /* If waiting for a response, get on the server's list of clients
+     * so the wait can be failed if the server dies.
+     */
+    struct process *server;
+    if (mtype == MSG_REPLY &&
+        (server = proc_find(proc_current->server)) != 0 &&
+        server->state != PROC_ZOMBIE) {
+      proc_current->client_next = server->clients;
+      proc_current->client_pprev = &server->clients;
+      if (server->clients != 0) {
+        server->clients->client_pprev = &proc_current->client_next;
+      }
+      server->clients = proc_current;
     }
     proc_yield();
     assert(!mq->waiting);
@@ -255,37 +446,65 @@ bool proc_recv(enum msg_type mtype, unsigned int max_time, void *contents,
     return false;
   }
 
-  /* Copy the message to the recipient.
+  /* Hand the message to the recipient.
    */
-  if (msg->size < *psize) {
-    *psize = msg->size;
-  }
-  memcpy(contents, msg->contents, *psize);
+  *pcontents = msg->contents;
+  *psize = msg->size;
   if (psrc != 0) {
     *psrc = msg->src;
   }
   if (puid != 0) {
     *puid = msg->uid;
   }
-  m_free(msg->contents);
   m_free(msg);
   return true;
 }
 
+/* Like proc_recv_buf(), but copy the message into the given buffer.
+ */
+bool proc_recv(enum msg_type mtype, unsigned int max_time, void *contents,
+               unsigned int *psize, gpid_t *psrc, unsigned int *puid) {
+  void *buf;
+  unsigned int size;
+
+  if (!proc_recv_buf(mtype, max_time, &buf, &size, psrc, puid)) {
+    return false;
+  }
+  if (size < *psize) {
+    *psize = size;
+  }
+  memcpy(contents, buf, *psize);
+  m_free(buf);
+  return true;
+}
+
 /* Send a message of the given type to the given process.  This routine
  * may be called from an interrupt handler, and so proc_current is not
  * necessarily the source of the message.
  */
 bool proc_send(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
                enum msg_type mtype, const void *contents, unsigned int size) {
+  void *buf = m_alloc(size);
+  memcpy(buf, contents, size);
+  return proc_send_buf(src_pid, src_uid, dst_pid, mtype, buf, size);
+}
+
+/* Like proc_send(), but the message contents are not copied.  Instead,
+ * the m_alloc'd buffer is handed to the destination (or released if the
+ * message cannot be delivered).
+ */
+bool proc_send_buf(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
+                   enum msg_type mtype, void *contents, unsigned int size) {
   /* See who the destination process is.
    */
   struct process *dst = proc_find(dst_pid);
   if (dst == 0) {
     printf("proc_send %u: unknown destination %u\n\r", src_pid, dst_pid);
+    m_free(contents);
     return false;
   }
   if (dst->state == PROC_ZOMBIE) {
+    m_free(contents);
     return false;
   }
 
@@ -297,17 +516,15 @@ bool proc_send(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
     if (dst->state != PROC_WAITING || !mq->waiting || dst->server != src_pid) {
       printf("%u: dst %u (%u) not waiting for reply (%u %u %u)\n", src_pid,
              dst_pid, dst->pid, dst->state, mq->waiting, dst->server);
+      m_free(contents);
       return false;
     }
   }
 
-  /* Copy the message.
-   */
   struct message *msg = new_alloc(struct message);
   msg->src = src_pid;
   msg->uid = src_uid;
-  msg->contents = m_alloc(size);
-  memcpy(msg->contents, contents, size);
+  msg->contents = contents;
   msg->size = size;
 
   /* Add the message to the message queue.
@@ -320,20 +537,14 @@ bool proc_send(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
     assert(dst->state == PROC_WAITING);
     dst->state = PROC_RUNNABLE;
     proc_nrunnable++;
-    dst->alarm_set = false;
+    proc_unwait(dst);
 
     /* dst == proc_current is possible if the process is waiting for
      * input.  In that case it shouldn't be put on the runnable queue
      * because it will automatically resume from earth.intr.suspend().
      */
     if (dst != proc_current) {
-#ifdef HW_MLFQ
-      if (dst->priority_level > 0) {
-        dst->priority_level -= 1;
-      }
-#endif
-
-      proc_to_runqueue(dst);
+      proc_sched->enqueue(dst, true);
     }
     mq->waiting = false;
   }
@@ -347,7 +558,7 @@ static void proc_wakeup(struct process *p) {
   assert(p->state == PROC_WAITING);
   p->state = PROC_RUNNABLE;
   proc_nrunnable++;
-  p->alarm_set = false;
+  proc_unwait(p);
   if (p != proc_current) {
     proc_to_runqueue(p);
   }
@@ -357,6 +568,92 @@ static void proc_wakeup(struct process *p) {
   }
 }
 
+/* Take a text page off the LRU list.
+ */
+static void text_lru_remove(struct text_page *tp) {
+  if (tp->lru_prev == 0) {
+    text_lru_first = tp->lru_next;
+  } else {
+    tp->lru_prev->lru_next = tp->lru_next;
+  }
+  if (tp->lru_next == 0) {
+    text_lru_last = tp->lru_prev;
+  } else {
+    tp->lru_next->lru_prev = tp->lru_prev;
+  }
+  tp->lru_prev = tp->lru_next = 0;
+}
+
+/* A process stops using a text page.
+ */
+static void text_release(struct text_page *tp) {
+  assert(tp->refcnt > 0);
+  if (--tp->refcnt == 0) {
+    tp->lru_next = 0;
+    tp->lru_prev = text_lru_last;
+    if (text_lru_last == 0) {
+      text_lru_first = tp;
+    } else {
+      text_lru_last->lru_next = tp;
+    }
+    text_lru_last = tp;
+  }
+}
+
+/* Drop the least recently used text page that is not in use and return
+ * its frame, or return -1 if there is no such page.
+ */
+static int text_reclaim(void) {
+  struct text_page *tp = text_lru_first, **ptp;
+
+  if (tp == 0) {
+    return -1;
+  }
+  text_lru_remove(tp);
+  ptp = &text_hash[(tp->server * 31 + tp->file_no + tp->page) % TEXT_HASH_SIZE];
+  while (*ptp != tp) {
+    ptp = &(*ptp)->next;
+  }
+  *ptp = tp->next;
+
+  unsigned int frame = tp->frame;
+  proc_frameinfo[frame].text = 0;
+  m_free(tp);
+  return frame;
+}
+
+/* Put a frame back on the free list, along with its copy on the paging
+ * device if any.
+ */
+static void proc_frame_release(unsigned int frame) {
+  struct frame_info *fi = &proc_frameinfo[frame];
+
+  if (fi->block >= 0) {
+    queue_add_uint(&proc_freeslots, fi->block);
+  }
+  memset(fi, 0, sizeof(*fi));
+  fi->block = -1;
+  queue_add_uint(&proc_freeframes, frame);
+}
+
+/* A page stops using a frame.  Shared frames are released only when
+ * the last page that uses them goes away.
+ */
+static void proc_page_release(unsigned int frame) {
+  struct frame_info *fi = &proc_frameinfo[frame];
+
+  if (fi->text != 0) {
+    text_release(fi->text);
+  } else if (fi->owner != 0) {
+    proc_frame_release(frame);
+  } else {
+    assert(fi->refcnt > 0);
+    if (--fi->refcnt == 0) {
+      proc_frame_release(frame);
+    }
+  }
+}
+
 /* All processes come here when they die.  The process may still executing on
  * its kernel stack, but we can clean up most everything else, and also notify
  * the owner of the process.
@@ -375,6 +672,9 @@ void proc_term(struct process *proc, int status) {
   if (proc->state == PROC_RUNNABLE) {
     proc_nrunnable--;
   }
+  if (proc->state == PROC_WAITING) {
+    proc_unwait(proc);
+  }
 
   /* See if the owner is still around.
    */
@@ -398,29 +698,50 @@ void proc_term(struct process *proc, int status) {
      * their rpcs.
      */
     struct process *p;
-    for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-      if (p->state == PROC_WAITING && p->mboxes[MSG_REPLY].waiting &&
-          p->server == proc->pid) {
-        printf("Process %u waiting for reply from %u\n\r", p->pid, proc->pid);
-        proc_wakeup(p);
+    while ((p = proc->clients) != 0) {
+      assert(p->state == PROC_WAITING && p->mboxes[MSG_REPLY].waiting &&
+             p->server == proc->pid);
+      printf("Process %u waiting for reply from %u\n\r", p->pid, proc->pid);
+      proc_wakeup(p);
+    }
+  }
+
+  /* Release any allocated frames, and the page table.
+   */
+  for (unsigned int l = 0; l < PT_LEAVES; l++) {
+    struct page_info *leaf = proc->pages[l];
+    if (leaf == 0) {
+      continue;
+    }
+    for (unsigned int j = 0; j < PT_LEAF_PAGES; j++) {
+      switch (leaf[j].status) {
+      case PI_UNINIT:
+        break;
+      case PI_VALID:
+        earth.log.p("proc_term: pid=%u: release frame=%u (page=%u)",
+                    proc->pid, leaf[j].u.frame, l * PT_LEAF_PAGES + j);
+        proc_page_release(leaf[j].u.frame);
+        break;
+      case PI_ONDISK:
+        queue_add_uint(&proc_freeslots, leaf[j].u.block);
+        break;
+      default:
+        assert(0);
       }
     }
+    proc->pages[l] = 0;
+    m_free(leaf);
   }
 
-  /* Release any allocated frames.
+  /* Its TLB entries may refer to released frames.
    */
-  for (unsigned int i = 0; i < VIRT_PAGES; i++) {
-    switch (proc->pages[i].status) {
-    case PI_UNINIT:
-      break;
-    case PI_VALID:
-      earth.log.p("proc_term: pid=%u: release frame=%u (page=%u)", proc->pid,
-                  proc->pages[i].u.frame, i);
-      earth.tlb.unmap(VIRT_BASE / PAGESIZE + i);
-      queue_add_uint(&proc_freeframes, proc->pages[i].u.frame);
-      break;
-    default:
-      assert(0);
+  earth.tlb.flush_asid(proc->pid, false);
+
+  /* The process may have died while paging a frame in or out.
+   */
+  for (unsigned int f = 0; f < PHYS_FRAMES; f++) {
+    if (proc_frameinfo[f].io_proc == proc) {
+      proc_frame_release(f);
     }
   }
 }
@@ -467,8 +788,10 @@ void proc_kill(gpid_t killer, gpid_t pid, int status) {
   /* If pid == 0, kill all interruptable processes.
    */
   if (pid == 0) {
-    for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-      if (p->state != PROC_FREE && p->interruptable) {
+    struct process *next;
+    for (p = proc_first; p != 0; p = next) {
+      next = p->all_next;
+      if (p->interruptable) {
         proc_zap(k, p, status);
       }
     }
@@ -491,6 +814,56 @@ void proc_kill(gpid_t killer, gpid_t pid, int status) {
   }
 }
 
+/* Switch to the scheduling class with the given name, moving the
+ * processes on the run queue over.  Returns false if there is no such
+ * class.
+ */
+bool proc_set_policy(const char *name) {
+  struct sched_class *sched = sched_find(name);
+  struct process *p;
+
+  if (sched == 0) {
+    return false;
+  }
+  if (sched == proc_sched) {
+    return true;
+  }
+  sched->init();
+  for (p = proc_first; p != 0; p = p->all_next) {
+    if (p->queued) {
+      proc_sched->dequeue(p);
+      p->sched_key = 0;
+      sched->enqueue(p, true);
+    } else {
+      p->sched_key = 0;
+    }
+  }
+  proc_sched = sched;
+  return true;
+}
+
+/* Set the scheduling parameters of process pid: its weight (0 for the
+ * default) and its period in milliseconds (0 for none).  If it is on the
+ * run queue, it is put back so the new parameters take effect at once.
+ */
+bool proc_set_sched(gpid_t pid, unsigned int weight, unsigned int period) {
+  struct process *p = proc_find(pid);
+
+  if (p == 0) {
+    return false;
+  }
+  bool queued = p->queued;
+  if (queued) {
+    proc_sched->dequeue(p);
+  }
+  p->weight = weight == 0 ? SCHED_WEIGHT : weight;
+  p->period = period;
+  if (queued) {
+    proc_sched->enqueue(p, true);
+  }
+  return true;
+}
+
 /* Entry point of new processes.  It is invoked from ctx_start().
  */
 void ctx_entry(void) {
@@ -506,7 +879,7 @@ void ctx_entry(void) {
 /* Right after a context switch we need to do some administration.
  *	- clean up the previous process if it's a zombie
  *	- update proc_current
- *	- flush the TLB
+ *	- switch the TLB to its address space
  */
 static void proc_after_switch() {
   assert(proc_next != proc_current);
@@ -518,13 +891,11 @@ static void proc_after_switch() {
     proc_release(proc_current);
   }
 
-  /* Flush the TLB
-   */
-  earth.tlb.flush();
-
-  /* Update the proc_current pointer.
+  /* Update the proc_current pointer.  The process id serves as the
+   * address space identifier in the TLB.
    */
   proc_current = proc_next;
+  earth.tlb.set_asid(proc_current->pid);
   earth.log.p("proc_after_switch: pid=%u", proc_current->pid);
 }
 
@@ -565,9 +936,22 @@ gpid_t proc_create_uid(gpid_t owner, char *descr, void (*start)(void *),
   proc->start = start;
   proc->arg = arg;
 
-  /* Initialize the signal stack for first use.
+  /* Allocate its kernel stack.  The signal stack is allocated when
+   * (and if) the process goes to user space.
+   */
+  if ((proc->kernelstack = queue_get(&proc_freestacks)) == 0 &&
+      (proc->kernelstack = earth.mem.stack_alloc(KERNEL_STACK_SIZE)) == 0) {
+    printf("proc_create_uid: out of memory\n");
+    proc->state = PROC_ZOMBIE;
+    proc_nrunnable--;
+    proc_release(proc);
+    return 0;
+  }
+
+  /* The kernel stack pointer must be aligned to 16 bytes.
    */
-  sigstk_init(proc);
+  proc->kernel_sp =
+      (address_t)&proc->kernelstack[KERNEL_STACK_SIZE] & ~0xF;
 
   /* Save the process id for the result value.
    */
@@ -632,48 +1016,29 @@ void proc_yield(void) {
       proc_cleanup();
       earth.dev_gate.exit(0);
     }
-    for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-      if (proc_shutting_down && p->state != PROC_FREE) {
+    if (proc_shutting_down) {
+      struct process *next;
+      for (p = proc_first; p != 0; p = next) {
+        next = p->all_next;
         proc_zap(0, p, STAT_SHUTDOWN);
-      } else if (p->state == PROC_WAITING && p->alarm_set) {
-        if (p->exptime <= now) {
-          proc_wakeup(p);
-        }
-        if (p->exptime < next) {
-          next = p->exptime;
-        }
       }
     }
-
-/* See if there are other processes to run.  If so, we're done.
- */
-#ifdef HW_MLFQ
-    int cur_lv = 0;
-    bool do_break = false;
-    while (cur_lv < MLFQ_LEVELS) {
-      while ((proc_next = queue_get(&proc_runnable_mlfq[cur_lv])) != 0) {
-        if (proc_next->state == PROC_RUNNABLE) {
-          do_break = true;
-          break;
-        }
-        assert(proc_next->state == PROC_ZOMBIE);
-        proc_release(proc_next);
-      }
-
-      if (do_break) {
-        break;
-      }
-      cur_lv++;
+    while (proc_nalarms > 0 && (p = proc_alarms[0])->exptime <= now) {
+      proc_wakeup(p);
     }
-#else
-    while ((proc_next = queue_get(&proc_runnable)) != 0) {
+    if (proc_nalarms > 0 && proc_alarms[0]->exptime < next) {
+      next = proc_alarms[0]->exptime;
+    }
+
+    /* See if there are other processes to run.  If so, we're done.
+     */
+    while ((proc_next = proc_sched->pick_next()) != 0) {
       if (proc_next->state == PROC_RUNNABLE) {
         break;
       }
       assert(proc_next->state == PROC_ZOMBIE);
       proc_release(proc_next);
     }
-#endif
 
     /* There should always be at least one process.
      */
@@ -682,9 +1047,6 @@ void proc_yield(void) {
     /* See if we found a suitable process to schedule.
      */
     if (proc_next != 0) {
-      #ifdef HW_MLFQ
-        proc_next->ticks_left = quantums[proc_next->priority_level];
-      #endif
       #ifdef HW_MEASURE
         proc_current->yield_count += 1;
       #endif
@@ -746,61 +1108,421 @@ void proc_yield(void) {
   proc_after_switch();
 }
 
-/* Allocate a (pinned) frame for the given page.
+/* Write the page in the given frame to the paging device, unless there
+ * already is a clean copy there, and take the frame away from its owner.
+ * The frame is owned by the current process during the write.
  */
-static void proc_frame_alloc(unsigned int page) {
-  /* First check to see if there's a frame on the free list.
+static void proc_page_out(unsigned int frame) {
+  struct frame_info *fi = &proc_frameinfo[frame];
+  struct process *p = fi->owner;
+  bool dirty = fi->dirty;
+  int block = fi->block;
+
+  if (block < 0) {
+    unsigned int slot;
+    if (!queue_get_uint(&proc_freeslots, &slot)) {
+      earth.log.panic("proc_page_out: paging device full");
+    }
+    block = slot;
+    dirty = true;
+  }
+
+  earth.log.p("proc_page_out: pid=%u: page=%u frame=%x block=%u dirty=%u",
+              p->pid, fi->page, frame, block, dirty);
+
+  /* The TLB may hold a newer version of the page.
    */
-  unsigned int frame_no;
-  bool success = queue_get_uint(&proc_freeframes, &frame_no);
-  if (success) {
-    earth.log.p("proc_frame_alloc: pid=%u: page=%u assign frame=%x",
-                proc_current->pid, page, frame_no);
-    proc_current->pages[page].status = PI_VALID;
-    proc_current->pages[page].u.frame = frame_no;
-    return;
+  earth.tlb.unmap(p->pid, VIRT_BASE / PAGESIZE + fi->page);
+  struct page_info *pi = proc_page(p, fi->page);
+  pi->status = PI_ONDISK;
+  pi->u.block = block;
+  fi->owner = 0;
+  fi->block = -1;
+  fi->dirty = false;
+  fi->io_proc = proc_current;
+
+  if (dirty) {
+    if (!block_writev(pgdev.server, pgdev.file_no, block * PG_BLOCKS,
+                      proc_frames[frame].contents, PG_BLOCKS)) {
+      earth.log.panic("proc_page_out: write failed");
+    }
+    stats.npage_out++;
+  }
+}
+
+/* Read the given page of the paging device into a frame.
+ */
+static void proc_page_in(unsigned int frame, unsigned int block) {
+  unsigned int nblock = PG_BLOCKS;
+
+  earth.log.p("proc_page_in: pid=%u: frame=%x block=%u", proc_current->pid,
+              frame, block);
+  if (!block_readv(pgdev.server, pgdev.file_no, block * PG_BLOCKS,
+                   proc_frames[frame].contents, &nblock) ||
+      nblock != PG_BLOCKS) {
+    earth.log.panic("proc_page_in: read failed");
+  }
+  stats.npage_in++;
+}
+
+/* Select a frame to evict using the CLOCK algorithm.  Frames that are
+ * in the TLB or have been used since the hand last passed are skipped.
+ * There are no hardware reference bits, so a frame counts as used when
+ * its page is faulted in or accessed by the kernel.
+ */
+static unsigned int proc_frame_evict(void) {
+  for (unsigned int n = 0; n < 2 * PHYS_FRAMES; n++) {
+    unsigned int frame = proc_clock;
+    struct frame_info *fi = &proc_frameinfo[frame];
+
+    proc_clock = (proc_clock + 1) % PHYS_FRAMES;
+    if (fi->owner == 0 || fi->io_proc != 0) {
+      continue;
+    }
+    if (fi->owner == proc_current &&
+        earth.tlb.get_entry(VIRT_BASE / PAGESIZE + fi->page) >= 0) {
+      continue;
+    }
+    if (fi->referenced) {
+      fi->referenced = false;
+      continue;
+    }
+    proc_page_out(frame);
+    return frame;
   }
 
   earth.log.panic("proc_frame_alloc: out of frames");
+  return 0;
+}
+
+/* Allocate a (pinned) frame.  If there are no free frames, reuse the
+ * frame of an unused text page, or else evict a page.  The frame stays
+ * pinned until proc_frame_assign() is called.
+ */
+static unsigned int proc_frame_alloc(void) {
+  unsigned int frame;
+
+  if (!queue_get_uint(&proc_freeframes, &frame)) {
+    int text_frame = text_reclaim();
+    frame = text_frame >= 0 ? (unsigned int)text_frame : proc_frame_evict();
+  }
+  proc_frameinfo[frame].io_proc = proc_current;
+  return frame;
+}
+
+/* Assign an initialized frame to the given page of the current process.
+ * block is the page on the paging device that holds a copy, if any.
+ */
+static void proc_frame_assign(unsigned int frame, unsigned int page, int block) {
+  struct frame_info *fi = &proc_frameinfo[frame];
+
+  earth.log.p("proc_frame_alloc: pid=%u: page=%u assign frame=%x",
+              proc_current->pid, page, frame);
+  struct page_info *pi = proc_page(proc_current, page);
+  pi->status = PI_VALID;
+  pi->u.frame = frame;
+  fi->owner = proc_current;
+  fi->page = page;
+  fi->block = block;
+  fi->referenced = true;
+  fi->dirty = block < 0;
+  fi->io_proc = 0;
 }
 
-/* Initialize a newly allocated frame.  See if it's in the executable.
+/* See if the given page of the executable of the current process can be
+ * shared, which is the case if it is only in read-only segments.
  */
-static void frame_init(struct frame *frame, unsigned int abs_page) {
+static bool text_shareable(unsigned int abs_page) {
   struct process *p = proc_current;
+  unsigned int nsegs = p->hdr.eh.eh_nsegments;
+  bool found = false;
 
+  if (!p->exec_shared) {
+    return false;
+  }
+  if (nsegs > MAX_SEGMENTS) {
+    nsegs = MAX_SEGMENTS;
+  }
+  for (unsigned int i = 0; i < nsegs; i++) {
+    struct exec_segment *es = &p->hdr.es[i];
+    if (es->es_first <= abs_page && abs_page < es->es_first + es->es_npages) {
+      if (es->es_prot & P_WRITE) {
+        return false;
+      }
+      found = true;
+    }
+  }
+  return found;
+}
+
+/* Look up the given page of the executable of the current process in the
+ * text page cache.  Stale versions that are no longer in use are dropped.
+ */
+static struct text_page *text_lookup(unsigned int abs_page) {
+  struct process *p = proc_current;
   struct exec_header *eh = &p->hdr.eh;
-  if (eh->eh_base <= abs_page && abs_page < eh->eh_base + eh->eh_size) {
-    earth.log.p("start read");
-    /* Read the page.
-     */
-    unsigned int size = PAGESIZE;
-    bool success = file_read(
-        p->executable.server, p->executable.file_no,
-        (eh->eh_offset + (abs_page - eh->eh_base)) * PAGESIZE, frame, &size);
-    if (!success) {
-      printf("--> %u %u\n", p->executable.server, p->executable.file_no);
+  unsigned int page = eh->eh_offset + (abs_page - eh->eh_base);
+  struct text_page **ptp, *tp;
+
+  ptp = &text_hash[(p->executable.server * 31 + p->executable.file_no + page) %
+                   TEXT_HASH_SIZE];
+  while ((tp = *ptp) != 0) {
+    if (tp->server == p->executable.server &&
+        tp->file_no == p->executable.file_no && tp->page == page) {
+      if (tp->modtime == p->exec_modtime && tp->size == p->exec_size) {
+        return tp;
+      }
+      if (tp->refcnt == 0) {
+        *ptp = tp->next;
+        text_lru_remove(tp);
+        proc_frameinfo[tp->frame].text = 0;
+        proc_frame_release(tp->frame);
+        m_free(tp);
+        continue;
+      }
     }
-    assert(success);
-    assert(size <= PAGESIZE);
-    if (size < PAGESIZE) {
-      memset((char *)frame + size, 0, PAGESIZE - size);
+    ptp = &tp->next;
+  }
+  return 0;
+}
+
+/* Map a text page into the current process.
+ */
+static void text_map(struct text_page *tp, unsigned int rel_page) {
+  if (tp->refcnt++ == 0) {
+    text_lru_remove(tp);
+  }
+  struct page_info *pi = proc_page(proc_current, rel_page);
+  pi->status = PI_VALID;
+  pi->u.frame = tp->frame;
+}
+
+/* Add an initialized (pinned) frame to the text page cache as the given
+ * page of the executable of the current process, and map it.
+ */
+static void text_insert(unsigned int frame, unsigned int abs_page,
+                        unsigned int rel_page) {
+  struct process *p = proc_current;
+  struct exec_header *eh = &p->hdr.eh;
+  struct text_page *tp = new_alloc(struct text_page);
+
+  tp->server = p->executable.server;
+  tp->file_no = p->executable.file_no;
+  tp->modtime = p->exec_modtime;
+  tp->size = p->exec_size;
+  tp->page = eh->eh_offset + (abs_page - eh->eh_base);
+  tp->frame = frame;
+
+  unsigned int h = (tp->server * 31 + tp->file_no + tp->page) % TEXT_HASH_SIZE;
+  tp->next = text_hash[h];
+  text_hash[h] = tp;
+
+  struct frame_info *fi = &proc_frameinfo[frame];
+  fi->io_proc = 0;
+  fi->text = tp;
+  text_map(tp, rel_page);
+  stats.ntext_miss++;
+}
+
+/* The current process wants to write a shared page.  Give it a private
+ * copy, or simply take the frame over if it is the last copy-on-write
+ * user of it.
+ */
+static void page_unshare(unsigned int rel_page) {
+  struct page_info *pi = proc_page(proc_current, rel_page);
+  unsigned int shared = pi->u.frame;
+  struct frame_info *fi = &proc_frameinfo[shared];
+
+  earth.tlb.unmap(proc_current->pid, VIRT_BASE / PAGESIZE + rel_page);
+  if (fi->text == 0 && fi->refcnt == 1) {
+    fi->owner = proc_current;
+    fi->page = rel_page;
+    fi->refcnt = 0;
+    fi->referenced = true;
+    fi->dirty = true;
+    return;
+  }
+
+  unsigned int frame = proc_frame_alloc();
+  memcpy(proc_frames[frame].contents, proc_frames[shared].contents, PAGESIZE);
+  proc_frame_assign(frame, rel_page, -1);
+  proc_page_release(shared);
+  stats.ncow_copy++;
+}
+
+/* Give the current process (the child) the address space of the given
+ * process (the parent), which must be waiting.  Frames in memory are
+ * shared copy-on-write, so they are only copied when written.  Pages on
+ * the paging device are read in as private pages of the child.  Shared
+ * frames are not evicted.  Returns false if the parent died meanwhile.
+ */
+bool proc_clone(struct process *parent) {
+  struct process *p = proc_current;
+  gpid_t ppid = parent->pid;
+
+  /* The parent's frames must be up to date, and it must no longer have
+   * writable mappings of them.
+   */
+  earth.tlb.flush_asid(ppid, true);
+
+  for (unsigned int i = 0; i < VIRT_PAGES; i++) {
+    unsigned int frame, block;
+    struct frame_info *fi;
+    struct page_info *pi = proc_page_lookup(parent, i), *cpi;
+
+    if (pi == 0) {
+      continue;
+    }
+    switch (pi->status) {
+    case PI_UNINIT:
+      break;
+    case PI_VALID:
+      frame = pi->u.frame;
+      fi = &proc_frameinfo[frame];
+      if (fi->text != 0) {
+        text_map(fi->text, i);
+        break;
+      }
+      if (fi->owner != 0) {
+        fi->owner = 0;
+        fi->refcnt = 1;
+      }
+      fi->refcnt++;
+      cpi = proc_page(p, i);
+      cpi->status = PI_VALID;
+      cpi->u.frame = frame;
+      break;
+    case PI_ONDISK:
+      block = pi->u.block;
+      frame = proc_frame_alloc();
+      proc_page_in(frame, block);
+      proc_frame_assign(frame, i, -1);
+      if (proc_find(ppid) != parent || parent->state != PROC_WAITING) {
+        return false;
+      }
+      break;
+    default:
+      assert(0);
     }
-    earth.log.p("finish read");
   }
+  return true;
+}
+
+/* Fault in a page of the executable, along with the pages that follow
+ * it (fault-around), using a single read request.  The window starts at
+ * PG_CLUSTER_MIN pages and doubles, up to PG_CLUSTER_MAX, each time the
+ * process faults right after the previous window.  Only the faulting
+ * page counts as referenced, so read-ahead pages that are never used
+ * are the first to be evicted.
+ */
+static void exec_fault(unsigned int abs_page) {
+  struct process *p = proc_current;
+  struct exec_header *eh = &p->hdr.eh;
 
-  /* Otherwise zero-init it.
+  if (abs_page == p->ra_next && p->ra_window != 0) {
+    p->ra_window *= 2;
+    if (p->ra_window > PG_CLUSTER_MAX) {
+      p->ra_window = PG_CLUSTER_MAX;
+    }
+  } else {
+    p->ra_window = PG_CLUSTER_MIN;
+  }
+
+  /* Extend the window over pages that haven't been touched yet.
+   */
+  unsigned int base = VIRT_BASE / PAGESIZE, end = eh->eh_base + eh->eh_size;
+  if (end > VIRT_TOP / PAGESIZE) {
+    end = VIRT_TOP / PAGESIZE;
+  }
+  unsigned int n = 1;
+  struct page_info *pi;
+  while (n < p->ra_window && abs_page + n < end &&
+         ((pi = proc_page_lookup(p, abs_page + n - base)) == 0 ||
+          pi->status == PI_UNINIT)) {
+    n++;
+  }
+
+  earth.log.p("start read: page=%x npages=%u", abs_page, n);
+  unsigned int size = n * PAGESIZE;
+  char *buf = m_alloc(size);
+  bool success = file_read(
+      p->executable.server, p->executable.file_no,
+      (eh->eh_offset + (abs_page - eh->eh_base)) * PAGESIZE, buf, &size);
+  if (!success) {
+    printf("--> %u %u\n", p->executable.server, p->executable.file_no);
+  }
+  assert(success);
+  assert(size <= n * PAGESIZE);
+  memset(buf + size, 0, n * PAGESIZE - size);
+  stats.nexec_read++;
+  earth.log.p("finish read");
+
+  /* Allocating frames may block to evict pages, so check again that
+   * each page is still untouched, and that no other process has put it
+   * in the text page cache in the meantime.  The faulting page (i == 0)
+   * goes last: once it is valid, nothing may block before the fault is
+   * done, or the CLOCK could evict it again.
    */
-  else {
+  for (unsigned int k = 1; k <= n; k++) {
+    unsigned int i = k % n;
+    unsigned int rel_page = abs_page + i - base;
+    if (proc_page(p, rel_page)->status != PI_UNINIT) {
+      continue;
+    }
+    bool shareable = text_shareable(abs_page + i);
+    struct text_page *tp;
+    if (shareable && (tp = text_lookup(abs_page + i)) != 0) {
+      text_map(tp, rel_page);
+      stats.ntext_hit++;
+      continue;
+    }
+    unsigned int frame = proc_frame_alloc();
+    if (shareable && (tp = text_lookup(abs_page + i)) != 0) {
+      proc_frame_release(frame);
+      text_map(tp, rel_page);
+      stats.ntext_hit++;
+      continue;
+    }
+    memcpy(proc_frames[frame].contents, buf + i * PAGESIZE, PAGESIZE);
+    if (shareable) {
+      text_insert(frame, abs_page + i, rel_page);
+    } else {
+      proc_frame_assign(frame, rel_page, -1);
+      if (i > 0) {
+        proc_frameinfo[frame].referenced = false;
+      }
+    }
+    stats.nexec_pages++;
+  }
+  m_free(buf);
+  p->ra_next = abs_page + n;
+}
+
+/* Initialize a page that hasn't been accessed before.  See if it's in the
+ * executable.  Otherwise zero-init it.
+ */
+static void page_init(unsigned int rel_page, unsigned int abs_page) {
+  struct exec_header *eh = &proc_current->hdr.eh;
+
+  if (eh->eh_base <= abs_page && abs_page < eh->eh_base + eh->eh_size) {
+    struct text_page *tp;
+    if (text_shareable(abs_page) && (tp = text_lookup(abs_page)) != 0) {
+      text_map(tp, rel_page);
+      stats.ntext_hit++;
+    } else {
+      exec_fault(abs_page);
+    }
+  } else {
     earth.log.p("zero init");
-    memset(frame, 0, PAGESIZE);
+    unsigned int frame = proc_frame_alloc();
+    memset(proc_frames[frame].contents, 0, PAGESIZE);
+    proc_frame_assign(frame, rel_page, -1);
   }
 }
 
 /* Got a page fault at the given virtual address.  Map the page.
  */
 void proc_pagefault(address_t virt, bool update) {
-  static unsigned int tlb_index; // to allocate TLB entries
   struct process *p = proc_current;
 
   assert(p->state == PROC_RUNNABLE);
@@ -821,18 +1543,30 @@ void proc_pagefault(address_t virt, bool update) {
   unsigned int rel_page = (virt - VIRT_BASE) / PAGESIZE;
   unsigned int abs_page = virt / PAGESIZE;
 
-  /* See if the entry is already mapped.
-   */
-  int index = earth.tlb.get_entry(abs_page);
-  earth.log.p("proc_pagefault: fault in page=%x, index=%d", rel_page, index);
+  earth.log.p("proc_pagefault: fault in page=%x", rel_page);
 
-  switch (p->pages[rel_page].status) {
+  /* Bring the page into memory if necessary.  This may block.
+   */
+  struct page_info *pi = proc_page(p, rel_page);
+  unsigned int frame_no, block;
+  switch (pi->status) {
   case PI_UNINIT:
-    assert(index < 0);
-    proc_frame_alloc(rel_page);
-    frame_init(&proc_frames[p->pages[rel_page].u.frame], abs_page);
+    page_init(rel_page, abs_page);
+    break;
+  case PI_ONDISK:
+    block = pi->u.block;
+    frame_no = proc_frame_alloc();
+    proc_page_in(frame_no, block);
+    proc_frame_assign(frame_no, rel_page, block);
     break;
   case PI_VALID:
+    /* Shared pages are mapped read-only, so a fault on one that is
+     * already mapped is a write.  Give the process its own copy.
+     */
+    if (proc_frameinfo[pi->u.frame].owner == 0 &&
+        earth.tlb.get_entry(abs_page) >= 0) {
+      page_unshare(rel_page);
+    }
     break;
   default:
     assert(0);
@@ -840,23 +1574,63 @@ void proc_pagefault(address_t virt, bool update) {
 
   /* Sanity checks.
    */
-  assert(p->pages[rel_page].status == PI_VALID);
-
-  /* See if we need to allocate a new index.
-   */
-  if (index < 0) {
-    index = tlb_index;
-    tlb_index = (tlb_index + 1) % TLB_SIZE;
+  assert(pi->status == PI_VALID);
+  struct frame_info *fi = &proc_frameinfo[pi->u.frame];
+  bool shared = fi->owner == 0;
+  fi->referenced = true;
+  if (update && !shared) {
+    fi->dirty = true;
   }
 
-  /* Map the page to the frame.
+  /* Map the page to the frame.  The TLB picks the entry.
    */
-  struct frame *frame = &proc_frames[p->pages[rel_page].u.frame];
-  if (update) {
-    earth.tlb.map(index, abs_page, frame, P_READ | P_WRITE | P_EXEC);
+  struct frame *frame = &proc_frames[pi->u.frame];
+  if (update && !shared) {
+    earth.tlb.map(abs_page, frame, P_READ | P_WRITE | P_EXEC);
   } else {
-    earth.tlb.map(index, abs_page, frame, P_READ | P_EXEC);
+    earth.tlb.map(abs_page, frame, P_READ | P_EXEC);
+  }
+}
+
+/* Return a kernel address through which the byte at the given user
+ * address can be accessed, valid up to the end of its page.  A page in
+ * the TLB is accessed at its virtual address (made writable if needed).
+ * A page that has a frame but is not mapped is accessed in the frame
+ * directly, saving the copies of mapping it.  Otherwise the page is
+ * faulted in.
+ */
+char *proc_user_addr(address_t virt, bool write) {
+  struct process *p = proc_current;
+
+  if (virt < VIRT_BASE || virt >= VIRT_TOP) {
+    proc_pagefault(virt, write); // terminates the process
+  }
+
+  unsigned int rel_page = (virt - VIRT_BASE) / PAGESIZE;
+  struct page_info *pi = proc_page_lookup(p, rel_page);
+  if (write && pi != 0 && pi->status == PI_VALID &&
+      proc_frameinfo[pi->u.frame].owner == 0) {
+    page_unshare(rel_page);
+  }
+  int index = earth.tlb.get_entry(virt / PAGESIZE);
+  if (index >= 0) {
+    unsigned int prot;
+    earth.tlb.get(index, 0, 0, &prot);
+    if (write && !(prot & P_WRITE)) {
+      proc_pagefault(virt, true);
+    }
+    return (char *)virt;
   }
+  if (pi != 0 && pi->status == PI_VALID) {
+    unsigned int frame = pi->u.frame;
+    proc_frameinfo[frame].referenced = true;
+    if (write) {
+      proc_frameinfo[frame].dirty = true;
+    }
+    return proc_frames[frame].contents + virt % PAGESIZE;
+  }
+  proc_pagefault(virt, write);
+  return (char *)virt;
 }
 
 /* Entry point for all interrupts.
@@ -874,18 +1648,9 @@ void proc_got_interrupt() {
     proc_current->tick_count += 1;
     ema_update(&es, proc_nrunnable);
 #endif
-#ifdef HW_MLFQ
-    proc_current->ticks_left -= 1;
-    if (proc_current->ticks_left == 0) {
-      if (proc_current->priority_level < MLFQ_LEVELS - 1) {
-        proc_current->priority_level += 1;
-      }
-
+    if (proc_sched->tick(proc_current)) {
       proc_yield();
     }
-#else
-    proc_yield();
-#endif
 
     break;
   case INTR_IO:
@@ -909,18 +1674,28 @@ void proc_dump(void) {
   printf("%u processes (current = %u, nrunnable = %u", proc_nprocs,
          proc_current->pid, proc_nrunnable);
 #endif
+  printf(", scheduler = %s", proc_sched->name);
+  printf(", paged in = %u, paged out = %u", stats.npage_in, stats.npage_out);
+  printf(", exec reads = %u (%u pages)", stats.nexec_read, stats.nexec_pages);
+  printf(", text cache hits = %u, misses = %u", stats.ntext_hit,
+         stats.ntext_miss);
+  printf(", cow copies = %u", stats.ncow_copy);
+
+  struct tlb_stats ts;
+  earth.tlb.get_stats(&ts);
+  printf(", tlb hits = %lu/%lu, maps = %lu, evictions = %lu, flushes = %lu, "
+         "remaps = %lu, copied = %lu, dirty faults = %lu, clean = %lu",
+         ts.hits, ts.lookups, ts.maps, ts.evictions, ts.flushes, ts.remaps,
+         ts.bytes_copied, ts.dirty_faults, ts.clean);
   printf("):\n\r");
 
   printf("PID   DESCRIPTION  UID STATUS      RES SWP OWNER ALARM   EXEC\n\r");
-  for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-    if (p->state == PROC_FREE) {
-      continue;
-    }
+  for (p = proc_first; p != 0; p = p->all_next) {
     printf("%4u: %-12.12s %3u ", p->pid, p->descr, p->uid);
-#ifdef HW_MLFQ
-    printf("Priority level: %d ", p->priority_level);
-    printf("Ticks left: %d ", p->ticks_left);
-#endif
+    if (proc_sched == &sched_mlfq) {
+      printf("Priority level: %d ", p->priority_level);
+      printf("Ticks left: %d ", p->ticks_left);
+    }
 
     switch (p->state) {
     case PROC_RUNNABLE:
@@ -950,12 +1725,19 @@ void proc_dump(void) {
 
     unsigned in_mem = 0, on_disk = 0;
     for (unsigned i = 0; i < VIRT_PAGES; i++) {
-      switch (p->pages[i].status) {
+      struct page_info *pi = proc_page_lookup(p, i);
+      if (pi == 0) {
+        continue;
+      }
+      switch (pi->status) {
       case PI_UNINIT:
         break;
       case PI_VALID:
         in_mem++;
         break;
+      case PI_ONDISK:
+        on_disk++;
+        break;
       default:
         assert(0);
       }
@@ -987,37 +1769,47 @@ void proc_initialize(void) {
 
   /* Initialize the TLB.
    */
-  earth.tlb.initialize(TLB_SIZE);
+  earth.tlb.initialize(TLB_SIZE, TLB_WAYS);
 
-  /* Allocate the physical memory.
+  /* Allocate the physical memory.  Earth keeps it in a shared memory
+   * object so the TLB can map frames without copying them.
    */
-  // proc_frames = earth.mem.initialize(PHYS_FRAMES, P_READ | P_WRITE);
-  proc_frames = m_alloc(PHYS_FRAMES * PAGESIZE);
+  proc_frames = earth.mem.initialize(PHYS_FRAMES, P_READ | P_WRITE);
+  if (proc_frames == 0) {
+    proc_frames = m_alloc(PHYS_FRAMES * PAGESIZE);
+  }
+  proc_frameinfo = m_alloc(PHYS_FRAMES * sizeof(*proc_frameinfo));
 
   /* Create a free list of physical frames.
    */
   queue_init(&proc_freeframes);
   for (i = 0; i < PHYS_FRAMES; i++) {
+    memset(&proc_frameinfo[i], 0, sizeof(proc_frameinfo[i]));
+    proc_frameinfo[i].block = -1;
     queue_add_uint(&proc_freeframes, i);
   }
 
-  /* Initialize the free list of processes.
+  /* And a free list of pages on the paging device.
    */
-  queue_init(&proc_free);
-  for (i = 0; i < MAX_PROCS; i++) {
-    proc_set[i].pid = i;
-    queue_add(&proc_free, &proc_set[i]);
+  queue_init(&proc_freeslots);
+  for (i = 0; i < PG_DEV_SIZE; i++) {
+    queue_add_uint(&proc_freeslots, i);
   }
 
-/* Initialize the run queue (aka ready queue).
- */
+  /* Initialize the free lists of processes and kernel stacks.
+   */
+  queue_init(&proc_free);
+  queue_init(&proc_freestacks);
+
+  /* Initialize the run queue (aka ready queue).  The scheduling class
+   * can be changed later with proc_set_policy().
+   */
 #ifdef HW_MLFQ
-  for (i = 0; i < MLFQ_LEVELS; i++) {
-    queue_init(&proc_runnable_mlfq[i]);
-  }
+  proc_sched = &sched_mlfq;
 #else
-  queue_init(&proc_runnable);
+  proc_sched = &sched_fifo;
 #endif
+  proc_sched->init();
 
 #ifdef HW_MEASURE
   ema_init(&es, ALPHA);
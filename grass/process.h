@@ -10,6 +10,11 @@
 #define MAX_SEGMENTS 4
 #define PG_DEV_SIZE 1024 // #pages on paging device
 
+/* The page table has two levels.  Its leaves are allocated on demand.
+ */
+#define PT_LEAF_PAGES 64                       // #pages per leaf
+#define PT_LEAVES (VIRT_PAGES / PT_LEAF_PAGES) // #leaves
+
 // Why does it have to be so large...?
 #define KERNEL_STACK_SIZE (64 * 1024) // size of kernel stack of a process
 
@@ -28,12 +33,16 @@ struct page_info {
   enum {
     PI_UNINIT, // page not yet accessed
     PI_VALID,  // page mapped
+    PI_ONDISK, // page on paging device
   } status;
   union {
     unsigned int frame; // if VALID (in memory)
+    unsigned int block; // if ONDISK (page # on paging device)
   } u;
 };
 
+extern fid_t pgdev; // paging device
+
 /* Message queue definition.
  */
 struct msg_queue {
@@ -44,7 +53,9 @@ struct msg_queue {
 /* One of these per process.
  */
 struct process {
-  gpid_t pid;             // process identifier
+  gpid_t pid;                // process identifier
+  struct process *hash_next; // next in pid hash bucket
+  struct process *all_next, *all_prev; // on list of all processes
   char descr[16];         // for dumps
   void (*start)(void *);  // starting point
   void (*finish)(void *); // ending point
@@ -66,10 +77,16 @@ struct process {
     PROC_ZOMBIE    // dead but not cleaned up
   } state;
 
-#ifdef HW_MLFQ
-  int ticks_left;
-  int priority_level;
-#endif
+  /* Scheduling parameters and state, used by the scheduling classes.
+   */
+  unsigned int weight;      // share of the CPU (stride)
+  unsigned int period;      // relative deadline in msec, or 0 (EDF)
+  bool queued;              // on the run queue
+  unsigned long sched_key;  // pass (stride) or absolute deadline (EDF)
+  unsigned long sched_seq;  // order of arrival among equal keys
+  unsigned int sched_index; // position in the run queue heap
+  int ticks_left;           // until demotion (MLFQ)
+  int priority_level;       // queue level (MLFQ)
 
 #ifdef HW_MEASURE
   int init_time;
@@ -85,14 +102,18 @@ struct process {
    */
   char *msgbuf;
 
-  /* If the process is waiting for a response, this is the server.
+  /* If the process is waiting for a response, this is the server.  While
+   * it waits, it is on the server's list of clients.
    */
   gpid_t server;
+  struct process *client_next, **client_pprev;
+  struct process *clients; // processes waiting for a response from this one
 
   /* If the process is waiting, it may have an alarm set.
    */
-  bool alarm_set;        // see if an alarm has been set
-  unsigned long exptime; // experiration time
+  bool alarm_set;           // see if an alarm has been set
+  unsigned long exptime;    // experiration time
+  unsigned int alarm_index; // position in the alarm heap
 
   bool interruptable; // can be interrupted with <ctrl>C
 
@@ -102,9 +123,10 @@ struct process {
   void *intr_arg;           // argument to last interrupt
   void (*intr_ip)();        // mostly used for debugging if anything
 
-  /* Software page table.
+  /* Software page table.  Leaves that are not allocated contain only
+   * PI_UNINIT pages.
    */
-  struct page_info pages[VIRT_PAGES];
+  struct page_info *pages[PT_LEAVES];
 
   /* id and header of executable.
    */
@@ -114,14 +136,28 @@ struct process {
     struct exec_segment es[MAX_SEGMENTS];
   } hdr;
 
-  /* Signal stack --- only needed for user processes.
+  /* Version of the executable, used to share its read-only pages
+   * through the text page cache.
+   */
+  bool exec_shared;    // read-only pages may be shared
+  time_t exec_modtime; // modification time of the executable
+  unsigned long exec_size;
+
+  /* Read-ahead state for page faults in the executable.
    */
-  char sigstack[SIGNAL_STACK_SIZE];
+  unsigned int ra_next;   // page after the last window read
+  unsigned int ra_window; // current window size (#pages)
+
+  /* Signal stack --- only needed for user processes, so it is allocated
+   * by sigstk_init() when the process first goes to user space.
+   */
+  char *sigstack;
   address_t sig_sp; // saved stack pointer into this stack
 
-  /* Kernel stack.
+  /* Kernel stack, allocated when the process is started.  Stacks are
+   * kept in a pool when processes die.
    */
-  char kernelstack[KERNEL_STACK_SIZE];
+  char *kernelstack;
   address_t kernel_sp;
 
 #ifndef NO_UCONTEXT
@@ -135,6 +171,24 @@ struct process {
  */
 extern struct process *proc_current;
 
+/* A scheduling class keeps a run queue of the processes that are
+ * runnable but not running, and decides which one runs next.  Processes
+ * on the run queue may be killed, so pick_next() can return zombies.
+ */
+#define SCHED_WEIGHT 10 // default weight
+
+struct sched_class {
+  const char *name;
+  void (*init)(void);
+  void (*enqueue)(struct process *p, bool wakeup); // add to the run queue
+  void (*dequeue)(struct process *p);       // remove from the run queue
+  struct process *(*pick_next)(void);       // remove next to run, or 0
+  bool (*tick)(struct process *p);          // clock tick; true to preempt
+};
+
+extern struct sched_class sched_fifo, sched_mlfq, sched_stride, sched_edf;
+struct sched_class *sched_find(const char *name);
+
 gpid_t proc_create(gpid_t owner, char *descr, void (*fun)(void *), void *arg);
 gpid_t proc_create_uid(gpid_t owner, char *descr, void (*fun)(void *),
                        void *arg, unsigned int uid);
@@ -150,8 +204,17 @@ bool proc_recv(enum msg_type mtype, unsigned int max_time, void *contents,
                unsigned int *psize, gpid_t *psrc, unsigned int *puid);
 bool proc_send(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
                enum msg_type mtype, const void *contents, unsigned int size);
+bool proc_recv_buf(enum msg_type mtype, unsigned int max_time,
+                   void **pcontents, unsigned int *psize, gpid_t *psrc,
+                   unsigned int *puid);
+bool proc_send_buf(gpid_t src_pid, unsigned int src_uid, gpid_t dst_pid,
+                   enum msg_type mtype, void *contents, unsigned int size);
 void proc_pagefault(address_t virt, bool update);
+char *proc_user_addr(address_t virt, bool write);
+bool proc_clone(struct process *parent);
 void proc_term(struct process *p, int status);
+bool proc_set_policy(const char *name);
+bool proc_set_sched(gpid_t pid, unsigned int weight, unsigned int period);
 void proc_syscall();
 
 /* copy_user() is a routine used to copy data between kernel and user
@@ -97,26 +97,30 @@ unsigned long sys_gettime(void){
 	return earth.clock.now();
 }
 
-/* Copy between the user's virtual address space and kernel space.
+/* Copy between the user's virtual address space and kernel space.  The
+ * copy is done a page at a time: each user page is looked up once and
+ * then copied with a single memcpy, straight from or to its frame if it
+ * is not mapped.
  */
 void copy_user(char *dst, const char *src, unsigned int size,
 									enum cu_dir dir){
-	/* TODO.  This is really inefficient but for now it does the job.
-	 */
-	unsigned int i;
-	for (i = 0; i < size; i++) {
-		/* First see if the page is mapped already.  If not, simulate
-		 * a page fault.
-		 */
+	while (size > 0) {
 		address_t virt = (address_t) (dir == CU_FROM_USER ? src : dst);
-		if (earth.tlb.get_entry(virt / PAGESIZE) < 0) {
-			earth.log.p("copy_user: pid=%u", proc_current->pid);
-			proc_pagefault(virt, dir == CU_TO_USER);
+		unsigned int n = PAGESIZE - virt % PAGESIZE;
+		if (n > size) {
+			n = size;
 		}
-		*dst++ = *src++;
-	}
-	if (dir == CU_TO_USER) {
-		earth.tlb.sync();
+
+		char *addr = proc_user_addr(virt, dir == CU_TO_USER);
+		if (dir == CU_FROM_USER) {
+			memcpy(dst, addr, n);
+		}
+		else {
+			memcpy(addr, src, n);
+		}
+		dst += n;
+		src += n;
+		size -= n;
 	}
 }
 
@@ -136,56 +140,116 @@ static void ps_print(struct syscall *sc){
 	sc->result = 0;
 }
 
+/* Messages to and from user processes are copied only twice: from the
+ * sender's pages into a kernel buffer, which then becomes the contents
+ * of the message, and from there into the receiver's pages.  While a
+ * buffer is being copied, it is kept in proc_current->msgbuf so that it
+ * is released if the process dies of a bad address.
+ */
+
+/* Copy a message from user space into a new kernel buffer.
+ */
+static char *msg_from_user(const char *data, unsigned int size){
+	char *buf = m_alloc(size);
+	proc_current->msgbuf = buf;
+	copy_user(buf, data, size, CU_FROM_USER);
+	proc_current->msgbuf = 0;
+	return buf;
+}
+
+/* Copy (up to size bytes of) a received message into user space and
+ * release it.  Returns the number of bytes copied.
+ */
+static int msg_to_user(char *data, unsigned int size,
+								char *buf, unsigned int msgsize){
+	if (msgsize < size) {
+		size = msgsize;
+	}
+	proc_current->msgbuf = buf;
+	copy_user(data, buf, size, CU_TO_USER);
+	proc_current->msgbuf = 0;
+	m_free(buf);
+	return size;
+}
+
 /* Kernel code for the sys_recv() system call.
  */
 static void ps_recv(struct syscall *sc){
-	unsigned int size = sc->u.recv.size;
-	proc_current->msgbuf = m_alloc(size);
-	sc->result = sys_recv(sc->u.recv.mtype, sc->u.recv.max_time,
-					proc_current->msgbuf, size, &sc->u.recv.src, &sc->u.recv.uid);
-	if (sc->result > 0) {
-		copy_user(sc->u.recv.data, proc_current->msgbuf, sc->result, CU_TO_USER);
+	enum msg_type mtype = sc->u.recv.mtype;
+	earth.log.p("sys_recv: pid=%u entry mtype=%u size=%u", proc_current->pid, mtype, sc->u.recv.size);
+	if (mtype != MSG_REQUEST && mtype != MSG_EVENT) {
+		earth.log.p("sys_recv: pid=%u: exit error=BadMsgType", proc_current->pid);
+		sc->result = -1;
+		return;
 	}
-	m_free(proc_current->msgbuf);
-	proc_current->msgbuf = 0;
+
+	void *buf;
+	unsigned int size;
+	bool r = proc_recv_buf(mtype, sc->u.recv.max_time, &buf, &size,
+								&sc->u.recv.src, &sc->u.recv.uid);
+	earth.log.p("sys_recv: pid=%u: exit r=%u", proc_current->pid, r);
+	if (!r) {
+		sc->result = -1;
+		return;
+	}
+	sc->result = msg_to_user(sc->u.recv.data, sc->u.recv.size, buf, size);
 }
 
 /* Kernel code for the sys_send() system call.
  */
 static void ps_send(struct syscall *sc){
+	enum msg_type mtype = sc->u.send.mtype;
+	earth.log.p("sys_send: pid=%u: entry dst=%u mtype=%u size=%u", proc_current->pid, sc->u.send.pid, mtype, sc->u.send.size);
+	if (mtype != MSG_REPLY && mtype != MSG_EVENT) {
+		earth.log.p("sys_send: pid=%u: exit error=BadMsgType", proc_current->pid);
+		sc->result = -1;
+		return;
+	}
+
 	unsigned int size = sc->u.send.size;
-	char *buf = m_alloc(size);
-	copy_user(buf, sc->u.send.data, size, CU_FROM_USER);
-	sc->result = sys_send(sc->u.send.pid, sc->u.send.mtype, buf, size);
-	m_free(buf);
+	char *buf = msg_from_user(sc->u.send.data, size);
+	bool r = proc_send_buf(proc_current->pid, proc_current->uid,
+								sc->u.send.pid, mtype, buf, size);
+	earth.log.p("sys_send: pid=%u: exit r=%u", proc_current->pid, r);
+	sc->result = r ? 0 : -1;
 }
 
 /* Kernel code for the sys_rpc() system call.
  */
 static void ps_rpc(struct syscall *sc){
-	/* First copy the request.
-	 */
-	unsigned int reqsize = sc->u.rpc.reqsize;
-	char *request = m_alloc(reqsize);
-	copy_user(request, sc->u.rpc.request, reqsize, CU_FROM_USER);
-
-	/* Allocate reply.
-	 */
-	unsigned int repsize = sc->u.rpc.repsize;
-	char *reply = m_alloc(repsize);
+	gpid_t pid = sc->u.rpc.pid;
+	earth.log.p("sys_rpc: pid=%u: entry dst=%u reqsize=%u repsize=%u", proc_current->pid, pid, sc->u.rpc.reqsize, sc->u.rpc.repsize);
+	if (pid == proc_current->pid) {
+		earth.log.p("sys_rpc: pid=%u: exit error=SendSelf", proc_current->pid);
+		sc->result = -1;
+		return;
+	}
 
-	/* Do the RPC.
+	/* Send the request.
 	 */
-	sc->result = sys_rpc(sc->u.rpc.pid, request, reqsize, reply, repsize);
+	unsigned int reqsize = sc->u.rpc.reqsize;
+	char *request = msg_from_user(sc->u.rpc.request, reqsize);
+	if (!proc_send_buf(proc_current->pid, proc_current->uid, pid,
+								MSG_REQUEST, request, reqsize)) {
+		earth.log.p("sys_rpc: pid=%u: exit error=SendFailed", proc_current->pid);
+		sc->result = -1;
+		return;
+	}
 
-	/* Copy the reply.
+	/* Wait for the reply and copy it out.
 	 */
-	if (sc->result > 0) {
-		copy_user(sc->u.rpc.reply, reply, sc->result, CU_TO_USER);
+	proc_current->server = pid;
+	void *reply;
+	unsigned int repsize;
+	gpid_t src;
+	bool r = proc_recv_buf(MSG_REPLY, 0, &reply, &repsize, &src, 0);
+	earth.log.p("sys_rpc: pid=%u: exit r=%u", proc_current->pid, r);
+	if (!r) {
+		sc->result = -1;
+		return;
 	}
-
-	m_free(reply);
-	m_free(request);
+	assert(src == pid);
+	sc->result = msg_to_user(sc->u.rpc.reply, sc->u.rpc.repsize, reply, repsize);
 }
 
 /* Kernel code for the sys_gettime() system call.
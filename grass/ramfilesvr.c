@@ -13,22 +13,179 @@
 #include <earth/intf.h>
 #include "process.h"
 
-#define MAX_FILES	100
+#define MAX_FILES	(1 << 16)
+#define MIN_FILES	64		// initial size of the file table
 #define BUF_SIZE	1024
+#define RF_FANOUT	(PAGESIZE / sizeof(void *))
+#define MAP_BITS	(8 * sizeof(unsigned long))
 
-/* Contents of a file.
+/* Contents of a file.  The contents are kept in pages, found through a
+ * radix tree.  A tree of height 1 is a single page, and one of height h
+ * is a page of RF_FANOUT pointers to trees of height h - 1.  Missing
+ * pages are holes and read as zeroes.
  */
 struct file {
 	struct file_control_block fcb;
-	char *contents;			// contents of file
+	void *root;				// root of radix tree
+	unsigned int height;	// 0 if there are no pages
 };
 
+/* The file table grows as needed.  A bitmap keeps track of which
+ * entries are in use.
+ */
 struct ramfile_state {
 	gpid_t gate;
 	unsigned long start_time;		// local starting time
-	struct file files[MAX_FILES];
+	struct file *files;
+	unsigned int nfiles;			// size of file table
+	unsigned long *used;			// bitmap of allocated files
+	unsigned int free_hint;			// no free entries in words before this
 };
 
+/* Return the file with the given number if it exists, or null otherwise.
+ */
+static struct file *ramfile_get(struct ramfile_state *rs, unsigned int file_no){
+	if (file_no >= rs->nfiles || !rs->files[file_no].fcb.st_alloc) {
+		return 0;
+	}
+	return &rs->files[file_no];
+}
+
+static void ramfile_set_used(struct ramfile_state *rs, unsigned int file_no, bool used){
+	unsigned long bit = 1UL << (file_no % MAP_BITS);
+
+	if (used) {
+		rs->used[file_no / MAP_BITS] |= bit;
+	}
+	else {
+		rs->used[file_no / MAP_BITS] &= ~bit;
+		if (file_no / MAP_BITS < rs->free_hint) {
+			rs->free_hint = file_no / MAP_BITS;
+		}
+	}
+}
+
+/* Find a free file number, growing the table if it's full.  Returns 0
+ * if there are MAX_FILES files already.
+ */
+static unsigned int ramfile_alloc(struct ramfile_state *rs){
+	unsigned int w, nwords = rs->nfiles / MAP_BITS;
+
+	for (w = rs->free_hint; w < nwords; w++) {
+		if (rs->used[w] != ~0UL) {
+			rs->free_hint = w;
+			return w * MAP_BITS + __builtin_ctzl(~rs->used[w]);
+		}
+	}
+	if (rs->nfiles >= MAX_FILES) {
+		return 0;
+	}
+
+	unsigned int nfiles = 2 * rs->nfiles;
+	rs->files = m_realloc(rs->files, nfiles * sizeof(*rs->files));
+	memset(&rs->files[rs->nfiles], 0, (nfiles - rs->nfiles) * sizeof(*rs->files));
+	rs->used = m_realloc(rs->used, nfiles / MAP_BITS * sizeof(*rs->used));
+	memset(&rs->used[nwords], 0, (nfiles - rs->nfiles) / MAP_BITS * sizeof(*rs->used));
+	rs->nfiles = nfiles;
+	rs->free_hint = nwords;
+	return nwords * MAP_BITS;
+}
+
+/* Number of pages covered by a tree of the given height.
+ */
+static unsigned long rf_span(unsigned int height){
+	unsigned long span = 1;
+
+	while (height-- > 1) {
+		span *= RF_FANOUT;
+	}
+	return span;
+}
+
+/* Find the given page of a file.  If it's not there, allocate a zeroed
+ * page if alloc is set, and return null otherwise.
+ */
+static char *rf_page(struct file *f, unsigned long page, bool alloc){
+	if (f->height == 0 || page >= rf_span(f->height)) {
+		if (!alloc) {
+			return 0;
+		}
+
+		/* Add levels on top until the page is covered.
+		 */
+		if (f->height == 0) {
+			f->height = 1;
+		}
+		while (page >= rf_span(f->height)) {
+			if (f->root != 0) {
+				void **node = m_calloc(RF_FANOUT, sizeof(void *));
+				node[0] = f->root;
+				f->root = node;
+			}
+			f->height++;
+		}
+	}
+
+	void **pnode = &f->root;
+	unsigned int height;
+	for (height = f->height; height > 1; height--) {
+		if (*pnode == 0) {
+			if (!alloc) {
+				return 0;
+			}
+			*pnode = m_calloc(RF_FANOUT, sizeof(void *));
+		}
+		unsigned long span = rf_span(height - 1);
+		pnode = &((void **) *pnode)[page / span];
+		page %= span;
+	}
+	if (*pnode == 0 && alloc) {
+		*pnode = m_calloc(1, PAGESIZE);
+	}
+	return *pnode;
+}
+
+/* Free the pages of a tree of the given height that start at page
+ * 'first' or later, if the first page in the tree is 'start'.
+ */
+static void rf_truncate(void **pnode, unsigned int height,
+						unsigned long start, unsigned long first){
+	if (*pnode == 0) {
+		return;
+	}
+	if (height > 1) {
+		unsigned long span = rf_span(height - 1);
+		unsigned int i;
+		for (i = 0; i < RF_FANOUT; i++) {
+			if (start + (i + 1) * span > first) {
+				rf_truncate(&((void **) *pnode)[i], height - 1, start + i * span, first);
+			}
+		}
+	}
+	if (start >= first) {
+		m_free(*pnode);
+		*pnode = 0;
+	}
+}
+
+/* Change the size of a file, dropping the pages beyond the new size and
+ * zeroing the rest of the last page so that it reads as zeroes if the
+ * file grows again.
+ */
+static void rf_setsize(struct file *f, unsigned long size){
+	if (size < f->fcb.st_size) {
+		rf_truncate(&f->root, f->height, 0, (size + PAGESIZE - 1) / PAGESIZE);
+		if (f->root == 0) {
+			f->height = 0;
+		}
+		char *page = size % PAGESIZE == 0 ? 0 : rf_page(f, size / PAGESIZE, false);
+		if (page != 0) {
+			memset(&page[size % PAGESIZE], 0, PAGESIZE - size % PAGESIZE);
+		}
+	}
+	f->fcb.st_size = size;
+}
+
 static void ramfile_respond(gpid_t src, enum file_status status,
 				void *data, unsigned int size){
 	struct file_reply *rep = new_alloc_ext(struct file_reply, size);
@@ -70,18 +227,14 @@ static bool ramfile_write_allowed(struct file *file, unsigned int uid) {
 static void ramfile_do_create(struct ramfile_state *rs, struct file_request *req, gpid_t src, unsigned int uid){
 	/* See if there's a free file.
 	 */
-	unsigned int file_no;
+	unsigned int file_no = ramfile_alloc(rs);
 
-	for (file_no = 1; file_no < MAX_FILES; file_no++) {
-		if (!rs->files[file_no].fcb.st_alloc) {
-			break;
-		}
-	}
-	if (file_no == MAX_FILES) {
+	if (file_no == 0) {
 		printf("ramfile_do_create: out of files\n\r");
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
 	}
+	ramfile_set_used(rs, file_no, true);
 	rs->files[file_no].fcb.st_alloc = true;
 	rs->files[file_no].fcb.st_dev = sys_getpid();
 	rs->files[file_no].fcb.st_ino = file_no;
@@ -102,15 +255,15 @@ static void ramfile_do_create(struct ramfile_state *rs, struct file_request *req
 /* Respond to a read request.
  */
 static void ramfile_do_read(struct ramfile_state *rs, struct file_request *req, gpid_t src, unsigned int uid){
-	if (!rs->files[req->file_no].fcb.st_alloc || req->file_no >= MAX_FILES) {
+	struct file *file = ramfile_get(rs, req->file_no);
+	unsigned int n;
+
+	if (file == 0) {
 		printf("ramfile_do_read: bad file number: %u\n\r", req->file_no);
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
 	}
 
-	struct file *file = &rs->files[req->file_no];
-	unsigned int n;
-
 	// check permission
 	if (!ramfile_read_allowed(file, uid)) {
 		printf("ramfile_do_read: permission denied: %u\n\r", req->file_no);
@@ -120,6 +273,9 @@ static void ramfile_do_read(struct ramfile_state *rs, struct file_request *req,
 
 	/* Allocate room for the reply.
 	 */
+	if (req->size > FILE_MAX_BULK_SIZE) {
+		req->size = FILE_MAX_BULK_SIZE;
+	}
 	struct file_reply *rep = new_alloc_ext(struct file_reply, req->size);
 
 	// try reading
@@ -128,7 +284,28 @@ static void ramfile_do_read(struct ramfile_state *rs, struct file_request *req,
 		if (n > req->size) {
 			n = req->size;
 		}
-		memcpy(&rep[1], &file->contents[req->offset], n);
+
+		/* Copy a page at a time.
+		 */
+		char *dst = (char *) &rep[1];
+		unsigned long offset = req->offset;
+		unsigned int left = n;
+		while (left > 0) {
+			unsigned int chunk = PAGESIZE - offset % PAGESIZE;
+			if (chunk > left) {
+				chunk = left;
+			}
+			char *page = rf_page(file, offset / PAGESIZE, false);
+			if (page == 0) {
+				memset(dst, 0, chunk);
+			}
+			else {
+				memcpy(dst, &page[offset % PAGESIZE], chunk);
+			}
+			dst += chunk;
+			offset += chunk;
+			left -= chunk;
+		}
 	}
 	else {
 		n = 0;
@@ -147,13 +324,22 @@ static void ramfile_put(struct ramfile_state *rs, unsigned int file_no,
 				unsigned long offset, char *data, unsigned int size){
 	struct file *file = &rs->files[file_no];
 	if (offset + size > file->fcb.st_size) {
-		/* TODO.  Should zero-fill if creating a hole.  Or just not allow
-		 *		  creating holes.
-		 */
-		file->contents = m_realloc(file->contents, offset + size);
 		file->fcb.st_size = offset + size;
 	}
-	memcpy(&file->contents[offset], data, size);
+
+	/* Copy a page at a time.  Pages in holes are left out.
+	 */
+	while (size > 0) {
+		unsigned int chunk = PAGESIZE - offset % PAGESIZE;
+		if (chunk > size) {
+			chunk = size;
+		}
+		char *page = rf_page(file, offset / PAGESIZE, true);
+		memcpy(&page[offset % PAGESIZE], data, chunk);
+		data += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
 	file->fcb.st_modtime = rs->files[0].fcb.st_modtime +
 						(sys_gettime() - rs->start_time) / 1000;
 }
@@ -162,7 +348,7 @@ static void ramfile_put(struct ramfile_state *rs, unsigned int file_no,
  */
 static void ramfile_do_write(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid, void *data, unsigned int size){
-	if (req->file_no >= MAX_FILES || !rs->files[req->file_no].fcb.st_alloc) {
+	if (ramfile_get(rs, req->file_no) == 0) {
 		printf("ramfile_do_write: bad inode %u\n\r", req->file_no);
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
@@ -183,11 +369,22 @@ static void ramfile_do_write(struct ramfile_state *rs, struct file_request *req,
 	ramfile_respond(src, FILE_OK, 0, 0);
 }
 
+/* Tell the client how much data a request may carry.
+ */
+static void ramfile_do_maxmsg(gpid_t src){
+	struct file_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = FILE_OK;
+	rep.op = FILE_MAXMSG;
+	rep.fcb.st_size = FILE_MAX_BULK_SIZE;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
 /* Respond to a stat request.
  */
 static void ramfile_do_stat(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid){
-	if (!rs->files[req->file_no].fcb.st_alloc || req->file_no >= MAX_FILES) {
+	if (ramfile_get(rs, req->file_no) == 0) {
 		printf("ramfile_do_stat: bad inode %u\n\r", req->file_no);
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
@@ -214,7 +411,7 @@ static void ramfile_do_stat(struct ramfile_state *rs, struct file_request *req,
  */
 static void ramfile_do_setsize(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid){
-	if (req->file_no >= MAX_FILES || !rs->files[req->file_no].fcb.st_alloc) {
+	if (ramfile_get(rs, req->file_no) == 0) {
 		printf("ramfile_do_setsize: bad inode %u\n\r", req->file_no);
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
@@ -232,8 +429,7 @@ static void ramfile_do_setsize(struct ramfile_state *rs, struct file_request *re
 	}
 
 	struct file *f = &rs->files[req->file_no];
-	f->fcb.st_size = req->offset;
-	f->contents = m_realloc(f->contents, f->fcb.st_size);
+	rf_setsize(f, req->offset);
 	f->fcb.st_modtime = sys_gettime();
 	ramfile_respond(src, FILE_OK, 0, 0);
 }
@@ -242,7 +438,7 @@ static void ramfile_do_setsize(struct ramfile_state *rs, struct file_request *re
  */
 static void ramfile_do_delete(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid){
-	if (req->file_no >= MAX_FILES || !rs->files[req->file_no].fcb.st_alloc) {
+	if (ramfile_get(rs, req->file_no) == 0) {
 		printf("ramfile_do_delete: bad inode %u\n\r", req->file_no);
 		ramfile_respond(src, FILE_ERROR, 0, 0);
 		return;
@@ -254,10 +450,9 @@ static void ramfile_do_delete(struct ramfile_state *rs, struct file_request *req
 	}
 
 	struct file *f = &rs->files[req->file_no];
+	rf_setsize(f, 0);
 	f->fcb.st_alloc = 0;
-	f->fcb.st_size = 0;
-	m_free(f->contents);
-	f->contents = 0;
+	ramfile_set_used(rs, req->file_no, false);
 	ramfile_respond(src, FILE_OK, 0, 0);
 }
 
@@ -265,7 +460,7 @@ static void ramfile_do_delete(struct ramfile_state *rs, struct file_request *req
  */
 static void ramfile_do_chown(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid) {
-    if (req->file_no >= MAX_FILES || !rs->files[req->file_no].fcb.st_alloc) {
+    if (ramfile_get(rs, req->file_no) == 0) {
         printf("ramfile_do_chown: bad inode: %u\n\r", req->file_no); 
         ramfile_respond(src, FILE_ERROR, 0, 0);
         return;
@@ -290,7 +485,7 @@ static void ramfile_do_chown(struct ramfile_state *rs, struct file_request *req,
  */
 static void ramfile_do_chmod(struct ramfile_state *rs, struct file_request *req,
 			gpid_t src, unsigned int uid) {
-    if (req->file_no >= MAX_FILES || !rs->files[req->file_no].fcb.st_alloc) {
+    if (ramfile_get(rs, req->file_no) == 0) {
         printf("ramfile_do_chown: bad inode: %u\n\r", req->file_no); 
         ramfile_respond(src, FILE_ERROR, 0, 0);
         return;
@@ -317,18 +512,19 @@ static void ramfile_cleanup(void *arg){
 
 	printf("ram file server: cleaning up\n\r");
 
-	for (i = 0; i < MAX_FILES; i++) {
+	for (i = 0; i < rs->nfiles; i++) {
 		struct file *f = &rs->files[i];
 
 		if (f->fcb.st_alloc) {
-			m_free(f->contents);
+			rf_setsize(f, 0);
 		}
 	}
+	m_free(rs->files);
+	m_free(rs->used);
 	m_free(rs);
 }
 
-/* A simple in-memory file server.  All files are simply contiguous
- * memory regions.
+/* A simple in-memory file server.  Files are kept as trees of pages.
  */
 static void ramfile_proc(void *arg){
 	struct ramfile_state *rs = arg;
@@ -341,17 +537,21 @@ static void ramfile_proc(void *arg){
 	bool r = gate_gettime(rs->gate, &gt);
 	assert(r);
 
+	rs->nfiles = MIN_FILES;
+	rs->files = m_calloc(rs->nfiles, sizeof(*rs->files));
+	rs->used = m_calloc(rs->nfiles / MAP_BITS, sizeof(*rs->used));
 	rs->files[0].fcb.st_alloc = true;
 	rs->files[0].fcb.st_modtime = gt.seconds;
+	ramfile_set_used(rs, 0, true);
 	rs->start_time = sys_gettime();
 
 	proc_current->finish = ramfile_cleanup;
 
-	struct file_request *req = new_alloc_ext(struct file_request, PAGESIZE);
+	struct file_request *req = new_alloc_ext(struct file_request, FILE_MAX_BULK_SIZE);
 	for (;;) {
 		gpid_t src;
 		unsigned int uid;
-		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + PAGESIZE, &src, &uid);
+		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + FILE_MAX_BULK_SIZE, &src, &uid);
 		if (req_size < 0) {
 			printf("ram file server shutting down\n\r");
 			m_free(rs);
@@ -385,6 +585,9 @@ static void ramfile_proc(void *arg){
 		case FILE_DELETE:
 			ramfile_do_delete(rs, req, src, uid);
 			break;
+		case FILE_MAXMSG:
+			ramfile_do_maxmsg(src);
+			break;
 		default:
 			printf("ram file server: bad request type: %u\n\r", req->type);
 			ramfile_respond(src, FILE_ERROR, 0, 0);
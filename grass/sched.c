@@ -0,0 +1,297 @@
+/* Scheduling classes.  Each class keeps its own run queue of processes
+ * that are runnable but not running.  proc_yield() asks the current class
+ * for the next process to run, and the clock interrupt asks it whether
+ * the current process should be preempted.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <assert.h>
+#include <earth/earth.h>
+#include <earth/intf.h>
+#include <egos/malloc.h>
+#include <egos/queue.h>
+#include <egos/syscall.h>
+#include <string.h>
+#include "process.h"
+
+#define MLFQ_LEVELS 3       // #levels in MLFQ
+#define STRIDE1 (1UL << 20) // stride of a process with weight 1
+#define NO_DEADLINE ((unsigned long)-1)
+
+/* Remove process p from queue q, keeping the order of the others.
+ */
+static void sched_queue_remove(struct queue *q, struct process *p) {
+  unsigned int n = queue_size(q);
+
+  while (n-- > 0) {
+    struct process *x = queue_get(q);
+    if (x != p) {
+      queue_add(q, x);
+    }
+  }
+}
+
+/* First come, first served, preempting the running process on every
+ * clock tick (round robin).
+ */
+static struct queue fifo_queue;
+
+static void fifo_init(void) { queue_init(&fifo_queue); }
+
+static void fifo_enqueue(struct process *p, bool wakeup) {
+  queue_add(&fifo_queue, p);
+  p->queued = true;
+}
+
+static void fifo_dequeue(struct process *p) {
+  sched_queue_remove(&fifo_queue, p);
+  p->queued = false;
+}
+
+static struct process *fifo_pick_next(void) {
+  struct process *p = queue_get(&fifo_queue);
+
+  if (p != 0) {
+    p->queued = false;
+  }
+  return p;
+}
+
+static bool fifo_tick(struct process *p) { return true; }
+
+struct sched_class sched_fifo = {"fifo",         fifo_init,
+                                 fifo_enqueue,   fifo_dequeue,
+                                 fifo_pick_next, fifo_tick};
+
+/* Multi-level feedback queue.  A process that uses up its quantum moves
+ * down a level, and one that gets woken up by a message moves up one.
+ */
+static struct queue mlfq_queues[MLFQ_LEVELS];
+static int mlfq_quantums[MLFQ_LEVELS] = {10, 20, 30};
+
+static void mlfq_init(void) {
+  for (unsigned int i = 0; i < MLFQ_LEVELS; i++) {
+    queue_init(&mlfq_queues[i]);
+  }
+}
+
+static void mlfq_enqueue(struct process *p, bool wakeup) {
+  if (wakeup && p->priority_level > 0) {
+    p->priority_level -= 1;
+  }
+  queue_add(&mlfq_queues[p->priority_level], p);
+  p->queued = true;
+}
+
+static void mlfq_dequeue(struct process *p) {
+  sched_queue_remove(&mlfq_queues[p->priority_level], p);
+  p->queued = false;
+}
+
+static struct process *mlfq_pick_next(void) {
+  for (unsigned int i = 0; i < MLFQ_LEVELS; i++) {
+    struct process *p = queue_get(&mlfq_queues[i]);
+    if (p != 0) {
+      p->ticks_left = mlfq_quantums[p->priority_level];
+      p->queued = false;
+      return p;
+    }
+  }
+  return 0;
+}
+
+static bool mlfq_tick(struct process *p) {
+  /* A process that started running without being picked (e.g., a new
+   * one) has not been given a quantum yet.
+   */
+  if (p->ticks_left <= 0) {
+    p->ticks_left = mlfq_quantums[p->priority_level];
+  }
+  if (--p->ticks_left > 0) {
+    return false;
+  }
+  if (p->priority_level < MLFQ_LEVELS - 1) {
+    p->priority_level += 1;
+  }
+  return true;
+}
+
+struct sched_class sched_mlfq = {"mlfq",         mlfq_init,
+                                 mlfq_enqueue,   mlfq_dequeue,
+                                 mlfq_pick_next, mlfq_tick};
+
+/* The stride and deadline classes keep their run queue in a binary heap
+ * ordered by sched_key, and by order of arrival among equal keys.
+ */
+struct sched_heap {
+  struct process **procs;
+  unsigned int n, size;
+};
+
+static unsigned long sched_seq; // to order arrivals
+
+static bool heap_before(struct process *a, struct process *b) {
+  return a->sched_key < b->sched_key ||
+         (a->sched_key == b->sched_key && a->sched_seq < b->sched_seq);
+}
+
+static void heap_place(struct sched_heap *h, unsigned int i,
+                       struct process *p) {
+  h->procs[i] = p;
+  p->sched_index = i;
+}
+
+/* Move the process at position i up or down to where it belongs.
+ */
+static void heap_sift(struct sched_heap *h, unsigned int i) {
+  struct process *p = h->procs[i];
+
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (!heap_before(p, h->procs[parent])) {
+      break;
+    }
+    heap_place(h, i, h->procs[parent]);
+    i = parent;
+  }
+  for (;;) {
+    unsigned int child = 2 * i + 1;
+    if (child >= h->n) {
+      break;
+    }
+    if (child + 1 < h->n &&
+        heap_before(h->procs[child + 1], h->procs[child])) {
+      child++;
+    }
+    if (!heap_before(h->procs[child], p)) {
+      break;
+    }
+    heap_place(h, i, h->procs[child]);
+    i = child;
+  }
+  heap_place(h, i, p);
+}
+
+static void heap_add(struct sched_heap *h, struct process *p) {
+  if (h->n == h->size) {
+    h->size = h->size == 0 ? 64 : 2 * h->size;
+    h->procs = m_realloc(h->procs, h->size * sizeof(*h->procs));
+  }
+  p->sched_seq = sched_seq++;
+  p->queued = true;
+  h->procs[h->n] = p;
+  heap_sift(h, h->n++);
+}
+
+static struct process *heap_remove(struct sched_heap *h, unsigned int i) {
+  struct process *p = h->procs[i];
+
+  assert(i < h->n && p->sched_index == i);
+  p->queued = false;
+  struct process *last = h->procs[--h->n];
+  if (i < h->n) {
+    h->procs[i] = last;
+    heap_sift(h, i);
+  }
+  return p;
+}
+
+/* Stride scheduling.  Each process has a pass, and the one with the
+ * lowest pass runs next.  Every time a process is picked, its pass
+ * advances by a stride inversely proportional to its weight, so over
+ * time processes get CPU time in proportion to their weights.  A process
+ * that has been waiting starts at the pass of the last one picked, so
+ * it cannot build up credit while it sleeps.
+ */
+static struct sched_heap stride_heap;
+static unsigned long stride_pass; // pass of the last process picked
+
+static void stride_init(void) {
+  stride_heap.n = 0;
+  stride_pass = 0;
+}
+
+static void stride_enqueue(struct process *p, bool wakeup) {
+  if (p->sched_key < stride_pass) {
+    p->sched_key = stride_pass;
+  }
+  heap_add(&stride_heap, p);
+}
+
+static void stride_dequeue(struct process *p) {
+  (void)heap_remove(&stride_heap, p->sched_index);
+}
+
+static struct process *stride_pick_next(void) {
+  if (stride_heap.n == 0) {
+    return 0;
+  }
+  struct process *p = heap_remove(&stride_heap, 0);
+  stride_pass = p->sched_key;
+  p->sched_key += STRIDE1 / (p->weight == 0 ? SCHED_WEIGHT : p->weight);
+  return p;
+}
+
+static bool stride_tick(struct process *p) { return true; }
+
+struct sched_class sched_stride = {"stride",         stride_init,
+                                   stride_enqueue,   stride_dequeue,
+                                   stride_pick_next, stride_tick};
+
+/* Earliest deadline first.  A process with a period gets a deadline of
+ * that many milliseconds after it is woken up, and the one with the
+ * earliest deadline runs next.  Processes without a period run, in order
+ * of arrival, only when no process with a deadline is runnable.  This is
+ * intended for latency-sensitive servers that do little work per request.
+ */
+static struct sched_heap edf_heap;
+
+static void edf_init(void) { edf_heap.n = 0; }
+
+static void edf_enqueue(struct process *p, bool wakeup) {
+  if (p->period == 0) {
+    p->sched_key = NO_DEADLINE;
+  } else if (wakeup || p->sched_key == 0 || p->sched_key == NO_DEADLINE) {
+    p->sched_key = sys_gettime() + p->period;
+  }
+  heap_add(&edf_heap, p);
+}
+
+static void edf_dequeue(struct process *p) {
+  (void)heap_remove(&edf_heap, p->sched_index);
+}
+
+static struct process *edf_pick_next(void) {
+  if (edf_heap.n == 0) {
+    return 0;
+  }
+  struct process *p = heap_remove(&edf_heap, 0);
+
+  /* If the deadline has passed, the next one is a period later.
+   */
+  unsigned long now = sys_gettime();
+  if (p->period != 0 && p->sched_key <= now) {
+    p->sched_key = now + p->period;
+  }
+  return p;
+}
+
+static bool edf_tick(struct process *p) { return true; }
+
+struct sched_class sched_edf = {"edf",         edf_init,     edf_enqueue,
+                                edf_dequeue,   edf_pick_next, edf_tick};
+
+/* Find a scheduling class by name.
+ */
+struct sched_class *sched_find(const char *name) {
+  static struct sched_class *classes[] = {&sched_fifo, &sched_mlfq,
+                                          &sched_stride, &sched_edf};
+
+  for (unsigned int i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+    if (strcmp(classes[i]->name, name) == 0) {
+      return classes[i];
+    }
+  }
+  return 0;
+}
@@ -18,6 +18,8 @@ static void spawn_respond(gpid_t src, enum spawn_status status, gpid_t pid){
 	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
+static void user_run(void);
+
 /* Run a user process.  The file number for the file is in 'arg'.
 */
 static void user_proc(void *arg){
@@ -38,6 +40,17 @@ static void user_proc(void *arg){
 		sys_exit(-1);
 	}
 
+	/* The version of the executable determines whether its read-only
+	 * pages can be shared with other processes running it.
+	 */
+	struct file_control_block fcb;
+	if (file_stat(proc_current->executable.server,
+						proc_current->executable.file_no, &fcb)) {
+		proc_current->exec_shared = true;
+		proc_current->exec_modtime = fcb.st_modtime;
+		proc_current->exec_size = fcb.st_size;
+	}
+
 /*
 	printf("base = %x\n", proc_current->hdr.eh.eh_base);
 	printf("offset = %u\n", proc_current->hdr.eh.eh_offset);
@@ -63,6 +76,76 @@ static void user_proc(void *arg){
 	 */
 	m_free(req);
 
+	user_run();
+}
+
+/* State passed to a forked process.
+ */
+struct fork_args {
+	gpid_t parent;			// process that forked
+	gpid_t server;			// spawn server
+};
+
+/* Run a copy of a user process that is waiting for the reply to its
+ * SPAWN_FORK request.  The child returns from the request with pid 0;
+ * the parent gets its reply once the child has been set up.
+ */
+static void fork_proc(void *arg){
+	struct fork_args *fa = arg;
+	gpid_t ppid = fa->parent, server = fa->server;
+	m_free(fa);
+
+	struct process *parent = proc_find(ppid);
+	if (parent == 0 || parent->state != PROC_WAITING) {
+		sys_exit(-1);
+	}
+
+	/* Copy the state of the parent, including the signal stack, which
+	 * holds its user context at the time of the request.
+	 */
+	proc_current->interruptable = parent->interruptable;
+	proc_current->executable = parent->executable;
+	proc_current->hdr = parent->hdr;
+	proc_current->exec_shared = parent->exec_shared;
+	proc_current->exec_modtime = parent->exec_modtime;
+	proc_current->exec_size = parent->exec_size;
+	proc_current->user_sp = parent->user_sp;
+	proc_current->intr_type = parent->intr_type;
+	proc_current->intr_arg = parent->intr_arg;
+	proc_current->intr_ip = parent->intr_ip;
+	memcpy(proc_current->descr, parent->descr, sizeof(proc_current->descr));
+	sigstk_init(proc_current);
+	memcpy(proc_current->sigstack, parent->sigstack, SIGNAL_STACK_SIZE);
+	proc_current->sig_sp = parent->sig_sp;
+	if (!proc_clone(parent)) {
+		sys_exit(-1);
+	}
+
+	/* Complete the child's system call as if it got a reply with pid 0,
+	 * and fix its process id in the grass environment.
+	 */
+	struct syscall sc;
+	struct spawn_reply rep;
+	gpid_t self = sys_getpid();
+	copy_user((char *) &sc, proc_current->intr_arg, sizeof(sc), CU_FROM_USER);
+	rep.status = SPAWN_OK;
+	rep.u.pid = 0;
+	sc.result = sc.u.rpc.repsize < sizeof(rep) ? sc.u.rpc.repsize : sizeof(rep);
+	copy_user(sc.u.rpc.reply, (char *) &rep, sc.result, CU_TO_USER);
+	copy_user(proc_current->intr_arg, (char *) &sc, sizeof(sc), CU_TO_USER);
+	copy_user((char *) &GRASS_ENV->self, (char *) &self, sizeof(self), CU_TO_USER);
+
+	/* Now the parent can continue.
+	 */
+	rep.u.pid = self;
+	proc_send(server, 0, ppid, MSG_REPLY, &rep, sizeof(rep));
+
+	user_run();
+}
+
+/* Main loop of a user process.
+ */
+static void user_run(void){
 	/* Main loop of the user process, which basically involves jumping
 	 * back and forth between:
 	 *	a) the kernel stack of the process.
@@ -72,6 +155,9 @@ static void user_proc(void *arg){
 	 * Interrupts are only possible when the process is running on
 	 * the user stack.
 	 */
+	if (proc_current->sigstack == 0) {
+		sigstk_init(proc_current);
+	}
 	for (;;) {
 		earth.log.p("user_proc: pid=%u: to user space", proc_current->pid);
 
@@ -91,11 +177,6 @@ static void user_proc(void *arg){
 
 		earth.log.p("user_proc: pid=%u: to kernel space", proc_current->pid);
 
-		/* Also make sure the modified virtual pages are written back to
-		 * the physical ones.
-		 */
-		earth.tlb.sync();
-
 		/* Handle the interrupt.
 		 */
 		proc_got_interrupt();
@@ -126,6 +207,26 @@ static void spawn_do_exec(struct spawn_request *req, gpid_t src, void *data, uns
 	spawn_respond(src, pid > 0 ? SPAWN_OK : SPAWN_ERROR, pid);
 }
 
+/* Respond to a fork request.  Only user processes can fork.  The reply
+ * is sent by the child once it has been set up.
+ */
+static void spawn_do_fork(struct spawn_request *req, gpid_t src){
+	struct process *p = proc_find(src);
+	if (p == 0 || p->executable.server == 0) {
+		spawn_respond(src, SPAWN_ERROR, 0);
+		return;
+	}
+
+	struct fork_args *fa = new_alloc(struct fork_args);
+	fa->parent = src;
+	fa->server = sys_getpid();
+	gpid_t pid = proc_create_uid(src, "user", fork_proc, fa, p->uid);
+	if (pid == 0) {
+		m_free(fa);
+		spawn_respond(src, SPAWN_ERROR, 0);
+	}
+}
+
 /* Respond to a kill request.
  */
 static void spawn_do_kill(struct spawn_request *req, gpid_t src){
@@ -168,6 +269,38 @@ static void spawn_do_set_descr(struct spawn_request *req, gpid_t src,
 	spawn_respond(src, SPAWN_OK, 0);
 }
 
+/* Set the scheduling parameters of a process.  Only allowed for own
+ * processes, unless the requester is the superuser.
+ */
+static void spawn_do_set_sched(struct spawn_request *req, gpid_t src,
+											unsigned int uid){
+	struct process *p = proc_find(req->u.set_sched.pid);
+
+	if (p == 0 || (uid != 0 && uid != p->uid) ||
+			!proc_set_sched(p->pid, req->u.set_sched.weight,
+											req->u.set_sched.period)) {
+		spawn_respond(src, SPAWN_ERROR, 0);
+	}
+	else {
+		spawn_respond(src, SPAWN_OK, p->pid);
+	}
+}
+
+/* Select the scheduling policy by name.  Only the superuser can do this.
+ */
+static void spawn_do_set_policy(struct spawn_request *req, gpid_t src,
+							unsigned int uid, void *data, unsigned int size){
+	char name[16];
+
+	if (uid != 0 || size == 0 || size >= sizeof(name)) {
+		spawn_respond(src, SPAWN_ERROR, 0);
+		return;
+	}
+	memcpy(name, data, size);
+	name[size] = 0;
+	spawn_respond(src, proc_set_policy(name) ? SPAWN_OK : SPAWN_ERROR, 0);
+}
+
 /* The 'spawn' server.
  */
 static void spawn_proc(void *arg){
@@ -176,7 +309,8 @@ static void spawn_proc(void *arg){
 	struct spawn_request *req = new_alloc_ext(struct spawn_request, PAGESIZE);
 	for (;;) {
 		gpid_t src;
-		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src, 0);
+		unsigned int uid;
+		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src, &uid);
 		if (req_size < 0) {
 			printf("spawn server terminating\n\r");
 			m_free(req);
@@ -188,6 +322,9 @@ static void spawn_proc(void *arg){
 		case SPAWN_EXEC:
 			spawn_do_exec(req, src, req, req_size);
 			break;
+		case SPAWN_FORK:
+			spawn_do_fork(req, src);
+			break;
 		case SPAWN_KILL:
 			spawn_do_kill(req, src);
 			break;
@@ -200,6 +337,12 @@ static void spawn_proc(void *arg){
 		case SPAWN_SET_DESCR:
 			spawn_do_set_descr(req, src, req + 1, req_size - sizeof(*req));
 			break;
+		case SPAWN_SET_SCHED:
+			spawn_do_set_sched(req, src, uid);
+			break;
+		case SPAWN_SET_POLICY:
+			spawn_do_set_policy(req, src, uid, req + 1, req_size - sizeof(*req));
+			break;
 		default:
 			printf("spawn server: bad request type\n\r");
 			spawn_respond(src, SPAWN_ERROR, 0);
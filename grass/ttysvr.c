@@ -220,6 +220,15 @@ static void tty_do_stat(struct tty_state *ts, struct file_request *req, gpid_t s
 	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
+static void tty_do_maxmsg(struct tty_state *ts, struct file_request *req, gpid_t src){
+	struct file_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = FILE_OK;
+	rep.op = FILE_MAXMSG;
+	rep.fcb.st_size = FILE_MAX_MSG_SIZE;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
 static void tty_set_flags(struct tty_state *ts, struct file_request *req, gpid_t src){
 	ts->flags = req->offset;
 	tty_respond(ts, src, FILE_OK, 0, 0);
@@ -269,6 +278,9 @@ static void tty_proc(void *arg){
 		case FILE_SET_FLAGS:
 			tty_set_flags(ts, req, src);
 			break;
+		case FILE_MAXMSG:
+			tty_do_maxmsg(ts, req, src);
+			break;
 		default:
 			printf("tty_proc: unknown command %d, src=%u\n", req->type, src);
 			tty_respond(ts, src, FILE_ERROR, 0, 0);
@@ -1,12 +1,22 @@
 #include <stdbool.h>
 
+/* Flags for dev_disk create().  With DEV_DISK_MMAP, the image is mapped
+ * into memory and accessed with memcpy rather than read/write system calls.
+ * The SEQUENTIAL and RANDOM flags are access pattern hints for the mapping.
+ */
+#define DEV_DISK_SYNC		0x1			// every write goes straight to disk
+#define DEV_DISK_MMAP		0x2			// memory-mapped image
+#define DEV_DISK_SEQUENTIAL	0x4			// madvise(MADV_SEQUENTIAL)
+#define DEV_DISK_RANDOM		0x8			// madvise(MADV_RANDOM)
+
 struct dev_disk_intf {
-	struct dev_disk *(*create)(char *file_name, unsigned int nblocks, bool sync);
+	struct dev_disk *(*create)(char *file_name, unsigned int nblocks, unsigned int flags);
 	unsigned int (*getsize)(struct dev_disk *dd);
-	void (*write)(struct dev_disk *dd, unsigned int offset, const char *data,
-					void (*completion)(void *arg, bool success), void *arg);
-	void (*read)(struct dev_disk *dd, unsigned int offset, char *data,
-					void (*completion)(void *arg, bool success), void *arg);
+	void (*write)(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+					const char *data, void (*completion)(void *arg, bool success), void *arg);
+	void (*read)(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+					char *data, void (*completion)(void *arg, bool success), void *arg);
+	void (*sync)(struct dev_disk *dd, void (*completion)(void *arg, bool success), void *arg);
 };
 
 void dev_disk_setup(struct dev_disk_intf *ddi);
@@ -1,6 +1,7 @@
 #include <earth/log.h>
 #include <earth/intr.h>
 #include <earth/tlb.h>
+#include <earth/mem.h>
 #include <earth/clock.h>
 #include <earth/devdisk.h>
 #include <earth/devgate.h>
@@ -13,6 +14,7 @@ struct earth_intf {
 	struct log_intf log;
 	struct intr_intf intr;
 	struct tlb_intf tlb;
+	struct mem_intf mem;
 	struct clock_intf clock;
 
 	struct dev_disk_intf dev_disk;
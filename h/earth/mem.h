@@ -0,0 +1,19 @@
+/* Interface to emulated physical memory.
+ *
+ * Physical frames are kept in a shared memory object, so that the TLB can
+ * map a frame directly at a virtual page instead of copying it in and out.
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+struct mem_intf {
+	void *(*initialize)(unsigned int nframes, unsigned int prot);
+	void *(*stack_alloc)(unsigned int size);	// with guard page below
+};
+
+void mem_setup(struct mem_intf *mi);
+
+/* For use by the TLB: find the memory object and offset of a frame.
+ */
+bool mem_lookup(void *phys, int *fd, off_t *offset);
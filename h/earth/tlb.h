@@ -1,16 +1,41 @@
 /* Interface to emulated TLB device.
+ *
+ * The TLB is set-associative and its entries are tagged with an address
+ * space identifier (asid).  Only the entries of the current address space
+ * are accessible, but switching address spaces does not flush the others.
+ * map(), get_entry() and unmap() of the current address space use the
+ * current asid.
  */
 
+#include <stdbool.h>
+
+struct tlb_stats {
+	unsigned long lookups, hits;	// get_entry() calls, and hits
+	unsigned long maps;				// map() calls
+	unsigned long evictions;		// entries replaced to make room
+	unsigned long flushes;			// flush() and flush_asid() calls
+	unsigned long remaps;			// frames mapped without copying
+	unsigned long bytes_copied;		// between virtual pages and frames
+	unsigned long dirty_faults;		// first writes to copied pages
+	unsigned long clean;			// writable pages not copied back
+};
+
 struct tlb_intf {
-	void (*initialize)(unsigned int nentries);
+	void (*initialize)(unsigned int nentries, unsigned int nways);
 	void (*flush)(void);
 	void (*sync)(void);
-	int (*map)(unsigned int tlb_index, page_no virt, void *phys,
-									unsigned int prot);
+	void (*set_asid)(unsigned int asid);
+	int (*map)(page_no virt, void *phys, unsigned int prot);
 	int (*get)(unsigned int tlb_index, page_no *virt,
 									void **phys, unsigned int *prot);
-	void (*unmap)(page_no virt);
+	void (*unmap)(unsigned int asid, page_no virt);
+	void (*flush_asid)(unsigned int asid, bool sync);
 	int (*get_entry)(page_no virt);
+	void (*get_stats)(struct tlb_stats *stats);
 };
 
 void tlb_setup(struct tlb_intf *ti);
+
+/* For use by the interrupt handler.
+ */
+bool tlb_write_fault(void *addr);
@@ -2,8 +2,15 @@
 #define _EGOS_BLOCK_H
 
 #include <stdbool.h>
+#include <earth/earth.h>
 #include <egos/syscall.h>
 
+/* Maximum amount of block data carried by a single BLOCK_READ or
+ * BLOCK_WRITE message.  Larger transfers are split up by the client.
+ */
+#define BLOCK_MAX_MSG_SIZE		(4 * PAGESIZE)
+#define BLOCK_MAX_NBLOCK		(BLOCK_MAX_MSG_SIZE / BLOCK_SIZE)
+
 /* This data structure is actually the header of block request message
  */
 struct block_request {
@@ -19,18 +26,22 @@ struct block_request {
     } type;                         // type of request
     unsigned int ino;               // inode number
     unsigned int offset_nblock;     // offset in blocks (not bytes)
+    unsigned int nblock;            // #blocks to read (0 is treated as 1)
 };
 
 /* This data structure is actually the header of block reply message
  */
 struct block_reply {
     enum block_status { BLOCK_OK, BLOCK_ERROR } status;
-    unsigned int size_nblock;       // size of device in case of GETSIZE request
+    unsigned int size_nblock;       // size of device in case of GETSIZE request,
+                                    // #blocks returned in case of READ
 #define br_ninodes	size_nblock		// overloaded for getninodes
 };
 
 bool block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr);
 bool block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr);
+bool block_readv(gpid_t svr, unsigned int ino, unsigned int offset, void *addr, unsigned int *p_nblock);
+bool block_writev(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr, unsigned int nblock);
 bool block_getsize(gpid_t svr, unsigned int ino, unsigned int *psize_nblock);
 bool block_setsize(gpid_t svr, unsigned int ino, unsigned int size_nblock);
 bool block_sync(gpid_t svr, unsigned int ino);
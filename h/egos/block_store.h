@@ -12,7 +12,8 @@
  * A physical disk would typically just have one inode (inode 0), while
  * a virtualized disk may have many.  Each block store module has an
  * 'init' function that returns a block_store_t *.  The block_store_t * is
- * a pointer to a structure that contains the following seven methods:
+ * a pointer to a structure that contains the following seven methods,
+ * plus the two optional multi-block methods described further below:
  *
  *      int getninodes(block_store_t *this_bs)
  *          returns the number of inodes of the block store
@@ -44,6 +45,24 @@
  * All these return -1 upon error (typically after printing the
  * reason for the error).
  *
+ * In addition, a block store module may provide the following methods
+ * to move a run of consecutive blocks in a single call.  They may be null,
+ * so use block_store_readv() and block_store_writev() rather than
+ * calling them directly.  These fall back to calling read or write once
+ * per block if a module does not have a native implementation.
+ *
+ *      int readv(block_store_t *this_bs, unsigned int ino, block_no offset,
+ *												block_no nblocks, block_t *blocks)
+ *          read blocks offset .. offset + nblocks - 1 at the given inode
+ *          number into blocks[0] .. blocks[nblocks - 1]
+ *          returns 0
+ *
+ *      int writev(block_store_t *this_bs, unsigned int ino, block_no offset,
+ *												block_no nblocks, block_t *blocks)
+ *          write blocks[0] .. blocks[nblocks - 1] to blocks
+ *          offset .. offset + nblocks - 1 at the given inode number
+ *          returns 0
+ *
  * A 'block_t' is a block of BLOCK_SIZE bytes.  A block store is an array
  * of blocks.  A 'block_no' holds the index of the block in the block store.
  *
@@ -69,10 +88,26 @@ typedef struct block_store {
     int (*write)(struct block_store *this_bs, unsigned int ino, block_no offset, block_t *block);
     void (*release)(struct block_store *this_bs);
     int (*sync)(struct block_store *this_bs, unsigned int ino);
+    int (*readv)(struct block_store *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+    int (*writev)(struct block_store *this_bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
 } block_store_t;
 
 typedef block_store_t *block_if;			// block store interface
 
+/* Used in block maps to indicate that there is no block (e.g., a hole).
+ */
+#define BLOCK_NONE		((block_no) -1)
+
+/* Multi-block access to any block store (see above).  block_store_readruns()
+ * and block_store_writeruns() take an array that maps each of the nblocks
+ * blocks to a block number of the given inode, coalesce runs of consecutive
+ * block numbers into single readv/writev calls, and skip BLOCK_NONE entries.
+ */
+int block_store_readv(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+int block_store_writev(block_if bs, unsigned int ino, block_no offset, block_no nblocks, block_t *blocks);
+int block_store_readruns(block_if bs, unsigned int ino, const block_no *map, block_no nblocks, block_t *blocks);
+int block_store_writeruns(block_if bs, unsigned int ino, const block_no *map, block_no nblocks, block_t *blocks);
+
 /* Each block store module has an 'init' function that returns a
  * 'block_store_t *' type.  Here are the 'init' functions of various
  * available block store types.
@@ -103,6 +138,7 @@ int unixdisk_create(block_if below, unsigned int below_ino, unsigned int ninodes
 
 int treedisk_check(block_if below);
 void clockdisk_dump_stats(block_if this_bs);
+void fatdisk_dump_stats(block_if this_bs);
 void statdisk_dump_stats(block_if this_bs);
 
 #endif
\ No newline at end of file
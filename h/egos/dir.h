@@ -23,21 +23,31 @@ struct dir_request {
 		DIR_UNUSED,
 		DIR_LOOKUP,
 		DIR_INSERT,
-		DIR_REMOVE
+		DIR_REMOVE,
+		DIR_LOOKUP_PATH,				// resolve a relative path
+		DIR_GENERATION					// only get the generation number
 	} type;	// type of request
 	fid_t dir;							// identifies directory
 	fid_t fid;							// to be inserted
+	bool is_dir;						// LOOKUP_PATH: last one is a directory
 	unsigned int size;					// size of pathname that follows
 };
 
+/* The directory server bumps its generation number whenever a directory
+ * changes, so clients can tell if what they cached may be stale.
+ */
 struct dir_reply {
 	enum dir_status { DIR_OK, DIR_ERROR } status;
 	fid_t fid;							// result of LOOKUP
+	fid_t dir;							// LOOKUP_PATH: parent of fid
+	unsigned long generation;
 };
 
 /* Interface to directory service.
  */
 bool dir_lookup(gpid_t svr, fid_t dir, const char *path, fid_t *pfid);
+bool dir_lookup_path(gpid_t svr, fid_t dir, const char *path, bool is_dir,
+											fid_t *p_dir, fid_t *p_fid);
 bool dir_insert(gpid_t svr, fid_t dir, const char *path, fid_t fid);
 bool dir_remove(gpid_t svr, fid_t dir, const char *path, fid_t fid);
 bool dir_create(gpid_t svr, fid_t dir, const char *path, fid_t *p_fid);
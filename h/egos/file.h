@@ -7,6 +7,12 @@
 
 #define FILE_MAX_MSG_SIZE		PAGESIZE
 
+/* Servers that support bulk transfers accept requests and send replies
+ * carrying up to FILE_MAX_BULK_SIZE bytes of data.  Clients find out with
+ * a FILE_MAXMSG request; other servers take FILE_MAX_MSG_SIZE at most.
+ */
+#define FILE_MAX_BULK_SIZE		(64 * PAGESIZE)
+
 /* Flags.
  */
 #define FILE_ECHO			(1L << 0)
@@ -49,6 +55,7 @@ struct file_request {
 		FILE_SETSIZE,				// size is in field offset
 		FILE_DELETE,
 		FILE_SYNC,
+		FILE_MAXMSG,				// max data size, returned in fcb.st_size
 
 		/* Special commands for tty server.
 		 */
@@ -81,5 +88,6 @@ bool file_setsize(gpid_t svr, unsigned int file_no, unsigned long size);
 bool file_delete(gpid_t svr, unsigned int file_no);
 bool file_set_flags(gpid_t svr, unsigned int file_no, unsigned long flags);
 bool file_sync(gpid_t svr, unsigned int file_no);
+unsigned int file_max_msg(gpid_t svr);
 
 #endif // _EGOS_FILE_H
@@ -12,6 +12,9 @@ struct spawn_request {
 		SPAWN_GETUID,
 		SPAWN_SET_DESCR,
 		SPAWN_SHUTDOWN,
+		SPAWN_FORK,
+		SPAWN_SET_SCHED,
+		SPAWN_SET_POLICY,
 	} type;							// type of request
 
 	union {
@@ -31,6 +34,11 @@ struct spawn_request {
 		struct {
 			gpid_t pid;
 		} getuid;
+		struct {
+			gpid_t pid;
+			unsigned int weight;	// share of the CPU (0 for default)
+			unsigned int period;	// relative deadline in msec (0 for none)
+		} set_sched;
 	} u;
 };
 
@@ -44,10 +52,14 @@ struct spawn_reply {
 
 bool spawn_exec(gpid_t svr, fid_t executable, const char *args, unsigned int size,
 						bool interruptable, unsigned int uid, gpid_t *ppid);
+bool spawn_fork(gpid_t svr, gpid_t *ppid);
 bool spawn_kill(gpid_t svr, gpid_t pid, int status);
 bool spawn_shutdown(gpid_t svr);
 bool spawn_getuid(gpid_t svr, gpid_t pid, unsigned int *p_uid);
 bool spawn_set_descr(gpid_t svr, gpid_t pid, char *descr);
+bool spawn_set_sched(gpid_t svr, gpid_t pid, unsigned int weight,
+											unsigned int period);
+bool spawn_set_policy(gpid_t svr, const char *policy);
 bool spawn_load_args(const struct grass_env *ge_init,
 							int argc, char *const *argv,
 							char **p_argb, unsigned int *p_size);
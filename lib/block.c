@@ -8,66 +8,114 @@
 #include <egos/malloc.h>
 #include <egos/block.h>
 
-bool block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr){
-    /* Prepare request.
-     */
-    struct block_request req;
-    memset(&req, 0, sizeof(req));
-    req.type = BLOCK_READ;
-    req.ino = ino;
-
-    /* Allocate reply. psize in BLOCKs, not bytes
+/* Read up to *p_nblock contiguous blocks starting at the given offset into
+ * addr, using as few RPCs as possible (up to BLOCK_MAX_NBLOCK blocks per
+ * message).  The server may return fewer blocks than asked for, for example
+ * at the end of the inode.  *p_nblock is updated to the number of blocks
+ * actually read.  Returns false if not even the first block could be read.
+ */
+bool block_readv(gpid_t svr, unsigned int ino, unsigned int offset, void *addr, unsigned int *p_nblock){
+    unsigned int nblock = *p_nblock, total = 0;
+
+    /* Allocate reply, large enough for the largest chunk.
      */
-    struct block_reply *reply = (struct block_reply *) malloc(sizeof(*reply) + BLOCK_SIZE);
-    unsigned int reply_size = sizeof(*reply) + BLOCK_SIZE;
-
-    /* Do the RPC.
-     */
-	req.offset_nblock = offset;
-
-	int n = sys_rpc(svr, &req, sizeof(req), reply, reply_size);
-	if (n < (int) reply_size) {
-		free(reply);
-		return false;
-	}
-	if (reply->status != BLOCK_OK) {
-		free(reply);
-		return false;
-	}
-
-	n -= sizeof(*reply);
-	memcpy(addr, &reply[1], BLOCK_SIZE);
+    unsigned int max_nblock = nblock < BLOCK_MAX_NBLOCK ? nblock : BLOCK_MAX_NBLOCK;
+    struct block_reply *reply = (struct block_reply *) malloc(sizeof(*reply) + max_nblock * BLOCK_SIZE);
+
+    while (total < nblock) {
+        /* Prepare request.
+         */
+        struct block_request req;
+        memset(&req, 0, sizeof(req));
+        req.type = BLOCK_READ;
+        req.ino = ino;
+        req.offset_nblock = offset + total;
+        req.nblock = nblock - total;
+        if (req.nblock > max_nblock) {
+            req.nblock = max_nblock;
+        }
+
+        /* Do the RPC.
+         */
+        unsigned int reply_size = sizeof(*reply) + req.nblock * BLOCK_SIZE;
+        int n = sys_rpc(svr, &req, sizeof(req), reply, reply_size);
+        if (n < (int) sizeof(*reply) || reply->status != BLOCK_OK) {
+            break;
+        }
+
+        /* See how many blocks were returned.  Old servers don't fill in
+         * size_nblock, so derive it from the size of the reply instead.
+         */
+        unsigned int got = (n - sizeof(*reply)) / BLOCK_SIZE;
+        if (got > req.nblock) {
+            got = req.nblock;
+        }
+        if (got == 0) {
+            break;
+        }
+        memcpy((char *) addr + total * BLOCK_SIZE, &reply[1], got * BLOCK_SIZE);
+        total += got;
+        if (got < req.nblock) {
+            break;
+        }
+    }
 
     free(reply);
+    if (total == 0 && nblock != 0) {
+        return false;
+    }
+    *p_nblock = total;
     return true;
 }
 
-bool block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr){
-    /* Prepare request.
-     */
+/* Write nblock contiguous blocks starting at the given offset, using up to
+ * BLOCK_MAX_NBLOCK blocks per message.
+ */
+bool block_writev(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr, unsigned int nblock){
+    unsigned int max_nblock = nblock < BLOCK_MAX_NBLOCK ? nblock : BLOCK_MAX_NBLOCK;
     struct block_request *req =
-                (struct block_request *) malloc(sizeof(*req) + BLOCK_SIZE);
-    memset(req, 0, sizeof(*req));
-    req->type = BLOCK_WRITE;
-    req->ino = ino;
-
-	req->offset_nblock = offset + 0;
-	memcpy(&req[1], addr, BLOCK_SIZE);
-
-	/* Do the RPC.
-	 */
-	struct block_reply reply;
-	// printf("BLK_WR %u %u\n", sizeof(*req) + size * BLOCK_SIZE, size);
-	int result = sys_rpc(svr, req, sizeof(*req) + BLOCK_SIZE, &reply, sizeof(reply));
-	if (result < (int) sizeof(reply) || reply.status != BLOCK_OK) {
-		free(req);
-		return false;
-	}
+                (struct block_request *) malloc(sizeof(*req) + max_nblock * BLOCK_SIZE);
+    unsigned int done = 0;
+
+    while (done < nblock) {
+        /* Prepare request.
+         */
+        unsigned int n = nblock - done;
+        if (n > max_nblock) {
+            n = max_nblock;
+        }
+        memset(req, 0, sizeof(*req));
+        req->type = BLOCK_WRITE;
+        req->ino = ino;
+        req->offset_nblock = offset + done;
+        req->nblock = n;
+        memcpy(&req[1], (const char *) addr + done * BLOCK_SIZE, n * BLOCK_SIZE);
+
+        /* Do the RPC.
+         */
+        struct block_reply reply;
+        int result = sys_rpc(svr, req, sizeof(*req) + n * BLOCK_SIZE, &reply, sizeof(reply));
+        if (result < (int) sizeof(reply) || reply.status != BLOCK_OK) {
+            free(req);
+            return false;
+        }
+        done += n;
+    }
 
     free(req);
     return true;
 }
 
+bool block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr){
+    unsigned int nblock = 1;
+
+    return block_readv(svr, ino, offset, addr, &nblock);
+}
+
+bool block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr){
+    return block_writev(svr, ino, offset, addr, 1);
+}
+
 bool block_sync(gpid_t svr, unsigned int ino){
     /* Prepare request.
      */
@@ -8,6 +8,34 @@
 #include <egos/file.h>
 #include <egos/dir.h>
 
+/* Per-process cache of resolved paths.  Each entry remembers the
+ * generation number of the directory server it was looked up under, and
+ * is only used if the server is still at that generation.  Asking for the
+ * generation is a much smaller RPC than resolving the path again.
+ */
+#define DENTRY_CACHE		64
+#define DENTRY_MAX_PATH		128
+
+struct dentry {
+	char path[DENTRY_MAX_PATH];		// empty if unused
+	gpid_t svr;
+	fid_t start;					// directory the path is relative to
+	bool is_dir;
+	fid_t dir, fid;					// result of the lookup
+	unsigned long generation;		// of the server when looked up
+};
+
+static struct dentry dentry_cache[DENTRY_CACHE];
+
+static struct dentry *dentry_slot(gpid_t svr, fid_t start, const char *path, bool is_dir){
+	unsigned int h = svr * 31 + start.server * 17 + start.file_no * 7 + is_dir;
+
+	while (*path != 0) {
+		h = h * 33 + (unsigned char) *path++;
+	}
+	return &dentry_cache[h % DENTRY_CACHE];
+}
+
 /* This is the client code for looking up an inode number.
  */
 bool dir_lookup(gpid_t svr, fid_t dir, const char *name, fid_t *pfid){
@@ -26,13 +54,99 @@ bool dir_lookup(gpid_t svr, fid_t dir, const char *name, fid_t *pfid){
 	struct dir_reply reply;
 	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
 	free(req);
-	if (r != sizeof(reply) || reply.status != DIR_OK) {
+	if (r != sizeof(reply)) {
+		return false;
+	}
+	if (reply.status != DIR_OK) {
 		return false;
 	}
 	*pfid = reply.fid;
 	return true;
 }
 
+/* Get the current generation number of the directory server.
+ */
+static bool dir_get_generation(gpid_t svr, unsigned long *p_generation){
+	struct dir_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = DIR_GENERATION;
+
+	struct dir_reply reply;
+	int r = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (r != sizeof(reply)) {
+		return false;
+	}
+	*p_generation = reply.generation;
+	return true;
+}
+
+/* Look up a path relative to directory dir in one RPC, or just a check
+ * of the generation number if it was looked up before.  Every component but the last names a directory,
+ * and so does the last one if is_dir is set.  The parent of the last
+ * component is returned in *p_dir even if the last one is not found,
+ * but *p_dir->server is 0 if the parent could not be found either.
+ */
+bool dir_lookup_path(gpid_t svr, fid_t dir, const char *path, bool is_dir,
+											fid_t *p_dir, fid_t *p_fid){
+	int n = strlen(path);
+	if (n == 0) {
+		*p_dir = *p_fid = dir;
+		return true;
+	}
+
+	/* See if it's cached.
+	 */
+	struct dentry *d = 0;
+	if (n < DENTRY_MAX_PATH) {
+		d = dentry_slot(svr, dir, path, is_dir);
+		unsigned long generation;
+		if (d->path[0] != 0 && d->svr == svr && fid_eq(d->start, dir)
+					&& d->is_dir == is_dir && strcmp(d->path, path) == 0
+					&& dir_get_generation(svr, &generation)
+					&& generation == d->generation) {
+			*p_dir = d->dir;
+			*p_fid = d->fid;
+			return true;
+		}
+	}
+
+	/* Prepare request.
+	 */
+	struct dir_request *req = malloc(sizeof(*req) + n);
+	memset(req, 0, sizeof(*req));
+	req->type = DIR_LOOKUP_PATH;
+	req->dir = dir;
+	req->is_dir = is_dir;
+	req->size = n;
+	memcpy(req + 1, path, n);
+
+	/* Do the RPC.
+	 */
+	struct dir_reply reply;
+	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
+	free(req);
+	if (r != sizeof(reply)) {
+		*p_dir = fid_val(0, 0);
+		return false;
+	}
+	*p_dir = reply.dir;
+	if (reply.status != DIR_OK) {
+		return false;
+	}
+	*p_fid = reply.fid;
+
+	if (d != 0) {
+		strcpy(d->path, path);
+		d->svr = svr;
+		d->start = dir;
+		d->is_dir = is_dir;
+		d->dir = reply.dir;
+		d->fid = reply.fid;
+		d->generation = reply.generation;
+	}
+	return true;
+}
+
 bool dir_insert(gpid_t svr, fid_t dir, const char *name, fid_t fid){
 	/* Prepare request.
 	 */
@@ -50,10 +164,10 @@ bool dir_insert(gpid_t svr, fid_t dir, const char *name, fid_t fid){
 	struct dir_reply reply;
 	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
 	free(req);
-	if (r != sizeof(reply) || reply.status != DIR_OK) {
+	if (r != sizeof(reply)) {
 		return false;
 	}
-	return true;
+	return reply.status == DIR_OK;
 }
 
 bool dir_remove(gpid_t svr, fid_t dir, const char *name, fid_t fid){
@@ -73,10 +187,10 @@ bool dir_remove(gpid_t svr, fid_t dir, const char *name, fid_t fid){
 	struct dir_reply reply;
 	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
 	free(req);
-	if (r != sizeof(reply) || reply.status != DIR_OK) {
+	if (r != sizeof(reply)) {
 		return false;
 	}
-	return true;
+	return reply.status == DIR_OK;
 }
 
 /* Create a directory.  'svr' is the directory server.  'filesvr' is the
@@ -67,7 +67,54 @@ bool file_chmod(gpid_t svr, unsigned int file_no, gmode_t mode) {
 	return reply.status == FILE_OK;
 }
 
-bool file_read(gpid_t svr, unsigned int file_no, unsigned long offset,
+/* The maximum data sizes of the servers asked so far.
+ */
+#define FILE_MAXMSG_CACHE	8
+
+static struct file_maxmsg {
+	gpid_t svr;
+	unsigned int size;
+} file_maxmsg_cache[FILE_MAXMSG_CACHE];
+static unsigned int file_maxmsg_next;
+
+/* Returns the maximum amount of data that a single read or write request
+ * to server svr can carry.  Servers that don't know FILE_MAXMSG get
+ * FILE_MAX_MSG_SIZE.
+ */
+unsigned int file_max_msg(gpid_t svr){
+	struct file_maxmsg *fm;
+
+	for (fm = file_maxmsg_cache; fm < &file_maxmsg_cache[FILE_MAXMSG_CACHE]; fm++) {
+		if (fm->svr == svr && fm->size != 0) {
+			return fm->size;
+		}
+	}
+
+	/* Prepare request.
+	 */
+	struct file_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = FILE_MAXMSG;
+
+	/* Do the RPC.
+	 */
+	struct file_reply reply;
+	unsigned int size = FILE_MAX_MSG_SIZE;
+	int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (result >= (int) sizeof(reply) && reply.status == FILE_OK &&
+						reply.fcb.st_size > FILE_MAX_MSG_SIZE) {
+		size = reply.fcb.st_size;
+	}
+
+	fm = &file_maxmsg_cache[file_maxmsg_next++ % FILE_MAXMSG_CACHE];
+	fm->svr = svr;
+	fm->size = size;
+	return size;
+}
+
+/* Read at most one message worth of data.
+ */
+static bool file_read_msg(gpid_t svr, unsigned int file_no, unsigned long offset,
 										void *addr, unsigned int *psize){
 	/* Prepare request.
 	 */
@@ -101,7 +148,36 @@ bool file_read(gpid_t svr, unsigned int file_no, unsigned long offset,
 	return true;
 }
 
-bool file_write(gpid_t svr, unsigned int file_no, unsigned long offset,
+/* Read up to *psize bytes, in as few requests as the server allows.  Stops
+ * early on a short read, e.g., at the end of the file.
+ */
+bool file_read(gpid_t svr, unsigned int file_no, unsigned long offset,
+										void *addr, unsigned int *psize){
+	unsigned int total = 0, size = *psize;
+
+	if (size <= FILE_MAX_MSG_SIZE) {
+		return file_read_msg(svr, file_no, offset, addr, psize);
+	}
+
+	unsigned int max = file_max_msg(svr);
+	while (total < size) {
+		unsigned int chunk = size - total < max ? size - total : max;
+		unsigned int n = chunk;
+		if (!file_read_msg(svr, file_no, offset + total, (char *) addr + total, &n)) {
+			return false;
+		}
+		total += n;
+		if (n < chunk) {
+			break;
+		}
+	}
+	*psize = total;
+	return true;
+}
+
+/* Write at most one message worth of data.
+ */
+static bool file_write_msg(gpid_t svr, unsigned int file_no, unsigned long offset,
 										const void *addr, unsigned int size){
 	/* Prepare request.
 	 */
@@ -125,6 +201,25 @@ bool file_write(gpid_t svr, unsigned int file_no, unsigned long offset,
 	return reply.status == FILE_OK;
 }
 
+/* Write size bytes, in as few requests as the server allows.
+ */
+bool file_write(gpid_t svr, unsigned int file_no, unsigned long offset,
+										const void *addr, unsigned int size){
+	if (size <= FILE_MAX_MSG_SIZE) {
+		return file_write_msg(svr, file_no, offset, addr, size);
+	}
+
+	unsigned int max = file_max_msg(svr);
+	for (unsigned int total = 0; total < size;) {
+		unsigned int chunk = size - total < max ? size - total : max;
+		if (!file_write_msg(svr, file_no, offset + total, (const char *) addr + total, chunk)) {
+			return false;
+		}
+		total += chunk;
+	}
+	return true;
+}
+
 bool file_sync(gpid_t svr, unsigned int file_no){
 	/* Prepare request.
 	 */
@@ -41,6 +41,30 @@ bool spawn_exec(gpid_t svr, fid_t executable, const char *argb, unsigned int siz
 	return true;
 }
 
+/* Create a copy of the current (user) process.  *ppid is set to the
+ * process id of the child in the parent, and to 0 in the child.
+ */
+bool spawn_fork(gpid_t svr, gpid_t *ppid){
+	/* Prepare request.
+	 */
+	struct spawn_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = SPAWN_FORK;
+
+	/* Do the RPC.  Both the parent and the child return from it.
+	 */
+	struct spawn_reply reply;
+	int n = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (n < (int) sizeof(reply)) {
+		return false;
+	}
+	if (reply.status != SPAWN_OK) {
+		return false;
+	}
+	*ppid = reply.u.pid;
+	return true;
+}
+
 bool spawn_kill(gpid_t svr, gpid_t pid, int status){
 	/* Prepare request.
 	 */
@@ -122,6 +146,53 @@ bool spawn_getuid(gpid_t svr, gpid_t pid, unsigned int *p_uid){
 	return reply.status == SPAWN_OK;
 }
 
+/* Set the scheduling parameters of process pid: its share of the CPU
+ * (0 for the default) and its relative deadline in milliseconds (0 for
+ * none).  Which of these is used depends on the scheduling policy.
+ */
+bool spawn_set_sched(gpid_t svr, gpid_t pid, unsigned int weight,
+											unsigned int period){
+	/* Prepare request.
+	 */
+	struct spawn_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = SPAWN_SET_SCHED;
+	req.u.set_sched.pid = pid;
+	req.u.set_sched.weight = weight;
+	req.u.set_sched.period = period;
+
+	/* Do the RPC.
+	 */
+	struct spawn_reply reply;
+	int n = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (n < (int) sizeof(reply)) {
+		return false;
+	}
+	return reply.status == SPAWN_OK;
+}
+
+/* Select the scheduling policy ("fifo", "mlfq", "stride", or "edf").
+ */
+bool spawn_set_policy(gpid_t svr, const char *policy){
+	/* Prepare request.
+	 */
+	int len = strlen(policy);
+	struct spawn_request *req = malloc(sizeof(*req) + len);
+	memset(req, 0, sizeof(*req));
+	req->type = SPAWN_SET_POLICY;
+	memcpy(req + 1, policy, len);
+
+	/* Do the RPC.
+	 */
+	struct spawn_reply reply;
+	int n = sys_rpc(svr, req, sizeof(*req) + len, &reply, sizeof(reply));
+	free(req);
+	if (n < (int) sizeof(reply)) {
+		return false;
+	}
+	return reply.status == SPAWN_OK;
+}
+
 /* Create a stack frame for a new process.
  */
 bool spawn_load_args(const struct grass_env *ge_init, int argc, char *const *argv,
@@ -8,6 +8,11 @@
 #include <egos/dir.h>
 #include <egos/memchan.h>
 
+/* Largest read or write passed to the file server in one go when a
+ * transfer bypasses the stream buffers.
+ */
+#define STDIO_MAX_DIRECT	(1U << 30)
+
 FILE *stdin, *stdout, *stderr;
 
 static char *errors[] = {
@@ -86,57 +91,16 @@ bool flookup(const char *restrict path, bool is_dir,
 		dir = GRASS_ENV->cwd;
 	}
 
-	/* Now walk the path until the final component.
+	/* Have the directory server walk the rest of the path.
 	 */
-	bool success = true;
-	fid_t fid = dir;
-	while (*path != 0) {
-		/* See if there's more.
-		 */
-		char *e = strchr(path, '/'), *next;
-		if (e == 0) {
-			if (is_dir) {
-				unsigned int n = strlen(path);
-				next = malloc(n + 5);
-				memcpy(next, path, n);
-				strcpy(&next[n], ".dir");
-			}
-			else {
-				next = (char *) path;
-			}
-		}
-		else {
-			next = malloc((e - path) + 5);
-			memcpy(next, path, e - path);
-			strcpy(&next[e - path], ".dir");
-		}
-
-		/* Take the next step.
-		 */
-		success = dir_lookup(GRASS_ENV->servers[GPID_DIR], dir, next, &fid);
-		if (e != 0 || is_dir) {
-			free(next);
-		}
-		if (e == 0) {
-			if (p_dir != 0) {
-				*p_dir = dir;
-			}
-			if (!success) {
-				return false;
-			}
-			break;
-		}
-
-		/* Go on to the remainder of the path.
-		 */
-		if (!success) {
-			return false;
-		}
-		path = e + 1;
-		dir = fid;
+	fid_t parent, fid;
+	bool success = dir_lookup_path(GRASS_ENV->servers[GPID_DIR], dir, path,
+										is_dir, &parent, &fid);
+	if (p_dir != 0 && parent.server != 0) {
+		*p_dir = parent;
 	}
-	if (p_dir != 0) {
-		*p_dir = dir;
+	if (!success) {
+		return false;
 	}
 	if (p_fid != 0) {
 		*p_fid = fid;
@@ -276,6 +240,36 @@ size_t fread(void *restrict ptr, size_t size, size_t nitems, FILE *restrict stre
 			return total;
 		}
 
+		/* Large reads bypass the buffer and go straight to the caller's
+		 * memory.  A trailing partial item is read again later.
+		 */
+		if (stream->in_size == 0 && nitems * size >= sizeof(stream->in_buf)) {
+			size_t want = nitems * size;
+			if (want > STDIO_MAX_DIRECT) {
+				want = STDIO_MAX_DIRECT / size * size;
+			}
+			unsigned int to_read = want;
+			bool r = file_read(stream->fid.server, stream->fid.file_no,
+								stream->pos, ptr, &to_read);
+			if (!r) {
+				printf("fread: file_read returned an error\n");
+				stream->flags |= _FILE_ERROR;
+				return 0;
+			}
+			if (to_read == 0) {
+				stream->flags |= _FILE_EOF;
+			}
+			if (to_read < want) {
+				short_read = true;
+			}
+			size_t ni = to_read / size;
+			stream->pos += ni * size;
+			ptr = (char *) ptr + ni * size;
+			nitems -= ni;
+			total += ni;
+			continue;
+		}
+
 		/* Move what's in the buffer to the beginning.
 		 */
 		if (buffered > 0 && stream->in_offset > 0) {
@@ -318,6 +312,22 @@ size_t fwrite(const void *restrict ptr, size_t size, size_t nitems, FILE *restri
 	size_t n = size * nitems;
 
 	while (n > 0) {
+		// Write large chunks directly if nothing is buffered
+		if (stream->index == 0 && n >= stream->size) {
+			size_t chunk = n > STDIO_MAX_DIRECT ? STDIO_MAX_DIRECT : n;
+			bool r = file_write(stream->fid.server, stream->fid.file_no,
+								stream->pos, p, chunk);
+			if (!r) {
+				printf("fwrite: file_write failed\n");
+				stream->flags |= _FILE_ERROR;
+				return 0;
+			}
+			stream->pos += chunk;
+			p += chunk;
+			n -= chunk;
+			continue;
+		}
+
 		// First copy as much as possible into the buffer
 		assert(stream->index < stream->size);
 		size_t chunk = n;